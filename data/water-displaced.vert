@@ -0,0 +1,55 @@
+#version 300 es
+
+// As water.vert, but the heights come from a texture rather than
+// from a vertex buffer (for 'rollercoaster scene -gpuTerrain').  The
+// mesh has no vertex attributes at all: x and y come from the
+// vertex's index in its grid (see TerrainVertex in terrain.h).
+
+uniform mat4 MVP;
+uniform mat4 MV;
+uniform sampler2D normalSampler;
+uniform highp sampler2D heightSampler; // R32F, one texel per heightfield texel
+
+uniform int   gridWidth;
+uniform vec2  gridOrigin;
+uniform float gridSpacing;
+uniform vec2  terrainMax;
+
+smooth out mediump vec3 normal_vcs;
+smooth out mediump vec3 position_vcs;
+smooth out mediump vec2 texCoords;
+
+highp float heightAt( ivec2 texel )
+{
+    return texelFetch( heightSampler, clamp( texel, ivec2(0), ivec2(terrainMax) ), 0 ).r;
+}
+
+void main()
+{
+    highp vec2 xy = min( gridOrigin + gridSpacing * vec2( gl_VertexID % gridWidth, gl_VertexID / gridWidth ), terrainMax );
+    ivec2 texel = ivec2( xy );
+
+    highp vec3 vertPosition = vec3( xy, heightAt( texel ) );
+
+    // Surface normal by central differences (one-sided on the border),
+    // as computeNormals() does on the CPU
+
+    ivec2 lo = max( texel - 1, ivec2(0) );
+    ivec2 hi = min( texel + 1, ivec2(terrainMax) );
+
+    highp float dx = (heightAt( ivec2( hi.x, texel.y ) ) - heightAt( ivec2( lo.x, texel.y ) )) / float( hi.x - lo.x );
+    highp float dy = (heightAt( ivec2( texel.x, hi.y ) ) - heightAt( ivec2( texel.x, lo.y ) )) / float( hi.y - lo.y );
+
+    mediump vec3 surfaceNormal = normalize( vec3( -dx, -dy, 1.0 ) );
+
+    gl_Position = MVP * vec4(vertPosition, 1.0);
+    texCoords = xy / terrainMax;
+
+    // The water normal map tilts the surface normal exactly as in
+    // water.vert, so a scene shades the same with and without
+    // -gpuTerrain (on flat water the result is the normal map's normal)
+
+    mediump vec3 texNormal = texture(normalSampler, texCoords).rgb;
+    normal_vcs = vec3( MV * vec4(surfaceNormal + texNormal - vec3(0.0, 0.0, 1.0), 0.0));
+    position_vcs = vec3(MV * vec4(vertPosition, 1.0));
+}
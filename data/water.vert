@@ -4,9 +4,16 @@ uniform mat4 MVP;
 uniform mat4 MV;
 uniform sampler2D normalSampler;
 
-layout (location = 0) in mediump vec3 vertPosition;
-layout (location = 1) in mediump vec3 vertNormal;
-layout (location = 2) in mediump vec2 vertTexCoords;
+// x, y and the texture coordinates come from the vertex's index in
+// its grid (see TerrainVertex in terrain.h)
+
+uniform int   gridWidth;
+uniform vec2  gridOrigin;
+uniform float gridSpacing;
+uniform vec2  terrainMax;
+
+layout (location = 0) in highp float vertHeight;
+layout (location = 1) in mediump vec2 vertNormal; // octahedral (see encodeOctahedral() in terrainNormals.h)
 
 smooth out mediump vec3 normal_vcs;
 smooth out mediump vec3 position_vcs;
@@ -14,9 +21,23 @@ smooth out mediump vec2 texCoords;
 
 void main()
 {
+    highp vec2 xy = min( gridOrigin + gridSpacing * vec2( gl_VertexID % gridWidth, gl_VertexID / gridWidth ), terrainMax );
+    highp vec3 vertPosition = vec3( xy, vertHeight );
+
+    // Unfold the octahedral surface normal
+
+    mediump vec3 surfaceNormal = vec3( vertNormal, 1.0 - abs(vertNormal.x) - abs(vertNormal.y) );
+    mediump float t = max( -surfaceNormal.z, 0.0 );
+    surfaceNormal.xy += vec2( surfaceNormal.x >= 0.0 ? -t : t, surfaceNormal.y >= 0.0 ? -t : t );
+    surfaceNormal = normalize( surfaceNormal );
+
     gl_Position = MVP * vec4(vertPosition, 1.0);
-	texCoords = vertTexCoords;
+    texCoords = xy / terrainMax;
+
+    // The water normal map tilts the surface normal (on flat water the
+    // result is the normal map's normal)
+
     mediump vec3 texNormal = texture(normalSampler, texCoords).rgb;
-    normal_vcs = vec3( MV * vec4(texNormal, 0.0));
+    normal_vcs = vec3( MV * vec4(surfaceNormal + texNormal - vec3(0.0, 0.0, 1.0), 0.0));
     position_vcs = vec3(MV * vec4(vertPosition, 1.0));
-}
\ No newline at end of file
+}
@@ -97,6 +97,86 @@ void Segs::drawOneSeg( vec3 tail, vec3 head, mat4 &MV, mat4 &MVP, vec3 lightDir
 
 
 
+// Build a persistent VAO with the same layout as drawSegs() uses.
+// The buffers stay allocated for as long as the VAO is used.
+
+GLuint Segs::makeVAO( vec3 *pts, vec3 *colours, vec3 *norms, int nPts )
+
+{
+  GLuint VAO;
+
+  glGenVertexArrays( 1, &VAO );
+  glBindVertexArray( VAO );
+
+  GLuint VBO[3];
+  glGenBuffers( 3, VBO );
+
+  vec3 *data[3] = { pts, colours, (norms != NULL ? norms : pts) };
+
+  for (int i=0; i<3; i++) {
+    glBindBuffer( GL_ARRAY_BUFFER, VBO[i] );
+    glBufferData( GL_ARRAY_BUFFER, nPts * sizeof(vec3), data[i], GL_STATIC_DRAW );
+    glVertexAttribPointer( i, 3, GL_FLOAT, GL_FALSE, 0, 0 );
+    glEnableVertexAttribArray( i );
+  }
+
+  glBindVertexArray( 0 );
+  glBindBuffer( GL_ARRAY_BUFFER, 0 );
+
+  return VAO;
+}
+
+
+
+// Delete a VAO from makeVAO(), with the buffers that it holds
+
+void Segs::deleteVAO( GLuint VAO )
+
+{
+  GLuint VBO[3];
+
+  glBindVertexArray( VAO );
+
+  for (int i=0; i<3; i++) {
+    GLint buffer = 0;
+    glGetVertexAttribiv( i, GL_VERTEX_ATTRIB_ARRAY_BUFFER_BINDING, &buffer );
+    VBO[i] = buffer;
+  }
+
+  glBindVertexArray( 0 );
+
+  glDeleteBuffers( 3, VBO );
+  glDeleteVertexArrays( 1, &VAO );
+}
+
+
+
+void Segs::drawVAO( GLuint primitiveType, GLuint VAO, int nPts, bool useNormals, mat4 &MV, mat4 &MVP, vec3 lightDir )
+
+{
+  GLint id = 0;
+  glGetIntegerv(GL_CURRENT_PROGRAM, &id); // get previously-active GPU program
+
+  gpuProg->activate();
+
+  gpuProg->setMat4( "MV",  MV  );
+  gpuProg->setMat4( "MVP", MVP );
+  gpuProg->setVec3( "lightDir", lightDir );
+
+  gpuProg->setInt( "useNormals", useNormals );
+
+  glBindVertexArray( VAO );
+  glDrawArrays( primitiveType, 0, nPts );
+  glBindVertexArray( 0 );
+
+  gpuProg->deactivate();
+
+  glUseProgram( id ); // restore previously-active GPU program
+}
+
+
+
+
 GPUProgram *Segs::setupShaders()
 
 {
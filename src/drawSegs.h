@@ -7,6 +7,14 @@
 // Use it:
 //
 //    segs->drawOneSeg( tail, head, MVP );
+//
+// For geometry that does not change, build a VAO once and draw it
+// each frame, which avoids creating buffers on every call:
+//
+//    GLuint VAO = Segs::makeVAO( pts, colours, NULL, nPts );
+//    segs->drawVAO( GL_TRIANGLE_STRIP, VAO, nPts, false, MV, MVP, lightDir );
+//    ...
+//    Segs::deleteVAO( VAO );           // and its buffers
 
 
 #ifndef DRAW_SEGS_H
@@ -39,6 +47,14 @@ class Segs {
   }
 
   void drawOneSeg( vec3 tail, vec3 head, mat4 &MV, mat4 &MVP, vec3 lightDir );
+
+  // makeVAO() only needs an OpenGL context, so it can be called before
+  // the Segs instance exists.
+
+  static GLuint makeVAO( vec3 *pts, vec3 *colours, vec3 *norms, int nPts );
+  static void   deleteVAO( GLuint VAO );
+
+  void drawVAO( GLuint primitiveType, GLuint VAO, int nPts, bool useNormals, mat4 &MV, mat4 &MVP, vec3 lightDir );
 };
 
 #endif
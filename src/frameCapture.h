@@ -0,0 +1,102 @@
+// frameCapture.h
+//
+// Captures the frames drawn in the window to numbered PNG files
+// (capture/frame000000.png, capture/frame000001.png, ...), for videos
+// of fly-throughs and rides.
+//
+// Each frame is read with glReadPixels into a pixel buffer object from
+// a ring of FRAME_CAPTURE_BUFFERS, which returns without waiting for
+// the frame to be drawn.  The buffer is mapped FRAME_CAPTURE_BUFFERS-1
+// frames later, when its transfer has finished, and its pixels are
+// handed to a pool of threads that encode them (with the bundled
+// lodepng) and write them.
+//
+// While capturing, the scene advances by exactly 1/FRAME_CAPTURE_FPS
+// each frame, so the frames play back at FRAME_CAPTURE_FPS however
+// long each one takes to draw and encode.  No frame is dropped: if the
+// encoders fall FRAME_CAPTURE_QUEUE frames behind, capture() waits for
+// them, which slows the window but not the captured motion.
+//
+//    FrameCapture capture;
+//    capture.start( "capture/frame" );
+//    ...
+//    capture.capture( width, height );  // each frame, before swapping buffers
+//    ...
+//    capture.stop();                    // writes the remaining frames
+
+
+#ifndef FRAME_CAPTURE_H
+#define FRAME_CAPTURE_H
+
+#include "headers.h"
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+#define FRAME_CAPTURE_FPS      60
+#define FRAME_CAPTURE_BUFFERS  3      // pixel buffer objects in the ring (so frames are read 2 frames late)
+#define FRAME_CAPTURE_QUEUE    8      // most frames waiting for an encoder
+#define FRAME_CAPTURE_THREADS  0      // encoders (0 = one per core, less one for drawing)
+#define FRAME_CAPTURE_PREFIX   "capture/frame"
+
+
+// A frame read back from a buffer, bottom row first, 4 bytes per pixel
+
+struct CapturedFrame {
+  int number;
+  int width, height;
+  std::vector<unsigned char> rgba;
+};
+
+
+class FrameCapture {
+
+  GLuint  buffers[ FRAME_CAPTURE_BUFFERS ];
+  GLsync  fences[ FRAME_CAPTURE_BUFFERS ];  // NULL unless the buffer holds a frame
+  int     bufferFrame[ FRAME_CAPTURE_BUFFERS ];
+  int     bufferWidth, bufferHeight;        // 0 until the buffers are allocated
+
+  string  prefix;
+  int     nextFrame;                        // number of the next frame read
+
+  // Encoder threads
+
+  std::vector<std::thread>   encoders;
+  std::mutex                 mutex;
+  std::condition_variable    changed;       // a frame queued or taken
+  std::deque<CapturedFrame>  queue;         // frames to encode, in order
+  std::vector< std::vector<unsigned char> > spare; // pixel storage to reuse
+  bool                       stopping;
+
+  int nCaptured, nWritten, nFailed; // written by the encoders, so read through counts()
+  int nWaits;                   // frames on which capture() waited for the encoders
+
+  void encode();
+  void readBack( int b );
+  void allocate( int width, int height );
+  void release();
+
+ public:
+
+  FrameCapture();
+  ~FrameCapture();
+
+  bool start( const char *filenamePrefix = FRAME_CAPTURE_PREFIX );
+  void capture( int width, int height );
+  void stop();
+
+  bool active() {
+    return !encoders.empty();
+  }
+
+  string filename( int number );
+
+  void counts( int &captured, int &written, int &failed, int &waits );
+};
+
+
+#endif
@@ -25,6 +25,8 @@
   #pragma warning(disable : 4244 4305 4996 4838)
   #define chdir _chdir
   #include <direct.h>
+  #define fseeko _fseeki64      // 64-bit file offsets (cache files can exceed 2 GB)
+  #define ftello _ftelli64
 #endif
 
 #ifdef MACOS
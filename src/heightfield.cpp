@@ -0,0 +1,173 @@
+// heightfield.cpp
+
+
+#include "heightfield.h"
+#include "lodepng.h"
+
+#include <sys/stat.h>
+
+
+static bool endsWith( string &s, const char *suffix )
+
+{
+  return s.size() > strlen( suffix ) && s.compare( s.size() - strlen( suffix ), string::npos, suffix ) == 0;
+}
+
+
+bool HeightfieldReader::open( string filename )
+
+{
+  close();
+  name = filename;
+
+  // Raw file: the size is in the name, or the file is square
+
+  if (endsWith( filename, HEIGHTFIELD_RAW_FLOAT ) || endsWith( filename, HEIGHTFIELD_RAW_UINT16 )) {
+
+    int bytesPerTexel = (endsWith( filename, HEIGHTFIELD_RAW_FLOAT ) ? 4 : 2);
+
+    string stem = filename.substr( 0, filename.size() - 4 );
+    size_t dot = stem.find_last_of( '.' );
+    int w, h;
+    char end;
+
+    if (dot != string::npos && sscanf( stem.c_str() + dot + 1, "%dx%d%c", &w, &h, &end ) == 2)
+      return openRaw( filename, w, h, bytesPerTexel );
+
+    struct stat st;
+    if (stat( filename.c_str(), &st ) != 0) {
+      cerr << "Could not open file '" << filename << "'." << endl;
+      return false;
+    }
+
+    long long n = st.st_size / bytesPerTexel;
+    w = (int) sqrt( (double) n );
+    while ((long long) w*w < n)
+      w++;
+
+    if ((long long) w*w*bytesPerTexel != st.st_size) {
+      cerr << "Raw heightfield '" << filename << "' is not square; give its size in its name, as in 'name.WxH" << filename.substr( filename.size() - 4 ) << "'." << endl;
+      return false;
+    }
+
+    return openRaw( filename, w, w, bytesPerTexel );
+  }
+
+  // PNG: decode one channel (three for colour) at the file's bit depth
+
+  unsigned char *png = NULL;
+  size_t pngSize = 0;
+
+  LodePNGState state;
+  lodepng_state_init( &state );
+
+  unsigned error = lodepng_load_file( &png, &pngSize, filename.c_str() );
+
+  if (!error)
+    error = lodepng_inspect( &width, &height, &state, png, pngSize );
+
+  if (!error) {
+
+    bool grey = lodepng_is_greyscale_type( &state.info_png.color );
+
+    bitDepth      = (state.info_png.color.bitdepth == 16 ? 16 : 8);
+    bytesPerValue = bitDepth / 8;
+    channels      = (grey ? 1 : 3);
+
+    state.info_raw.colortype = (grey ? LCT_GREY : LCT_RGB);
+    state.info_raw.bitdepth  = bitDepth;
+
+    error = lodepng_decode( &image, &width, &height, &state, png, pngSize );
+  }
+
+  lodepng_state_cleanup( &state );
+  free( png );
+
+  if (error) {
+    cerr << "Error loading '" << filename << "': " << lodepng_error_text(error) << endl;
+    close();
+    return false;
+  }
+
+  scale = HEIGHTFIELD_MAX_HEIGHT * width / (bitDepth == 16 ? 65535.0 : 255.0);
+
+  return true;
+}
+
+
+bool HeightfieldReader::openRaw( string filename, int w, int h, int bytesPerTexel )
+
+{
+  close();
+  name = filename;
+
+  file = fopen( filename.c_str(), "rb" );
+
+  if (file == NULL) {
+    cerr << "Could not open file '" << filename << "'." << endl;
+    return false;
+  }
+
+  width  = w;
+  height = h;
+
+  bytesPerValue = bytesPerTexel;
+  bitDepth      = 8 * bytesPerTexel;
+  rowBuffer     = new unsigned char[ (size_t) width * bytesPerValue ];
+  scale         = (bytesPerValue == 2 ? HEIGHTFIELD_MAX_HEIGHT * width / 65535.0 : 1);
+
+  return true;
+}
+
+
+bool HeightfieldReader::readRow( int y, float *row )
+
+{
+  if (image != NULL) {
+
+    const unsigned char *p = image + (size_t) y * width * channels * bytesPerValue;
+    const int stride = channels * bytesPerValue;
+
+    if (bytesPerValue == 2)
+      for (unsigned int x=0; x<width; x++, p+=stride)
+        row[x] = ((p[0] << 8) | p[1]) * scale; // PNG samples are big-endian
+    else
+      for (unsigned int x=0; x<width; x++, p+=stride)
+        row[x] = p[0] * scale;
+
+    return true;
+  }
+
+  if (file == NULL)
+    return false;
+
+  if (fseeko( file, (int64_t) y * width * bytesPerValue, SEEK_SET ) != 0 ||
+      fread( rowBuffer, bytesPerValue, width, file ) != width) {
+    cerr << "'" << name << "' ends at row " << y << "." << endl;
+    return false;
+  }
+
+  if (bytesPerValue == 4)
+    memcpy( row, rowBuffer, width * sizeof(float) );
+  else
+    for (unsigned int x=0; x<width; x++)
+      row[x] = (rowBuffer[2*x] | (rowBuffer[2*x+1] << 8)) * scale; // little-endian
+
+  return true;
+}
+
+
+void HeightfieldReader::close()
+
+{
+  free( image );
+  image = NULL;
+
+  delete[] rowBuffer;
+  rowBuffer = NULL;
+
+  if (file != NULL) {
+    fclose( file );
+    file = NULL;
+  }
+}
@@ -0,0 +1,76 @@
+// heightfield.h
+//
+// Reads a heightfield a row at a time, as float heights, from
+//
+//   - a PNG, 8 or 16 bits deep: the grey value (or the red channel of
+//     a colour image), scaled so that the largest value is
+//     HEIGHTFIELD_MAX_HEIGHT times the width;
+//
+//   - a raw file of little-endian 32-bit floats (.r32), which are the
+//     heights, or 16-bit unsigned integers (.r16), scaled like a 16-bit
+//     PNG.  Raw files are in row-major order, and are square unless
+//     the name gives the size, as in "alps.4097x2049.r16".
+//
+// A PNG is decoded to a single channel at its own bit depth (a colour
+// PNG to RGB), so it takes one or two bytes per texel rather than the
+// four of RGBA.  A raw file is read a row at a time, so it need not fit
+// in memory.
+
+
+#ifndef HEIGHTFIELD_H
+#define HEIGHTFIELD_H
+
+#include "headers.h"
+
+#include <stdint.h>
+
+
+#define HEIGHTFIELD_MAX_HEIGHT 0.1     // of the width
+
+#define HEIGHTFIELD_RAW_FLOAT  ".r32"
+#define HEIGHTFIELD_RAW_UINT16 ".r16"
+
+
+class HeightfieldReader {
+
+  string         name;
+  FILE          *file;          // raw
+  unsigned char *image;         // PNG, decoded
+  int            channels;      // in 'image'
+  int            bytesPerValue; // 1 or 2 (PNG or .r16), or 4 (.r32)
+  unsigned char *rowBuffer;     // raw
+  float          scale;         // value -> height
+
+ public:
+
+  unsigned int width, height;
+  int          bitDepth;        // of the values: 8, 16 or 32 (float)
+
+  HeightfieldReader() {
+    file = NULL;
+    image = NULL;
+    rowBuffer = NULL;
+    width = height = 0;
+  }
+
+  ~HeightfieldReader() {
+    close();
+  }
+
+  // Open a heightfield, with its format from its extension.  Errors
+  // are reported on cerr.
+
+  bool open( string filename );
+
+  // Open a raw file of the given size, with 4 (float) or 2 (uint16)
+  // bytes per texel
+
+  bool openRaw( string filename, int width, int height, int bytesPerTexel );
+
+  bool readRow( int y, float *row );
+
+  void close();
+};
+
+
+#endif
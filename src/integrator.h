@@ -0,0 +1,92 @@
+// integrator.h
+//
+// Integrators for the train's one-dimensional equation of motion
+//
+//    ds/dt = v
+//    dv/dt = a(s,v)
+//
+// where s is the arc length along the track.  Each integrator is a
+// policy class with a static 'step' that advances (s,v) by 'dt'.
+// 'accel' is any callable with signature  float accel( float s, float v ).
+//
+// Each evaluation of 'accel' costs a spline evaluation, so the number
+// of evaluations per step is listed with each integrator.
+
+
+#ifndef INTEGRATOR_H
+#define INTEGRATOR_H
+
+
+enum IntegratorType { SEMI_IMPLICIT_EULER, EXPLICIT_EULER, VELOCITY_VERLET, RK4, NUM_INTEGRATORS };
+
+extern const char *integratorName[];
+
+
+// Explicit (forward) Euler.  1 evaluation.  First order; gains energy.
+
+struct ExplicitEuler {
+
+  template<class Accel>
+  static void step( float &s, float &v, float dt, Accel &accel ) {
+    float a = accel( s, v );
+    s += v * dt;
+    v += a * dt;
+  }
+};
+
+
+// Semi-implicit (symplectic) Euler: update v, then s with the new v.
+// 1 evaluation.  First order, but energy errors stay bounded.
+
+struct SemiImplicitEuler {
+
+  template<class Accel>
+  static void step( float &s, float &v, float dt, Accel &accel ) {
+    v += accel( s, v ) * dt;
+    s += v * dt;
+  }
+};
+
+
+// Velocity Verlet.  2 evaluations.  Second order and symplectic for
+// position-only forces.  The velocity-dependent (drag) term uses the
+// half-step velocity.
+
+struct VelocityVerlet {
+
+  template<class Accel>
+  static void step( float &s, float &v, float dt, Accel &accel ) {
+    float a0 = accel( s, v );
+    float vHalf = v + 0.5f * dt * a0;
+    s += dt * vHalf;
+    v = vHalf + 0.5f * dt * accel( s, vHalf );
+  }
+};
+
+
+// Classical fourth-order Runge-Kutta.  4 evaluations.
+
+struct RungeKutta4 {
+
+  template<class Accel>
+  static void step( float &s, float &v, float dt, Accel &accel ) {
+
+    float k1s = v;
+    float k1v = accel( s, v );
+
+    float k2s = v + 0.5f * dt * k1v;
+    float k2v = accel( s + 0.5f * dt * k1s, k2s );
+
+    float k3s = v + 0.5f * dt * k2v;
+    float k3v = accel( s + 0.5f * dt * k2s, k3s );
+
+    float k4s = v + dt * k3v;
+    float k4v = accel( s + dt * k3s, k4s );
+
+    s += dt/6.0f * (k1s + 2*k2s + 2*k3s + k4s);
+    v += dt/6.0f * (k1v + 2*k2v + 2*k3v + k4v);
+  }
+};
+
+
+#endif
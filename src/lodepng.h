@@ -1,5 +1,6 @@
 /*
-LodePNG version 20201017
+LodePNG version 20201017 (altered: SSE2 unfiltering and Adler-32, see LODEPNG_SSE2 in lodepng.cpp; a fast path for
+inflate, see inflateHuffmanBlockFast; and a CRC that takes 8 bytes at a time)
 
 Copyright (c) 2005-2020 Lode Vandevenne
 
@@ -652,6 +653,10 @@ typedef struct LodePNGDecoderSettings {
 
   unsigned color_convert; /*whether to convert the PNG to the color type you want. Default: yes*/
 
+  /*whether to unfilter 2, 3 and 4 byte pixels with SSE2, where it is compiled in (see LODEPNG_SSE2). The scalar code,
+  used otherwise, is the reference; both give the same result. Default: yes*/
+  unsigned simd_unfilter;
+
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   unsigned read_text_chunks; /*if false but remember_unknown_chunks is true, they're stored in the unknown chunks*/
 
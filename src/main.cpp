@@ -5,6 +5,11 @@
 #include "scene.h"
 #include "font.h"
 #include "main.h"
+#include "tools.h"
+#include "terrain.h"
+
+#include <chrono>
+#include <iomanip>
 
 // window dimensions
 
@@ -22,6 +27,32 @@ Axes     *axes;
 Segs     *segs;
 Cube* cube;
 
+// Startup timing
+
+
+static auto startupStart = std::chrono::steady_clock::now();
+static auto phaseStart   = startupStart;
+
+bool startingUp = true;
+
+
+void startupPhase( const char *name )
+
+{
+  if (!startingUp)
+    return;
+
+  auto now = std::chrono::steady_clock::now();
+
+  cerr << "startup: " << std::left << std::setw(24) << name << std::right << std::fixed << std::setprecision(3)
+       << std::chrono::duration<double>( now - phaseStart ).count() << " s   (total "
+       << std::chrono::duration<double>( now - startupStart ).count() << " s)" << endl;
+
+  cerr.unsetf( std::ios::floatfield );
+  phaseStart = now;
+}
+
+
 // Error callback
 
 void errorCallback( int error, const char* description )
@@ -56,12 +87,33 @@ int main( int argc, char **argv )
   // Get scene file name
 
   if (argc < 2) {
-    cerr << "Usage: " << argv[0] << " scene_name" << endl;
+    cerr << "Usage: " << argv[0] << " scene_name [-record telemetry_file | -replay telemetry_file] [-capture frame_prefix] [-gpuTerrain]" << endl;
     exit(1);
   }
 
+  // Command-line tools (no window)
+
+  if (argv[1][0] == '-')
+    return runTool( argc, argv );
+
   char *sceneFilename = argv[1];
 
+  // Optional telemetry
+
+  char *recordFilename = NULL;
+  char *replayFilename = NULL;
+  char *capturePrefix  = NULL;
+
+  for (int i=2; i<argc; i++)
+    if (strcmp( argv[i], "-record" ) == 0 && i+1 < argc)
+      recordFilename = argv[++i];
+    else if (strcmp( argv[i], "-replay" ) == 0 && i+1 < argc)
+      replayFilename = argv[++i];
+    else if (strcmp( argv[i], "-capture" ) == 0 && i+1 < argc)
+      capturePrefix = argv[++i];    // frames go to capturePrefix000000.png, ...
+    else if (strcmp( argv[i], "-gpuTerrain" ) == 0)
+      Terrain::gpuDisplacement = true;   // heights from a texture in the vertex shader
+
   std::cout << sceneFilename << std::endl;
 
   chdir( ".." );
@@ -104,9 +156,13 @@ int main( int argc, char **argv )
   glfwSetWindowSizeCallback( window, windowReshapeCallback );
   glfwSetFramebufferSizeCallback( window, framebufferReshapeCallback );
 
+  startupPhase( "window" );
+
   // Fonts
 
   initFont( "./FreeSans.ttf", 20 );
+
+  startupPhase( "font" );
   
   // Set up the scene (and event handlers for mouse and keyboard)
 
@@ -119,6 +175,17 @@ int main( int argc, char **argv )
   axes     = new Axes();
   segs     = new Segs();
   cube = new Cube();
+
+  startupPhase( "objects" );
+
+  if (recordFilename != NULL)
+    scene->recordTelemetry( recordFilename );
+
+  if (replayFilename != NULL)
+    scene->replayTelemetry( replayFilename );
+
+  if (capturePrefix != NULL)
+    scene->startCapture( capturePrefix );
   
   // Main loop
 
@@ -133,14 +200,26 @@ int main( int argc, char **argv )
     float elapsedSeconds = (thisTime.time + thisTime.millitm / 1000.0) - (prevTime.time + prevTime.millitm / 1000.0);
     prevTime = thisTime;
 
+    if (scene->capturing())     // one captured frame per step, however long it takes
+      elapsedSeconds = 1.0 / FRAME_CAPTURE_FPS;
+
     scene->update( elapsedSeconds );
     scene->draw( false ); // false = draw normally
 
+    if (startingUp) {
+      glFinish();
+      startupPhase( "first frame" );
+      startingUp = false;
+    }
+
     glfwPollEvents();
   }
 
   // Clean up
 
+  scene->closeTelemetry();
+  scene->stopCapture();
+
   glfwDestroyWindow( window );
   glfwTerminate();
 
@@ -13,3 +13,11 @@ extern Cube     *cube;
 extern Cylinder *cylinder;
 extern Axes     *axes;
 extern Segs     *segs;
+
+// Report on stderr the time taken by a phase of startup (since the
+// previous call, or since the program started).  Nothing is reported
+// once the first frame is drawn, so reloading a scene is quiet.
+
+extern bool startingUp;
+
+void startupPhase( const char *name );
@@ -0,0 +1,361 @@
+// minMaxPyramid.cpp
+
+
+#include "minMaxPyramid.h"
+#include "terrain.h"            // for alignedAlloc
+
+
+void MinMaxPyramid::build( const float *h, int width, int height )
+
+{
+  allocate( h, width, height );
+  fill();
+}
+
+
+void MinMaxPyramid::allocate( const float *h, int width, int height )
+
+{
+  release();
+
+  heights  = h;
+  hfWidth  = width;
+  hfHeight = height;
+
+  if (width < 2 || height < 2)
+    return;                     // no quads
+
+  // Allocate levels down to a single cell
+
+  int w = width-1;
+  int ht = height-1;
+
+  while (true) {
+
+    levelWidth[nLevels]  = w;
+    levelHeight[nLevels] = ht;
+    levelMin[nLevels] = (float *) alignedAlloc( w * ht * sizeof(float) );
+    levelMax[nLevels] = (float *) alignedAlloc( w * ht * sizeof(float) );
+    nLevels++;
+
+    if (w == 1 && ht == 1)
+      break;
+
+    w  = (w+1)/2;
+    ht = (ht+1)/2;
+  }
+}
+
+
+// Fill from the bottom up
+
+void MinMaxPyramid::fill()
+
+{
+  for (int level=0; level<nLevels; level++)
+    for (int y=0; y<levelHeight[level]; y++)
+      for (int x=0; x<levelWidth[level]; x++)
+        updateCell( level, x, y );
+}
+
+
+void MinMaxPyramid::update( int x0, int y0, int x1, int y1 )
+
+{
+  if (nLevels == 0)
+    return;
+
+  // Texel (x,y) is a corner of quads x-1..x and y-1..y
+
+  x0 = (x0 > 0 ? x0-1 : 0);
+  y0 = (y0 > 0 ? y0-1 : 0);
+  x1 = (x1 < levelWidth[0]-1  ? x1 : levelWidth[0]-1);
+  y1 = (y1 < levelHeight[0]-1 ? y1 : levelHeight[0]-1);
+
+  for (int level=0; level<nLevels; level++) {
+
+    for (int y=y0; y<=y1; y++)
+      for (int x=x0; x<=x1; x++)
+        updateCell( level, x, y );
+
+    x0 /= 2;  y0 /= 2;
+    x1 /= 2;  y1 /= 2;
+  }
+}
+
+
+void MinMaxPyramid::updateCell( int level, int x, int y )
+
+{
+  float lo, hi;
+
+  if (level == 0) {
+
+    const float *row = heights + y*hfWidth + x;
+
+    float h00 = row[0];
+    float h10 = row[1];
+    float h01 = row[hfWidth];
+    float h11 = row[hfWidth+1];
+
+    lo = fmin( fmin( h00, h10 ), fmin( h01, h11 ) );
+    hi = fmax( fmax( h00, h10 ), fmax( h01, h11 ) );
+
+  } else {
+
+    // Children that exist below this cell
+
+    int w = levelWidth[level-1];
+    int ht = levelHeight[level-1];
+
+    float *cmin = levelMin[level-1];
+    float *cmax = levelMax[level-1];
+
+    int cx = 2*x;
+    int cy = 2*y;
+
+    lo = cmin[ cy*w + cx ];
+    hi = cmax[ cy*w + cx ];
+
+    if (cx+1 < w) {
+      lo = fmin( lo, cmin[ cy*w + cx+1 ] );
+      hi = fmax( hi, cmax[ cy*w + cx+1 ] );
+    }
+
+    if (cy+1 < ht) {
+      lo = fmin( lo, cmin[ (cy+1)*w + cx ] );
+      hi = fmax( hi, cmax[ (cy+1)*w + cx ] );
+
+      if (cx+1 < w) {
+        lo = fmin( lo, cmin[ (cy+1)*w + cx+1 ] );
+        hi = fmax( hi, cmax[ (cy+1)*w + cx+1 ] );
+      }
+    }
+  }
+
+  levelMin[level][ y*levelWidth[level] + x ] = lo;
+  levelMax[level][ y*levelWidth[level] + x ] = hi;
+}
+
+
+// Find the intersection of rayStart + t*rayDir with the heightfield.
+//
+// The ray descends the pyramid from its single top cell.  A cell is
+// entered only if the ray passes through its box (its x and y extent
+// and its range of heights), and its children are visited in the
+// order in which the ray reaches them, so the first quad hit is the
+// nearest.  Rays that pass far above or beside the heightfield are
+// rejected near the top, so a typical ray visits O(log n) cells.
+//
+// Only quads that overlap [x0,x1] x [y0,y1] are searched.
+
+
+bool MinMaxPyramid::intersect( vec3 rayStart, vec3 rayDir, vec3 &intPoint, float x0, float y0, float x1, float y1 )
+
+{
+  if (nLevels == 0)
+    return false;
+
+  region[0] = x0;
+  region[1] = y0;
+  region[2] = x1;
+  region[3] = y1;
+
+  return intersectCell( nLevels-1, 0, 0, rayStart, rayDir, intPoint );
+}
+
+
+// Clip the ray to lo <= start + t*dir <= hi in one dimension
+
+
+bool raySlab( float start, float dir, float lo, float hi, float &tNear, float &tFar )
+
+{
+  if (fabs(dir) < 1e-12)
+    return (start >= lo && start <= hi);
+
+  float t0 = (lo - start) / dir;
+  float t1 = (hi - start) / dir;
+
+  if (t0 > t1) {
+    float t = t0;
+    t0 = t1;
+    t1 = t;
+  }
+
+  if (t0 > tNear)
+    tNear = t0;
+  if (t1 < tFar)
+    tFar = t1;
+
+  return (tNear <= tFar);
+}
+
+
+// Intersect the ray with the quads under cell (cx,cy) at 'level'.
+// Returns the nearest intersection.
+
+
+bool MinMaxPyramid::intersectCell( int level, int cx, int cy, vec3 &rayStart, vec3 &rayDir, vec3 &intPoint )
+
+{
+  // Box of this cell
+
+  int size = 1 << level;
+
+  float x0 = cx * size;
+  float y0 = cy * size;
+  float x1 = fmin( x0 + size, hfWidth-1.0 );
+  float y1 = fmin( y0 + size, hfHeight-1.0 );
+
+  if (x1 <= region[0] || x0 >= region[2] || y1 <= region[1] || y0 >= region[3])
+    return false;               // outside the region searched
+
+  float tNear = 0;
+  float tFar = MAXFLOAT;
+
+  if (!raySlab( rayStart.x, rayDir.x, x0-CELL_EPSILON, x1+CELL_EPSILON, tNear, tFar ) ||
+      !raySlab( rayStart.y, rayDir.y, y0-CELL_EPSILON, y1+CELL_EPSILON, tNear, tFar ) ||
+      !raySlab( rayStart.z, rayDir.z,
+                minHeight( level, cx, cy ) - CELL_EPSILON,
+                maxHeight( level, cx, cy ) + CELL_EPSILON, tNear, tFar ))
+    return false;
+
+  if (level == 0) {
+
+    // Test for intersection of ray with the two terrain triangles
+    // above this terrain pixel.  Keep the nearer one.
+
+    const float *h = heights + cy*hfWidth + cx;
+
+    vec3 ll( cx,   cy,   h[0] );
+    vec3 lr( cx+1, cy,   h[1] );
+    vec3 ul( cx,   cy+1, h[hfWidth] );
+    vec3 ur( cx+1, cy+1, h[hfWidth+1] );
+
+    vec3 p0, p1;
+    float t;
+
+    bool hit0 = rayTriangleInt( rayStart, rayDir, ll, lr, ul, p0, t );
+    bool hit1 = rayTriangleInt( rayStart, rayDir, ul, lr, ur, p1, t );
+
+    if (hit0 && hit1)
+      intPoint = ((p0-rayStart)*rayDir <= (p1-rayStart)*rayDir ? p0 : p1);
+    else if (hit0)
+      intPoint = p0;
+    else if (hit1)
+      intPoint = p1;
+
+    return hit0 || hit1;
+  }
+
+  // Visit the children in the order in which the ray enters their
+  // columns.  The columns are disjoint, so the first hit is the
+  // nearest.
+
+  int   childX[4], childY[4];
+  float childT[4];
+  int   nChildren = 0;
+
+  int childSize = size/2;
+
+  for (int j=0; j<2; j++)
+    for (int i=0; i<2; i++) {
+
+      int x = 2*cx + i;
+      int y = 2*cy + j;
+
+      if (x >= levelWidth[level-1] || y >= levelHeight[level-1])
+        continue;
+
+      float tn = 0;
+      float tf = MAXFLOAT;
+
+      if (!raySlab( rayStart.x, rayDir.x, x*childSize - CELL_EPSILON, (x+1)*childSize + CELL_EPSILON, tn, tf ) ||
+          !raySlab( rayStart.y, rayDir.y, y*childSize - CELL_EPSILON, (y+1)*childSize + CELL_EPSILON, tn, tf ))
+        continue;
+
+      // insert in order of tn
+
+      int k = nChildren++;
+      while (k > 0 && childT[k-1] > tn) {
+        childX[k] = childX[k-1];
+        childY[k] = childY[k-1];
+        childT[k] = childT[k-1];
+        k--;
+      }
+
+      childX[k] = x;
+      childY[k] = y;
+      childT[k] = tn;
+    }
+
+  for (int k=0; k<nChildren; k++)
+    if (intersectCell( level-1, childX[k], childY[k], rayStart, rayDir, intPoint ))
+      return true;
+
+  return false;
+}
+
+
+
+
+
+bool rayTriangleInt( vec3 rayStart, vec3 rayDir,
+                     vec3 v0, vec3 v1, vec3 v2,
+                     vec3 & intPoint, float & intParam )
+
+{
+  float param;
+  vec3 point, lc;
+
+  vec3 normal = (v1-v0)^(v2-v0);  // not normalized yet!
+
+  // Compute ray/plane intersection
+
+  float dn = rayDir * normal;
+
+  if (fabs(dn) < 0.0001)
+    return false;               // ray is parallel to plane
+
+  float dist = v0 * normal;
+
+  param = (dist - rayStart*normal) / dn;
+  if (param < 0)
+    return false;               // plane is behind starting point
+
+  point = rayStart + param * rayDir;
+
+  // Compute barycentric coords
+
+  float totalArea = ((v1-v0) ^ (v2-v0)) * normal;
+
+  float u = (((v2-v1) ^ (point - v1)) * normal) / totalArea;
+
+  float v = (((v0-v2) ^ (point - v2)) * normal) / totalArea;
+
+  // Reject if outside triangle
+
+  if (u < 0 || v < 0 || u + v > 1)
+    return false;
+
+  // Return int point and normal and parameter
+
+  intParam = param / normal.length();
+  intPoint = point;
+
+  return true;
+}
+
+
+
+void MinMaxPyramid::release()
+
+{
+  for (int i=0; i<nLevels; i++) {
+    alignedFree( levelMin[i] );
+    alignedFree( levelMax[i] );
+  }
+
+  nLevels = 0;
+}
@@ -0,0 +1,104 @@
+// minMaxPyramid.h
+//
+// A pyramid of minimum and maximum heights over a heightfield, for
+// skipping empty space when intersecting rays with the terrain.
+//
+// Level 0 has one cell per terrain quad: cell (x,y) covers texels
+// x..x+1 and y..y+1.  Each cell of level k+1 covers the 2x2 cells of
+// level k below it (fewer at the right and top edges when a level has
+// odd size).  The top level is a single cell.
+
+
+#ifndef MIN_MAX_PYRAMID_H
+#define MIN_MAX_PYRAMID_H
+
+#include "headers.h"
+
+
+#define MAX_PYRAMID_LEVELS 32
+
+#define CELL_EPSILON 0.001      // box padding, so that ray hits on quad edges are not lost
+
+
+bool raySlab( float start, float dir, float lo, float hi, float &tNear, float &tFar );
+bool rayTriangleInt( vec3 rayStart, vec3 rayDir, vec3 v0, vec3 v1, vec3 v2, vec3 & intPoint, float & intParam );
+
+
+class MinMaxPyramid {
+
+  const float *heights;         // heightfield, heights[ y*hfWidth + x ] (not owned)
+  int hfWidth, hfHeight;
+
+  int    nLevels;
+  int    levelWidth[MAX_PYRAMID_LEVELS];
+  int    levelHeight[MAX_PYRAMID_LEVELS];
+  float *levelMin[MAX_PYRAMID_LEVELS];
+  float *levelMax[MAX_PYRAMID_LEVELS];
+
+  float region[4];              // x0, y0, x1, y1 searched by intersect()
+
+  void updateCell( int level, int x, int y );
+  bool intersectCell( int level, int cx, int cy, vec3 &rayStart, vec3 &rayDir, vec3 &intPoint );
+  void release();
+
+ public:
+
+  MinMaxPyramid() {
+    heights = NULL;
+    nLevels = 0;
+  }
+
+  ~MinMaxPyramid() {
+    release();
+  }
+
+  void build( const float *heights, int width, int height );
+
+  // build() in two steps, so that the levels can be filled from
+  // elsewhere (e.g. a cache) instead
+
+  void allocate( const float *heights, int width, int height );
+  void fill();
+
+  // Recompute the cells that depend on texels [x0,x1] x [y0,y1] after
+  // those heights have changed
+
+  void update( int x0, int y0, int x1, int y1 );
+
+  // Nearest intersection of a ray with the heightfield (in its own
+  // coordinates), optionally limited to a region
+
+  bool intersect( vec3 rayStart, vec3 rayDir, vec3 &intPoint,
+                  float x0 = 0, float y0 = 0, float x1 = MAXFLOAT, float y1 = MAXFLOAT );
+
+  int levels() {
+    return nLevels;
+  }
+
+  int width( int level ) {
+    return levelWidth[level];
+  }
+
+  int height( int level ) {
+    return levelHeight[level];
+  }
+
+  float *minLevel( int level ) {
+    return levelMin[level];
+  }
+
+  float *maxLevel( int level ) {
+    return levelMax[level];
+  }
+
+  float minHeight( int level, int x, int y ) {
+    return levelMin[level][ y*levelWidth[level] + x ];
+  }
+
+  float maxHeight( int level, int x, int y ) {
+    return levelMax[level][ y*levelWidth[level] + x ];
+  }
+};
+
+
+#endif
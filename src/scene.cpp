@@ -56,10 +56,28 @@ Scene::Scene( char *sceneFilename, GLFWwindow *w )
    
   spline     = new Spline();
   ctrlPoints = new CtrlPoints( spline, window );
-  train      = new Train( spline );
+  trains     = new Trains( spline );
+  train      = trains->add( 0 );
+
+  recorder = NULL;
+  replay   = NULL;
+  profile  = new SpeedProfile();
+
+  frameCapture  = new FrameCapture();
+  capturePrefix = FRAME_CAPTURE_PREFIX;
+
+  clearanceVersion = 0;         // spline versions start at 1
+
+  terrain   = NULL;
+  sceneFile = NULL;
 
   read( sceneFilename );
 
+  // Textures read after startup are uploaded over several frames
+
+  textureUploader = new TextureUploader();
+  Terrain::textureUploader = textureUploader;
+
   // Miscellaneous stuff
 
   pause = false;
@@ -85,14 +103,14 @@ void Scene::draw( bool useItemTags )
 
   // model-view transform (i.e. OCS-to-VCS)
 
-  float diag = sqrt( terrain->texture->width*terrain->texture->width + terrain->texture->height*terrain->texture->height );
+  float diag = sqrt( (float) terrain->width*terrain->width + (float) terrain->height*terrain->height );
   
   VCStoCCS = perspective( fovy, 
                           windowWidth/(float)windowHeight, 
                           MAX(0.1,arcball->distToCentre - 1.2*diag),
                           arcball->distToCentre + 1.2*diag );
 
-  mat4 M = translate( -1*(int)(terrain->texture->width)/2, -1*(int)(terrain->texture->height)/2, 0 );
+  mat4 M = translate( -1*(int)(terrain->width)/2, -1*(int)(terrain->height)/2, 0 );
   mat4 V = arcball->V;
 
   mat4 MV = V * M;
@@ -128,10 +146,11 @@ void Scene::draw( bool useItemTags )
 
   gpu->deactivate();
 
-  // Draw train
+  // Draw trains
 
   if (ctrlPoints->count() > 1 && drawCoaster)
-    train->draw( MV, MVP, lightDir, flag );
+    for (int i=0; i<trains->count(); i++)
+      (*trains)[i]->draw( MV, MVP, lightDir, flag );
 
   // Now the axes
     
@@ -140,10 +159,29 @@ void Scene::draw( bool useItemTags )
     axes->draw( MVP );
   }
 
+  // Capture the frame, without the status message (and not the
+  // item tags drawn for picking)
+
+  if (frameCapture->active() && !useItemTags) {
+    int width, height;
+    glfwGetFramebufferSize( window, &width, &height );
+    frameCapture->capture( width, height );
+  }
+
   // Draw status message
 
   ostrstream message;
-  message << "using " << spline->name() << "        speed " << std::setprecision(2) << train->getSpeed() << '\0';
+  message << "using " << spline->name() << " and " << (train->getProfile() != NULL ? "speed profile" : integratorName[ train->getIntegrator() ]) << "        speed " << std::setprecision(2) << train->getSpeed();
+  if (trains->count() > 1)
+    message << "        " << trains->count() << " trains, " << trains->conflicts() << " conflicts" << (trains->getBlockBrakes() ? " (block brakes on)" : "");
+  if (ctrlPoints->count() > 1) {
+    if (clearanceVersion != spline->version()) {
+      trackClearance = terrain->clearance( *spline, CLEARANCE_SPACING, trackClearanceAt );
+      clearanceVersion = spline->version();
+    }
+    message << "        clearance " << std::setprecision(3) << trackClearance << (trackClearance < 0 ? " (underground)" : "");
+  }
+  message << '\0';
   render_text( message.str(), 10, 10, window );
 
   // Done
@@ -153,6 +191,32 @@ void Scene::draw( bool useItemTags )
 
 
 
+// Advance the simulation
+
+
+void Scene::update( float elapsedSeconds )
+
+{
+  if (ctrlPoints->count() > 1 && !pause) {
+
+    // Recompute the speed profile if the track has changed
+
+    if (train->getProfile() != NULL && !profile->isCurrent( spline )) {
+      train->computeProfile( profile );
+      for (int i=0; i<trains->count(); i++)
+        (*trains)[i]->setProfile( profile );
+    }
+
+    trains->advance( elapsedSeconds );
+  }
+
+  terrain->setTime(elapsedSeconds);
+
+  textureUploader->update();
+}
+
+
+
 // Key callback
 
 
@@ -160,7 +224,7 @@ void Scene::keyCallback( GLFWwindow* window, int key, int scancode, int action,
 
 {
   if (action == GLFW_PRESS)
-    switch (key) {
+    switch (key) {              // letter keys are reported as capitals, with or without shift
 
     case GLFW_KEY_ESCAPE:
       glfwSetWindowShouldClose( window, GL_TRUE );
@@ -205,6 +269,32 @@ void Scene::keyCallback( GLFWwindow* window, int key, int scancode, int action,
       spline->nextCOB();
       break;
 
+    case 'O':                   // toggle the precomputed speed profile
+      if (train->getProfile() != NULL)
+        for (int i=0; i<trains->count(); i++)
+          (*trains)[i]->setProfile( NULL );
+      else if (ctrlPoints->count() > 1) {
+        train->computeProfile( profile );
+        for (int i=0; i<trains->count(); i++)
+          (*trains)[i]->setProfile( profile );
+      }
+      break;
+
+    case 'N':                   // add a train in the largest gap
+      if (ctrlPoints->count() > 1) {
+        Train *t = trains->add();
+        t->setProfile( train->getProfile() );
+      }
+      break;
+
+    case 'B':                   // toggle block brakes
+      trains->setBlockBrakes( !trains->getBlockBrakes() );
+      break;
+
+    case 'I':                   // change the integrator
+      train->setIntegrator( (IntegratorType) ((train->getIntegrator() + 1) % NUM_INTEGRATORS) );
+      break;
+
     case '+':
     case '=':
       train->accelerate();
@@ -219,6 +309,11 @@ void Scene::keyCallback( GLFWwindow* window, int key, int scancode, int action,
       readView();
       break;
 
+    case 'L':                   // reload the scene
+      read( sceneFile );
+      cout << "Scene reloaded from '" << sceneFile << "' (" << TextureCache::resident() << " textures resident)." << endl;
+      break;
+
     case 'W':
       writeView();
       break;
@@ -227,6 +322,13 @@ void Scene::keyCallback( GLFWwindow* window, int key, int scancode, int action,
       showAxes = !showAxes;
       break;
 
+    case 'V':                   // start or stop capturing frames
+      if (capturing())
+        stopCapture();
+      else
+        startCapture();
+      break;
+
     case '/':  // = ?
       cout << "Click to add a control point." << endl
            << "Ctrl-click to delete a control point." << endl
@@ -235,15 +337,21 @@ void Scene::keyCallback( GLFWwindow* window, int key, int scancode, int action,
            << endl
 	   << "-/+ change train speed" << endl
            << "a - toggle arc length parameterization" << endl
+           << "b - toggle block brakes between trains" << endl
            << "c - toggle coaster drawing" << endl
            << "d - toggle debug mode (shows local coordinate frame on track)" << endl
            << "f - toggle flag (useful for debugging)" << endl
+           << "i - cycle through integrators" << endl
+           << "l - reload scene from '" << sceneFile << "'" << endl
            << "m - cycle through CoB matrices" << endl
+           << "n - add another train" << endl
+           << "o - toggle precomputed speed profile (-/+ have no effect while it is on)" << endl
            << "p - toggle pause" << endl
            << "r - read initial view" << endl
            << "s - store scene in '" << sceneFile << "'" << endl
            << "t - toggle track drawing" << endl
            << "u - toggle underside of terrain" << endl
+           << "v - start/stop capturing frames to '" << capturePrefix << "NNNNNN.png' at " << FRAME_CAPTURE_FPS << " fps" << endl
            << "w - write initial view (for use on next startup)" << endl
            << "x - toggle world axes" << endl
         ;
@@ -285,6 +393,95 @@ void Scene::writeView()
 
 
 
+// Record every physics step of the train to a telemetry file
+
+
+bool Scene::recordTelemetry( const char *filename )
+
+{
+  if (recorder == NULL)
+    recorder = new TelemetryRecorder();
+
+  if (!recorder->open( filename ))
+    return false;
+
+  train->setRecorder( recorder );
+  return true;
+}
+
+
+// Drive the train from a telemetry file instead of simulating it
+
+
+bool Scene::replayTelemetry( const char *filename )
+
+{
+  if (replay == NULL)
+    replay = new TelemetryReplay();
+
+  if (!replay->open( filename ))
+    return false;
+
+  cout << "Replaying " << replay->count() << " steps (" << replay->duration() << " seconds) from '" << filename << "'." << endl;
+
+  train->setReplay( replay );
+  return true;
+}
+
+
+// Flush and close any telemetry files
+
+
+void Scene::closeTelemetry()
+
+{
+  train->setRecorder( NULL );
+  train->setReplay( NULL );
+
+  if (recorder != NULL)
+    recorder->close();
+
+  if (replay != NULL)
+    replay->close();
+}
+
+
+// Capture each frame to a numbered PNG file, and advance the scene by
+// a fixed step each frame while doing so (see frameCapture.h)
+
+
+bool Scene::startCapture( const char *prefix )
+
+{
+  if (prefix != NULL)
+    capturePrefix = prefix;
+
+  if (!frameCapture->start( capturePrefix.c_str() ))
+    return false;
+
+  cout << "Capturing frames to '" << capturePrefix << "NNNNNN.png' at " << FRAME_CAPTURE_FPS << " fps." << endl;
+  return true;
+}
+
+
+void Scene::stopCapture()
+
+{
+  if (!capturing())
+    return;
+
+  frameCapture->stop();
+
+  int nCaptured, nWritten, nFailed, nWaits;
+  frameCapture->counts( nCaptured, nWritten, nFailed, nWaits );
+
+  cout << "Captured " << nCaptured << " frames (" << nWritten << " written, "
+       << nFailed << " failed; waited for the encoders on " << nWaits << ")." << endl;
+}
+
+
+
+
 // Return rayStart and rayDir for the ray in the WCS from the
 // viewpoint through the current mouse position (mouseX,mouseY).
 
@@ -343,7 +540,7 @@ void Scene::mouseButtonCallback( GLFWwindow* window, int button, int action, int
       vec3 start,dir;
       getMouseRay( xpos, ypos, start, dir ); // sets 'start' and 'dir'
 
-      mat4 M = translate( -1*(int)(terrain->texture->width)/2, -1*(int)(terrain->texture->height)/2, 0 );
+      mat4 M = translate( -1*(int)(terrain->width)/2, -1*(int)(terrain->height)/2, 0 );
 
       int hitID = ctrlPoints->findSelectedPoint( start, dir, M );
 
@@ -400,7 +597,7 @@ void Scene::mouseMovementCallback( GLFWwindow* window, double xpos, double ypos
   vec3 updir = arcball->upDirection();
   vec3 n     = (dir ^ updir).normalize();
 
-  mat4 M = translate( -1*(int)(terrain->texture->width)/2, -1*(int)(terrain->texture->height)/2, 0 );
+  mat4 M = translate( -1*(int)(terrain->width)/2, -1*(int)(terrain->height)/2, 0 );
 
   // Perform the action
 
@@ -457,7 +654,7 @@ void Scene::mouseClick( vec3 mousePosition, int keyModifiers )
 {
   // Find ray from eye through mouse
 
-  mat4 M = translate( -1*(int)(terrain->texture->width)/2, -1*(int)(terrain->texture->height)/2, 0 );
+  mat4 M = translate( -1*(int)(terrain->width)/2, -1*(int)(terrain->height)/2, 0 );
 
   vec3 start,dir;
   getMouseRay( mousePosition.x, mousePosition.y, start, dir ); // sets 'start' and 'dir'
@@ -493,7 +690,9 @@ void Scene::mouseClick( vec3 mousePosition, int keyModifiers )
 void Scene::read( const char *filename )
 
 {
-  sceneFile = strdup( filename );
+  char *name = strdup( filename ); // 'filename' may be 'sceneFile'
+  free( sceneFile );
+  sceneFile = name;
 
   // Find directory of this scene file
 
@@ -529,7 +728,13 @@ void Scene::read( const char *filename )
 
         std::cout << "got to terrain" << std::endl;
 
+        // Build the new terrain before freeing the old one, so that
+        // the textures they share stay resident
+
+        Terrain *oldTerrain = terrain;
         terrain = new Terrain(string(basePath), heightFile, textureFile);
+        delete oldTerrain;
+        startupPhase( "terrain shaders and mesh" );
       in >> cmd;
 
     } 
@@ -568,7 +773,7 @@ bool Scene::write()
     return false;
 
   out << "terrain" << endl;
-  out << "  " << terrain->heightfield->name << endl;
+  out << "  " << terrain->heightfieldName << endl;
   out << "  " << terrain->texture->name << endl;
   out << endl;
   out << "points" << endl;
@@ -608,7 +813,7 @@ void Scene::drawAllTrack( mat4 &MV, mat4 &MVP, vec3 lightDir )
     mat4 V = arcball->V;
     mat4 modelView;
     mat4 modelViewProjection;
-    mat4 M_base = translate(-1 * (int)(terrain->texture->width) / 2, -1 * (int)(terrain->texture->height) / 2, 0);
+    mat4 M_base = translate(-1 * (int)(terrain->width) / 2, -1 * (int)(terrain->height) / 2, 0);
     float scaleFactor = ss_inc;
 
 
@@ -12,12 +12,18 @@
 #include "spline.h"
 #include "ctrlPoints.h"
 #include "train.h"
+#include "trains.h"
+#include "telemetry.h"
+#include "speedProfile.h"
+#include "frameCapture.h"
 
 
 #define TRACK_PIECES_PER_SEG  20
 
 #define POST_COLOUR vec3(0.8,0.9,0.5)
 
+#define CLEARANCE_SPACING 1.0   // arc length between terrain clearance samples
+
 
 class Scene {
 
@@ -25,10 +31,28 @@ class Scene {
   Spline     *spline;
   CtrlPoints *ctrlPoints;
   char       *sceneFile;
-  Train      *train;
+  Trains     *trains;
+  Train      *train;              // the first train, which the user controls
   Arcball    *arcball;
   GPUProgram *gpu;
 
+  TextureUploader *textureUploader; // for textures of reloaded scenes
+
+  TelemetryRecorder *recorder;
+  TelemetryReplay   *replay;
+
+  SpeedProfile *profile;
+
+  FrameCapture *frameCapture;
+  string        capturePrefix;     // of the captured frames' files
+
+  // lowest height of the track above the terrain, recomputed when the
+  // spline changes
+
+  float        trackClearance;
+  float        trackClearanceAt;   // arc length
+  unsigned int clearanceVersion;
+
   GLFWwindow *window;
 
   mat4       VCStoCCS;
@@ -75,16 +99,23 @@ class Scene {
 
   void drawAllTrack( mat4 &MV, mat4 &MVP, vec3 lightDir );
 
-  void update( float elapsedSeconds ) {
-    if (ctrlPoints->count() > 1 && !pause)
-      train->advance( elapsedSeconds );
-    terrain->setTime(elapsedSeconds);
-  }
+  void update( float elapsedSeconds );
 
   void getMouseRay( int mouseX, int mouseY, vec3 &rayStart, vec3 &rayDir );
 
   void readView();
   void writeView();
+
+  bool recordTelemetry( const char *filename );
+  bool replayTelemetry( const char *filename );
+  void closeTelemetry();
+
+  bool startCapture( const char *prefix = NULL );
+  void stopCapture();
+
+  bool capturing() {
+    return frameCapture->active();
+  }
 };
 
 
@@ -0,0 +1,202 @@
+// speedProfile.cpp
+
+
+#include "speedProfile.h"
+#include "train.h"
+
+
+#define PROFILE_STALL_SPEED 0.01  // lowest speed, so that times stay finite
+
+
+// Integrate u = v^2/2 over arc length:
+//
+//    du/ds = a(s,v) = slope (G - drag/mass v) - friction G
+//
+// The slope term is integrated exactly as the height difference
+// across each interval, and v is taken at the interval midpoint.
+// Without drag or friction this gives exactly v^2/2 - G h = constant.
+//
+// Each lap starts from the sample at 'initialPos', where the speed is
+// 'initialSpeed', and wraps around the end of the track.  Repeat laps
+// until the speed at the end of a lap matches the start.
+
+
+void SpeedProfile::compute( Spline *spline, float initialPos, float initialSpeed, float drag, float mass, float friction, float minSpeed )
+
+{
+  float totalLength = spline->totalArcLength();
+
+  delete [] speed;
+  delete [] time;
+
+  n = spline->data.size() * DIVS_PER_SEG * PROFILE_SAMPLES_PER_DIV;
+  ds = totalLength / n;
+
+  speed = new float[ n+1 ];
+  time  = new double[ n+1 ];
+
+  float lowest = (minSpeed > PROFILE_STALL_SPEED ? minSpeed : PROFILE_STALL_SPEED);
+
+  // Heights do not change between laps
+
+  float *height = new float[ n+1 ];
+  for (int i=0; i<n; i++)
+    height[i] = spline->value( spline->paramAtArcLength( i * ds ) ).z;
+  height[n] = height[0];
+
+  int i0 = (int) (initialPos / ds + 0.5);
+  i0 = (i0 < 0 ? 0 : i0 % n);
+
+  float v0 = (initialSpeed > lowest ? initialSpeed : lowest);
+
+  for (int lap=0; lap<PROFILE_MAX_LAPS; lap++) {
+
+    float v = v0;
+
+    for (int k=0; k<n; k++) {
+
+      int i = (i0 + k) % n;
+      speed[i] = v;
+
+      float u = 0.5 * v * v;
+      float dh = height[i+1] - height[i];
+
+      float uMid = u + 0.5 * ((G - drag / mass * v) * dh - friction * G * ds);
+      float vMid = sqrt( uMid > 0 ? 2*uMid : 0 );
+
+      u += (G - drag / mass * vMid) * dh - friction * G * ds;
+      v = sqrt( u > 0 ? 2*u : 0 );
+      v = (v > lowest ? v : lowest);
+
+      if (i == n-1)
+        speed[n] = v;
+    }
+
+    if (fabs( v - v0 ) < PROFILE_TOLERANCE)
+      break;
+
+    v0 = v;
+  }
+
+  delete [] height;
+
+  // Time to reach each sample
+
+  time[0] = 0;
+  for (int i=0; i<n; i++)
+    time[i+1] = time[i] + intervalTime( i );
+
+  splineVersion = spline->version();
+}
+
+
+// Time to cross interval i.  With v linear in s, ds/dt = v0 + k(s-s0)
+// integrates to t = ln(v1/v0)/k.
+
+
+float SpeedProfile::intervalTime( int i )
+
+{
+  float v0 = speed[i];
+  float v1 = speed[i+1];
+  float k  = (v1 - v0) / ds;
+
+  if (fabs(k) * ds < 1e-4 * v0)
+    return ds / v0;
+
+  return log( v1/v0 ) / k;
+}
+
+
+float SpeedProfile::speedAt( float s )
+
+{
+  s = fmod( s, length() );
+  if (s < 0)
+    s += length();
+
+  int i = (int) (s / ds);
+  if (i > n-1)
+    i = n-1;
+
+  float p = s/ds - i;
+
+  return (1-p) * speed[i] + p * speed[i+1];
+}
+
+
+// Position at time t after the start of a lap.  'cursor' is the
+// interval found on the previous call; the search starts there.
+
+
+float SpeedProfile::posAtTime( double t, int &cursor )
+
+{
+  t = fmod( t, lapTime() );
+  if (t < 0)
+    t += lapTime();
+
+  if (cursor < 0 || cursor > n-1 || time[cursor] > t) {
+
+    // Went backward (e.g. a new lap): binary search
+
+    int l = 0;
+    int r = n;
+    while (r-l > 1) {
+      int m = (l+r)/2;
+      if (time[m] <= t)
+        l = m;
+      else
+        r = m;
+    }
+    cursor = l;
+
+  } else
+
+    while (cursor < n-1 && time[cursor+1] <= t)
+      cursor++;
+
+  // Invert t = ln(v/v0)/k within the interval
+
+  float v0 = speed[cursor];
+  float k  = (speed[cursor+1] - v0) / ds;
+  float tau = t - time[cursor];
+
+  float s;
+  if (fabs(k) * ds < 1e-4 * v0)
+    s = v0 * tau;
+  else
+    s = v0 * (exp( k * tau ) - 1) / k;
+
+  if (s > ds)
+    s = ds;
+
+  s += cursor * ds;
+
+  return (s < length() ? s : 0);
+}
+
+
+// Time after the start of a lap to reach position s
+
+
+double SpeedProfile::timeAtPos( float s )
+
+{
+  s = fmod( s, length() );
+  if (s < 0)
+    s += length();
+
+  int i = (int) (s / ds);
+  if (i > n-1)
+    i = n-1;
+
+  float v0 = speed[i];
+  float k  = (speed[i+1] - v0) / ds;
+  float sigma = s - i * ds;
+
+  if (fabs(k) * ds < 1e-4 * v0)
+    return time[i] + sigma / v0;
+
+  return time[i] + log( (v0 + k * sigma) / v0 ) / k;
+}
@@ -0,0 +1,77 @@
+// speedProfile.h
+//
+// Speed as a function of arc length, v(s), precomputed over the track
+// in one pass.
+//
+// Speed depends only on the track slope, drag, and friction, so it can
+// be found by integrating d(v^2/2)/ds = a(s,v) along the track instead
+// of stepping in time.  Speed is linear in s between samples, which
+// gives the time between samples, and the position at any time, in
+// closed form.
+//
+// With drag or friction the speed at the end of a lap differs from the
+// start, so the profile is iterated to the lap that the train settles
+// into.  Without them a single lap is exact.
+//
+// Any number of trains can share one profile.  Each keeps its own
+// cursor so that a lookup is O(1) for small time steps.
+
+
+#ifndef SPEED_PROFILE_H
+#define SPEED_PROFILE_H
+
+#include "headers.h"
+#include "spline.h"
+
+
+#define PROFILE_SAMPLES_PER_DIV 4    // profile samples per arc length table interval
+#define PROFILE_MAX_LAPS        50   // iterations to find the settled lap
+#define PROFILE_TOLERANCE       1e-3 // speed difference at which a lap has settled
+
+
+class SpeedProfile {
+
+  int    n;                     // number of intervals
+  float  ds;                    // arc length per interval
+  float *speed;                 // speed[i] at s = i*ds, for i in [0,n]
+  double *time;                 // time[i] to reach s = i*ds from s = 0
+
+  unsigned int splineVersion;   // version of the spline this was computed from
+
+  float intervalTime( int i );
+
+ public:
+
+  SpeedProfile() {
+    n = 0;
+    speed = NULL;
+    time = NULL;
+    splineVersion = 0;
+  }
+
+  ~SpeedProfile() {
+    delete [] speed;
+    delete [] time;
+  }
+
+  void compute( Spline *spline, float initialPos, float initialSpeed, float drag, float mass, float friction, float minSpeed ); // speed at arc length initialPos
+
+  bool isCurrent( Spline *spline ) {
+    return n > 0 && splineVersion == spline->version();
+  }
+
+  float length() {
+    return n * ds;
+  }
+
+  double lapTime() {
+    return time[n];
+  }
+
+  float  speedAt( float s );
+  float  posAtTime( double t, int &cursor );
+  double timeAtPos( float s );
+};
+
+
+#endif
@@ -294,6 +294,7 @@ void Spline::computeArcLengthParameterization()
   if (next.z > maxHeight)
     maxHeight = next.z;
   
+  arcLengthVersion++;
   mustRecomputeArcLength = false;
 }
 
@@ -311,8 +312,15 @@ float Spline::paramAtArcLength( float s )
   //
   //        arcLength[l] <= s < arcLength[l+1].
 
-  if (s < 0)
-    s += arcLength[ data.size() * DIVS_PER_SEG ];
+  // The track is closed, so wrap s into [0,totalLength)
+
+  float totalLength = arcLength[ data.size() * DIVS_PER_SEG ];
+
+  if (s < 0 || s >= totalLength) {
+    s = fmod( s, totalLength );
+    if (s < 0)
+      s += totalLength;
+  }
 
   int l = 0;
   int r = data.size()*DIVS_PER_SEG;
@@ -340,6 +348,27 @@ float Spline::paramAtArcLength( float s )
 
 
 
+// Find dz/ds, the rate of change of height with arc length, at arc
+// length s.  This is the exact derivative of value(paramAtArcLength(s)).z,
+// so it is consistent with the piecewise-linear arc length table.
+
+
+float Spline::slopeAtArcLength( float s )
+
+{
+  float t = paramAtArcLength( s );
+
+  int l = (int) (t * DIVS_PER_SEG);
+  if (l > data.size() * DIVS_PER_SEG - 1)
+    l = data.size() * DIVS_PER_SEG - 1;
+
+  float dtds = 1 / (DIVS_PER_SEG * (arcLength[l+1] - arcLength[l]));
+
+  return tangent( t ).z * dtds;
+}
+
+
+
 float Spline::totalArcLength()
 
 {
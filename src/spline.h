@@ -27,6 +27,7 @@ class Spline {
   void computeArcLengthParameterization();
   float *arcLength;
   float maxHeight;
+  unsigned int arcLengthVersion; // incremented each time the arc length table is recomputed
 
  public:
 
@@ -36,6 +37,7 @@ class Spline {
   Spline() {
     mustRecomputeArcLength = true;
     arcLength = NULL;
+    arcLengthVersion = 0;
     currSpline = 0;
   }
 
@@ -61,10 +63,20 @@ class Spline {
     return maxHeight;
   }
 
+  // Changes whenever the curve changes, so that data derived from
+  // the curve can tell when it is stale.
+
+  unsigned int version() {
+    if (mustRecomputeArcLength)
+      computeArcLengthParameterization();
+    return arcLengthVersion;
+  }
+
   void draw( mat4 &MV, mat4 &MVP, vec3 lightDir, bool drawIntervals );
   void drawWithArcLength( mat4 &MV, mat4 &MVP, vec3 lightDir, bool drawIntervals );
   void addPoint( vec3 v );
   float paramAtArcLength( float s );
+  float slopeAtArcLength( float s );
   float totalArcLength();
 
   void findLocalSystem( float t, vec3 &o, vec3 &x, vec3 &y, vec3 &z );
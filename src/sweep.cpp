@@ -0,0 +1,288 @@
+// sweep.cpp
+
+
+#include "sweep.h"
+#include "tools.h"
+#include "train.h"
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <iomanip>
+#include <sstream>
+
+
+#define SWEEP_MAX_SECONDS  600   // give up on a run after this much simulated time
+#define SWEEP_STALL_MERGE  10    // stalls closer than this (in arc length) are reported once
+#define SWEEP_MAX_STALLS   5     // stall locations printed per run
+
+
+struct SweepRun {
+
+  // parameters
+
+  float speed, mass, drag, minSpeed;
+
+  // results
+
+  bool   completed;
+  double completionTime;
+  float  lowestSpeed;
+  float  peakG;
+  std::vector<float> stalls;    // arc lengths at which the speed first fell below minSpeed
+};
+
+
+// Parse 'a', 'a,b,c', or 'lo:hi:step' into a list of values
+
+static bool parseValues( const char *text, std::vector<float> &values )
+
+{
+  values.clear();
+
+  float lo, hi, step;
+
+  if (sscanf( text, "%f:%f:%f", &lo, &hi, &step ) == 3) {
+    if (step <= 0 || hi < lo)
+      return false;
+    for (int i=0; lo + i*step <= hi + 0.5*step; i++)
+      values.push_back( lo + i*step );
+    return true;
+  }
+
+  stringstream in( text );
+  string item;
+  while (getline( in, item, ',' ))
+    values.push_back( atof( item.c_str() ) );
+
+  return !values.empty();
+}
+
+
+// Simulate one run.  'spline' is shared by all workers and is not
+// modified.
+
+static void simulate( Spline *spline, SweepRun &run, float dt, int laps )
+
+{
+  Train train( spline );
+
+  train.setSpeed( run.speed );
+  train.setMass( run.mass );
+  train.setDrag( run.drag );
+  train.setMinSpeed( run.minSpeed );
+
+  vec3 prevVel = run.speed * spline->tangent( spline->paramAtArcLength( 0 ) ).normalize();
+
+  run.completed = false;
+  run.lowestSpeed = run.speed;
+  run.peakG = 0;
+  run.stalls.clear();
+
+  bool inStall = false;
+
+  while (train.getTime() < SWEEP_MAX_SECONDS) {
+
+    train.advance( dt );
+
+    if (train.getLaps() >= laps) {
+      run.completed = true;
+      run.completionTime = train.getTime();
+      break;
+    }
+
+    float v = train.getSpeed();
+
+    if (v < run.lowestSpeed)
+      run.lowestSpeed = v;
+
+    // g-force felt by a rider: (acceleration - gravity) / G.  The
+    // simulation accelerates the train by +G times the vertical slope
+    // (see trackAccel()), so its gravity is (0,0,+G).
+
+    vec3 vel = v * spline->tangent( spline->paramAtArcLength( train.getPos() ) ).normalize();
+    vec3 a = (1/dt) * (vel - prevVel);
+    prevVel = vel;
+
+    float g = (a - vec3(0,0,G)).length() / G;
+    if (g > run.peakG)
+      run.peakG = g;
+
+    // Stalls.  Below minSpeed the train is pushed back up to exactly
+    // minSpeed, so it is still stalled while v <= minSpeed.  Report
+    // where each stall starts.
+
+    bool stalled = (v < run.minSpeed || (inStall && v <= run.minSpeed));
+
+    if (stalled && !inStall) {
+      float s = train.getPos();
+      if (run.stalls.empty() || fabs( s - run.stalls.back() ) > SWEEP_STALL_MERGE)
+        run.stalls.push_back( s );
+    }
+
+    inStall = stalled;
+  }
+}
+
+
+int runSweep( int argc, char **argv )
+
+{
+  if (argc < 3) {
+    cerr << "Usage: " << argv[0] << " -sweep scene_file [speed=..] [mass=..] [drag=..] [minSpeed=..] [dt=..] [laps=..] [cob=..] [threads=..]" << endl;
+    return 1;
+  }
+
+  // Defaults match the interactive simulation
+
+  std::vector<float> speeds( 1, 70 );
+  std::vector<float> masses( 1, 1 );
+  std::vector<float> drags( 1, DEFAULT_DRAG );
+  std::vector<float> minSpeeds( 1, DEFAULT_MIN_SPEED );
+
+  float dt = 1/60.0;
+  int laps = 1;
+  int cob = 0;
+  int nThreads = std::thread::hardware_concurrency();
+
+  for (int i=3; i<argc; i++) {
+
+    const char *eq = strchr( argv[i], '=' );
+    if (eq == NULL) {
+      cerr << "Expected name=value, not '" << argv[i] << "'." << endl;
+      return 1;
+    }
+
+    string name( argv[i], eq - argv[i] );
+    const char *value = eq+1;
+    bool ok = true;
+
+    if (name == "speed")
+      ok = parseValues( value, speeds );
+    else if (name == "mass")
+      ok = parseValues( value, masses );
+    else if (name == "drag")
+      ok = parseValues( value, drags );
+    else if (name == "minSpeed")
+      ok = parseValues( value, minSpeeds );
+    else if (name == "dt")
+      dt = atof( value );
+    else if (name == "laps")
+      laps = atoi( value );
+    else if (name == "cob")
+      cob = atoi( value );
+    else if (name == "threads")
+      nThreads = atoi( value );
+    else {
+      cerr << "Unknown sweep parameter '" << name << "'." << endl;
+      return 1;
+    }
+
+    for (float m : masses)
+      ok = ok && m > 0;
+    for (float d : drags)
+      ok = ok && d >= 0;
+    for (float s : minSpeeds)
+      ok = ok && s >= 0;
+
+    if (!ok || dt <= 0 || laps < 1) {
+      cerr << "Bad value in '" << argv[i] << "'." << endl;
+      return 1;
+    }
+  }
+
+  if (nThreads < 1)
+    nThreads = 1;
+
+  // Read and bake the track once
+
+  Spline spline;
+  CtrlPoints ctrlPoints( &spline, NULL );
+
+  if (!readTrack( argv[2], &ctrlPoints ))
+    return 1;
+
+  for (int i=0; i<cob; i++)
+    spline.nextCOB();
+
+  float length = spline.totalArcLength(); // computes the arc length table
+
+  // Build the grid
+
+  std::vector<SweepRun> runs;
+
+  for (float speed : speeds)
+    for (float mass : masses)
+      for (float drag : drags)
+        for (float minSpeed : minSpeeds) {
+          SweepRun run;
+          run.speed = speed;
+          run.mass = mass;
+          run.drag = drag;
+          run.minSpeed = minSpeed;
+          runs.push_back( run );
+        }
+
+  cerr << runs.size() << " runs of " << laps << " lap(s) on a " << spline.name()
+       << " track of length " << length << " using " << nThreads << " thread(s)" << endl;
+
+  // Run on all workers.  Each takes the next unclaimed run.
+
+  std::atomic<int> next( 0 );
+
+  auto worker = [&]() {
+    int i;
+    while ((i = next++) < (int) runs.size())
+      simulate( &spline, runs[i], dt, laps );
+  };
+
+  std::vector<std::thread> workers;
+  for (int i=0; i<nThreads; i++)
+    workers.push_back( std::thread( worker ) );
+  for (auto &w : workers)
+    w.join();
+
+  // Print results
+
+  cout << setw(8) << "speed"
+       << setw(8) << "mass"
+       << setw(8) << "drag"
+       << setw(10) << "minSpeed"
+       << setw(12) << "time"
+       << setw(10) << "lowest"
+       << setw(8) << "peakG"
+       << "  stalls" << endl;
+
+  cout << fixed;
+
+  for (auto &run : runs) {
+
+    cout << setprecision(2)
+         << setw(8) << run.speed
+         << setw(8) << run.mass
+         << setw(8) << run.drag
+         << setw(10) << run.minSpeed;
+
+    if (run.completed)
+      cout << setw(12) << run.completionTime;
+    else
+      cout << setw(12) << "DNF";
+
+    cout << setw(10) << run.lowestSpeed
+         << setw(8) << run.peakG
+         << "  ";
+
+    if (run.stalls.empty())
+      cout << "-";
+
+    for (unsigned int i=0; i<run.stalls.size() && i<SWEEP_MAX_STALLS; i++)
+      cout << (i > 0 ? "," : "") << setprecision(0) << run.stalls[i];
+
+    if (run.stalls.size() > SWEEP_MAX_STALLS)
+      cout << " (+" << run.stalls.size() - SWEEP_MAX_STALLS << " more)";
+
+    cout << endl;
+  }
+
+  return 0;
+}
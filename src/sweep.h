@@ -0,0 +1,34 @@
+// sweep.h
+//
+// Parameter sweep for ride tuning.
+//
+// Runs the train headlessly over every combination of a grid of
+// parameters and prints one row per combination:
+//
+//    rollercoaster -sweep scene_file [name=values ...]
+//
+// Parameters (each takes a single value, a list 'a,b,c', or a range
+// 'lo:hi:step'):
+//
+//    speed     initial speed
+//    mass      train mass (scales the drag)
+//    drag      drag coefficient
+//    minSpeed  minimum-speed threshold
+//
+// Options (single values):
+//
+//    dt        time step in seconds
+//    laps      laps to complete
+//    cob       change-of-basis matrix index (0 = linear, ...)
+//    threads   worker threads (default: all cores)
+//
+// All runs share one spline, whose arc length table is computed
+// before the workers start and is read-only after that.
+
+
+#ifndef SWEEP_H
+#define SWEEP_H
+
+int runSweep( int argc, char **argv );
+
+#endif
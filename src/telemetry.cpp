@@ -0,0 +1,295 @@
+// telemetry.cpp
+
+
+#include "telemetry.h"
+
+#ifndef _WIN32
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+
+
+// ---------------- TelemetryRecorder ----------------
+
+
+bool TelemetryRecorder::open( const char *filename )
+
+{
+  close();
+
+  file = fopen( filename, "wb" );
+
+  if (file == NULL) {
+    cerr << "Could not open telemetry file '" << filename << "' for writing." << endl;
+    return false;
+  }
+
+  TelemetryHeader header;
+  memset( &header, 0, sizeof(header) );
+  strncpy( header.magic, TELEMETRY_MAGIC, sizeof(header.magic) );
+  header.version = TELEMETRY_VERSION;
+  header.recordSize = sizeof(TelemetryRecord);
+
+  fwrite( &header, sizeof(header), 1, file );
+
+  block.reserve( TELEMETRY_BLOCK_SIZE );
+  closing = false;
+
+  writer = std::thread( &TelemetryRecorder::writeBlocks, this );
+
+  return true;
+}
+
+
+// Called from the simulation.  Only touches the lock when a block
+// fills up.
+
+void TelemetryRecorder::record( const TelemetryRecord &rec )
+
+{
+  if (file == NULL)
+    return;
+
+  block.push_back( rec );
+
+  if (block.size() == TELEMETRY_BLOCK_SIZE) {
+
+    {
+      std::lock_guard<std::mutex> guard( lock );
+      pending.push_back( std::vector<TelemetryRecord>() );
+      pending.back().swap( block );
+    }
+
+    wakeWriter.notify_one();
+    block.reserve( TELEMETRY_BLOCK_SIZE );
+  }
+}
+
+
+// Background thread: write full blocks until closed
+
+void TelemetryRecorder::writeBlocks()
+
+{
+  std::unique_lock<std::mutex> guard( lock );
+
+  while (true) {
+
+    wakeWriter.wait( guard, [this] { return closing || !pending.empty(); } );
+
+    while (!pending.empty()) {
+
+      std::vector<TelemetryRecord> full;
+      full.swap( pending.front() );
+      pending.pop_front();
+
+      guard.unlock();
+      fwrite( full.data(), sizeof(TelemetryRecord), full.size(), file );
+      guard.lock();
+    }
+
+    if (closing)
+      break;
+  }
+}
+
+
+// Flush the partial block, stop the writer, and close the file
+
+void TelemetryRecorder::close()
+
+{
+  if (file == NULL)
+    return;
+
+  {
+    std::lock_guard<std::mutex> guard( lock );
+    if (!block.empty()) {
+      pending.push_back( std::vector<TelemetryRecord>() );
+      pending.back().swap( block );
+    }
+    closing = true;
+  }
+
+  wakeWriter.notify_one();
+  writer.join();
+
+  fclose( file );
+  file = NULL;
+}
+
+
+// ---------------- TelemetryReplay ----------------
+
+
+bool TelemetryReplay::open( const char *filename )
+
+{
+  close();
+
+#ifndef _WIN32
+
+  int fd = ::open( filename, O_RDONLY );
+  if (fd < 0) {
+    cerr << "Could not open telemetry file '" << filename << "'." << endl;
+    return false;
+  }
+
+  struct stat st;
+  fstat( fd, &st );
+  mappingSize = st.st_size;
+
+  if (mappingSize >= sizeof(TelemetryHeader)) {
+    void *p = mmap( NULL, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0 );
+    if (p != MAP_FAILED) {
+      mapping = (unsigned char *) p;
+      madvise( p, mappingSize, MADV_SEQUENTIAL );
+    }
+  }
+
+  ::close( fd );
+
+#else
+
+  // No mmap: read the whole file
+
+  FILE *in = fopen( filename, "rb" );
+  if (in == NULL) {
+    cerr << "Could not open telemetry file '" << filename << "'." << endl;
+    return false;
+  }
+
+  fseek( in, 0, SEEK_END );
+  mappingSize = ftell( in );
+  rewind( in );
+
+  if (mappingSize >= sizeof(TelemetryHeader)) {
+    mapping = new unsigned char[ mappingSize ];
+    mappingSize = fread( mapping, 1, mappingSize, in );
+  }
+
+  fclose( in );
+
+#endif
+
+  if (mapping == NULL) {
+    cerr << "Telemetry file '" << filename << "' is empty or could not be read." << endl;
+    mappingSize = 0;
+    return false;
+  }
+
+  TelemetryHeader *header = (TelemetryHeader *) mapping;
+
+  if (strncmp( header->magic, TELEMETRY_MAGIC, sizeof(header->magic) ) != 0 ||
+      header->version != TELEMETRY_VERSION ||
+      header->recordSize != sizeof(TelemetryRecord)) {
+    cerr << "Telemetry file '" << filename << "' has an unknown format." << endl;
+    close();
+    return false;
+  }
+
+  records  = (TelemetryRecord *) (mapping + sizeof(TelemetryHeader));
+  nRecords = (mappingSize - sizeof(TelemetryHeader)) / sizeof(TelemetryRecord); // ignores a partial last record
+
+  buildIndex();
+
+  return true;
+}
+
+
+void TelemetryReplay::close()
+
+{
+  if (mapping != NULL) {
+#ifndef _WIN32
+    munmap( mapping, mappingSize );
+#else
+    delete [] mapping;
+#endif
+  }
+
+  mapping = NULL;
+  mappingSize = 0;
+  records = NULL;
+  nRecords = 0;
+  index.clear();
+}
+
+
+// Record times are non-decreasing, so one pass fills the index.
+
+void TelemetryReplay::buildIndex()
+
+{
+  index.clear();
+
+  if (nRecords == 0)
+    return;
+
+  unsigned int nBuckets = (unsigned int) (duration() / TELEMETRY_INDEX_INTERVAL) + 1;
+  index.resize( nBuckets );
+
+  unsigned int r = 0;
+  for (unsigned int k=0; k<nBuckets; k++) {
+    double t = k * TELEMETRY_INDEX_INTERVAL;
+    while (r < nRecords-1 && records[r].time < t)
+      r++;
+    index[k] = r;
+  }
+}
+
+
+// Return the state at 'time', linearly interpolated between the two
+// bracketing records.  Times outside the recording are clamped.
+// Returns false if there is nothing to replay.
+
+bool TelemetryReplay::sample( double time, TelemetryRecord &rec )
+
+{
+  if (nRecords == 0)
+    return false;
+
+  if (time <= records[0].time) {
+    rec = records[0];
+    return true;
+  }
+
+  if (time >= records[nRecords-1].time) {
+    rec = records[nRecords-1];
+    return true;
+  }
+
+  // Start at the bucket's first record (which is at or after the
+  // bucket start) and back up one, then scan forward within the
+  // bucket.
+
+  unsigned int k = (unsigned int) (time / TELEMETRY_INDEX_INTERVAL);
+  if (k >= index.size())
+    k = index.size()-1;
+
+  unsigned int i = index[k];
+  if (i > 0)
+    i--;
+
+  while (i < nRecords-2 && records[i+1].time <= time)
+    i++;
+
+  TelemetryRecord &r0 = records[i];
+  TelemetryRecord &r1 = records[i+1];
+
+  float dt = r1.time - r0.time;
+  float a = (dt > 0 ? (time - r0.time) / dt : 0);
+  float b = 1-a;
+
+  rec.time  = time;
+  rec.pos   = (r1.pos >= r0.pos ? b * r0.pos + a * r1.pos : r1.pos); // pos wraps at the end of each lap
+  rec.speed = b * r0.speed + a * r1.speed;
+  rec.accel = b * r0.accel + a * r1.accel;
+  rec.o     = b * r0.o + a * r1.o;
+  rec.y     = (b * r0.y + a * r1.y).normalize();
+  rec.z     = (b * r0.z + a * r1.z).normalize();
+
+  return true;
+}
@@ -0,0 +1,125 @@
+// telemetry.h
+//
+// Binary recording and replay of the train state.
+//
+// A TelemetryRecorder appends one fixed-size TelemetryRecord per
+// physics step to a file.  Records are collected in blocks on the
+// simulation thread and written by a background thread, so recording
+// does not slow the simulation.
+//
+// A TelemetryReplay maps a recorded file into memory and returns the
+// (interpolated) state at any time.  A sparse index of the first
+// record in each TELEMETRY_INDEX_INTERVAL of time makes the seek O(1).
+//
+// File layout:
+//
+//    TelemetryHeader
+//    TelemetryRecord[]   (until end of file)
+
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include "headers.h"
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
+
+
+#define TELEMETRY_MAGIC          "RCTELEM"
+#define TELEMETRY_VERSION        1
+#define TELEMETRY_BLOCK_SIZE     4096   // records per background write
+#define TELEMETRY_INDEX_INTERVAL 0.25   // seconds between sparse index entries
+
+
+struct TelemetryHeader {
+  char     magic[8];
+  uint32_t version;
+  uint32_t recordSize;
+};
+
+
+struct TelemetryRecord {
+  double time;                  // simulation time
+  float  pos;                   // arc length along the spline
+  float  speed;
+  float  accel;
+  vec3   o, y, z;               // pose: origin, up, and forward (x = z ^ y)
+};
+
+
+class TelemetryRecorder {
+
+  FILE *file;
+
+  std::vector<TelemetryRecord> block; // block being filled by the simulation
+  std::deque< std::vector<TelemetryRecord> > pending; // full blocks awaiting the writer
+
+  std::thread             writer;
+  std::mutex              lock;
+  std::condition_variable wakeWriter;
+  bool                    closing;
+
+  void writeBlocks();
+
+ public:
+
+  TelemetryRecorder() {
+    file = NULL;
+    closing = false;
+  }
+
+  ~TelemetryRecorder() {
+    close();
+  }
+
+  bool open( const char *filename );
+  void record( const TelemetryRecord &rec );
+  void close();
+};
+
+
+class TelemetryReplay {
+
+  unsigned char   *mapping;     // whole file
+  size_t           mappingSize;
+  TelemetryRecord *records;
+  unsigned int     nRecords;
+
+  std::vector<unsigned int> index; // index[k] = first record with time >= k * TELEMETRY_INDEX_INTERVAL
+
+  void buildIndex();
+
+ public:
+
+  TelemetryReplay() {
+    mapping = NULL;
+    mappingSize = 0;
+    records = NULL;
+    nRecords = 0;
+  }
+
+  ~TelemetryReplay() {
+    close();
+  }
+
+  bool open( const char *filename );
+  void close();
+
+  unsigned int count() {
+    return nRecords;
+  }
+
+  double duration() {
+    return (nRecords > 0 ? records[nRecords-1].time : 0);
+  }
+
+  bool sample( double time, TelemetryRecord &rec );
+};
+
+
+#endif
@@ -3,6 +3,22 @@
 
 #include "terrain.h"
 #include "main.h"
+#include "terrainNormals.h"
+#include "terrainHeights.h"
+#include "heightfield.h"
+#include "spline.h"
+
+#include <vector>
+#include <iomanip>
+#include <chrono>
+
+
+static_assert( TERRAIN_CHUNK_LODS == CACHE_CHUNK_LODS, "cache records must hold every level" );
+
+
+bool Terrain::gpuDisplacement = false;
+
+TextureUploader *Terrain::textureUploader = NULL;
 
 
 #define CURTAIN_COLOUR 0.6,0.6,0.4
@@ -11,274 +27,510 @@
 
 #define VERTEX(x,y,z)  glVertex3f(x,y,z)
 
+#define WATER_LEVEL 10
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+
+void *alignedAlloc( size_t size )
+
+{
+#ifdef _WIN32
+  return _aligned_malloc( size, HEIGHT_ALIGNMENT );
+#else
+  void *p;
+  if (posix_memalign( &p, HEIGHT_ALIGNMENT, size ) != 0)
+    return NULL;
+  return p;
+#endif
+}
+
+
+void alignedFree( void *p )
+
+{
+#ifdef _WIN32
+  _aligned_free( p );
+#else
+  free( p );
+#endif
+}
+
+
 void Terrain::readTextures( string basePath, string heightfieldFilename, string textureFilename, string distortionFilename, string normalFilename)
 
 {
-  heightfield = new Texture( basePath, heightfieldFilename );
-  texture = new Texture( basePath, textureFilename );
-  distortionTex = new Texture(basePath, distortionFilename);
-  normalTex = new Texture(basePath, normalFilename);
-
-  // Store texture map as a vec3 array.  Create a border around it
-  // to allow indexing one beyond the texture.
-
-  points = new vec3*[ heightfield->width + 2 ];
-  for (unsigned int x=0; x<heightfield->width + 2; x++)
-    points[x] = new vec3[ heightfield->height + 2 ];
-
-  for (unsigned int x=0; x<heightfield->width; x++)
-    for (unsigned int y=0; y<heightfield->height; y++) {
-      float alpha;
-      float height = heightfield->texel(x, y, alpha).x * 0.1*heightfield->width; // max height is 10% of width
-      points[x][y] = vec3(x,y, 10);
-    }
+  heightfieldName = heightfieldFilename;
 
-  // Compute normals for the texture map
+  string path = basePath + "/" + heightfieldFilename;
 
-  normals = new vec3*[ heightfield->width ];
-  for (unsigned int x=0; x<heightfield->width; x++) {
-    normals[x] = new vec3[ heightfield->height ];
-    for (unsigned int y=0; y<heightfield->height; y++) {
+  if (heightfieldFilename.size() > strlen( TERRAIN_TILES_SUFFIX ) &&
+      heightfieldFilename.compare( heightfieldFilename.size() - strlen( TERRAIN_TILES_SUFFIX ), string::npos, TERRAIN_TILES_SUFFIX ) == 0) {
 
-      // average the face normals around heightfield[x][y]
+    // Tiled terrain, streamed in as the eye moves
 
-      int offsets[8][2] = { {1,0}, {1,1}, {0,1}, {-1,1}, {-1,0}, {-1,-1}, {0,-1}, {1,-1} };
+    tiles = new TerrainTiles();
+    displaced = false;          // tiles have their own vertex buffers
 
-      int count = 0;
-      vec3 sum(0,0,0);
-      vec3 &c = points[x][y];
+    if (!tiles->open( path.c_str() ))
+      exit(1);
 
-      for (int i=0; i<8; i++) {
+    width = tiles->width;
+    height = tiles->height;
 
-        int cwx = x+offsets[i][0];
-        int cwy = y+offsets[i][1];
+    startupPhase( "terrain tiles" );
+  }
 
-        int ccwx = x+offsets[(i+1)%8][0];
-        int ccwy = y+offsets[(i+1)%8][1];
+  // Read the heightfield and decode the textures in parallel.  The
+  // textures are uploaded as they are decoded, or, with a
+  // textureUploader, in the frames that follow.
+
+  TextureLoader loader;
+  bool   heightfieldRead = true;
+  double heightfieldSecs = 0;
+
+  if (tiles == NULL)
+    loader.run( [&]() {
+      auto start = std::chrono::steady_clock::now();
+      heightfieldRead = openCache( path ) || readHeightfield( path ); // use the cache if it is current
+      heightfieldSecs = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+    } );
+
+  if (textureUploader != NULL) {
+    texture = textureUploader->load( basePath, textureFilename );
+    distortionTex = textureUploader->load( basePath, distortionFilename );
+    normalTex = textureUploader->load( basePath, normalFilename );
+  } else {
+    texture = loader.load( basePath, textureFilename ); // shared with other terrains through the TextureCache
+    distortionTex = loader.load( basePath, distortionFilename );
+    normalTex = loader.load( basePath, normalFilename );
+  }
 
-        if (cwx >= 0 && cwx < (int) heightfield->width &&
-            cwy >= 0 && cwy < (int) heightfield->height &&
-            ccwx >= 0 && ccwx < (int) heightfield->width &&
-            ccwy >= 0 && ccwy < (int) heightfield->height) {
+  loader.finish();
 
-          vec3 &cw = points[cwx][cwy];
-          vec3 &ccw = points[ccwx][ccwy];
-          vec3 n = ((cw-c) ^ (ccw-c)).normalize();
-          sum = sum + n;
-          count++;
-        }
+  if (!heightfieldRead)
+    exit(1);
+
+  if (startingUp) {
+    startupPhase( "terrain and textures" );
+    cerr << "         heightfield " << std::fixed << std::setprecision(3) << heightfieldSecs << " s; "
+         << loader.nDecoded << " textures decoded: longest " << loader.decodeMax << " s, sum " << loader.decodeSum << " s" << endl;
+    cerr.unsetf( std::ios::floatfield );
+  }
+}
+
+
+Terrain::~Terrain()
+
+{
+  TextureCache::release( texture );
+  TextureCache::release( distortionTex );
+  TextureCache::release( normalTex );
+
+  if (tiles != NULL) {
+    tiles->releaseGL();
+    delete tiles;
+  }
+
+  if (!cache.isOpen() || heights != cache.heights()) // else mapped from the cache
+    alignedFree( heights );
+  releaseNormals();
+
+  if (chunks != NULL) {
+    for (int c=0; c<nChunksX*nChunksY; c++)
+      if (chunks[c].VAO != gridVAO) {
+        glDeleteVertexArrays( 1, &chunks[c].VAO );
+        glDeleteBuffers( 1, &chunks[c].VBO );
       }
+    delete[] chunks;
 
-      normals[x][y] = (1/(float)count) * sum;
-    }
+    for (int l=0; l<TERRAIN_CHUNK_LODS; l++)
+      glDeleteBuffers( 16, lodIndexBuffer[l] );
+  }
+
+  if (displaced) {
+    glDeleteVertexArrays( 1, &gridVAO );
+    glDeleteTextures( 1, &heightTextureID );
   }
+
+  Segs::deleteVAO( undersideVAO );
+  Segs::deleteVAO( curtainVAO );
 }
 
 
+// Read the heightfield (see heightfield.h) and compute heights,
+// normals, and the min/max pyramid
 
-void Terrain::setupVAO()
+
+bool Terrain::readHeightfield( string filename )
 
 {
-  // Set up buffers of vertices, normals, and texture coordinates.
+  HeightfieldReader reader;
 
-  int nVerts = heightfield->width * heightfield->height;
+  if (!reader.open( filename ))
+    return false;
 
-  GLfloat *vertexBuffer = new GLfloat[ nVerts * 3 ];
-  GLfloat *normalBuffer = new GLfloat[ nVerts * 3 ];
-  GLfloat *texCoordBuffer = new GLfloat[ nVerts * 2 ];
+  width = reader.width;
+  height = reader.height;
 
-  vec3 *v = (vec3*) vertexBuffer;
-  vec3 *n = (vec3*) normalBuffer;
-  vec2 *t = (vec2*) texCoordBuffer;
+  if (width < 2 || height < 2) {
+    cerr << "Heightfield '" << filename << "' is smaller than 2x2." << endl;
+    return false;
+  }
 
-  for (unsigned int y=0; y<heightfield->height; y++)
-    for (unsigned int x=0; x<heightfield->width; x++) {
-      *v++ = points[x][y];
-      *n++ = normals[x][y];
-      *t++ = vec2( x/(float)( heightfield->width-1), y/(float)(heightfield->height-1) );
-    }
-      
-  // set up triangular faces to cover the terrain
+  // 8-bit heightfields are only placeholders for the water surface,
+  // which is flat.  16-bit and raw heightfields are terrain.
 
-  nFaces = 2 * (heightfield->width - 1) * (heightfield->height - 1);
+  bool flatWater = (reader.bitDepth == 8);
 
-  GLuint *indexBuffer = new GLuint[ nFaces * 3 ];
+  // Store the heights in one contiguous buffer
 
-  GLuint *i = indexBuffer;
+  heights = (float *) alignedAlloc( width * height * sizeof(float) );
 
-  int k = 0;  // = index into v/n/t buffers of current LL corner (min x, min y) of current quad
+  for (unsigned int y=0; y<height; y++) {
+    float *row = heights + y*width;
+    if (!reader.readRow( y, row ))
+      return false;
+    if (flatWater)
+      for (unsigned int x=0; x<width; x++)
+        row[x] = WATER_LEVEL;
+  }
 
-  for (unsigned int y=0; y<heightfield->height - 1; y++) {
-    for (unsigned int x=0; x<heightfield->width - 1; x++) {
+  pyramid.build( heights, width, height );
 
-      // one face
-      
-      *i++ = k;
-      *i++ = k+1;
-      *i++ = k + heightfield->width;
+  // Compute normals for the vertex buffers (the displacement shader
+  // computes its own)
 
-      // other face
+  if (!displaced) {
+    normals = (vec3 *) alignedAlloc( width * height * sizeof(vec3) );
+    computeNormals( heights, normals, width, height );
+  }
 
-      *i++ = k + heightfield->width;
-      *i++ = k+1;
-      *i++ = k+1 + heightfield->width;
+  return true;
+}
 
-      k++;
-    }
-    
-    k++; // next row
+
+// Set the cache name and key for the heightfield 'filename', and open
+// the cache if it is current.  The key covers everything that the
+// cached data is built from; bump TERRAIN_CACHE_VERSION when the way
+// it is built changes.
+
+
+bool Terrain::openCache( string filename )
+
+{
+  cacheName = filename + TERRAIN_CACHE_SUFFIX;
+  cacheKey = FNV_OFFSET;
+
+  if (!fnvHashFile( filename.c_str(), cacheKey )) {
+    cacheName = "";             // no heightfield; readHeightfield() reports it
+    return false;
   }
 
-  // Create a VAO
+  int params[] = { TERRAIN_CACHE_VERSION, TERRAIN_CHUNK_SIZE, TERRAIN_CHUNK_LODS, WATER_LEVEL, (int) sizeof(TerrainCacheHeader) };
+  cacheKey = fnvHash( params, sizeof(params), cacheKey );
 
-  glGenVertexArrays( 1, &VAO );
-  glBindVertexArray( VAO );
+  if (!cache.open( cacheName.c_str(), cacheKey ))
+    return false;
 
-  // store vertices (i.e. one triple of floats per vertex)
+  // Heights are used in place; the pyramid is copied
 
-  GLuint vertexBufferID;
-  glGenBuffers( 1, &vertexBufferID );
-  glBindBuffer( GL_ARRAY_BUFFER, vertexBufferID );
+  TerrainCacheHeader *header = cache.header;
 
-  glBufferData( GL_ARRAY_BUFFER, nVerts * 3 * sizeof(GLfloat), vertexBuffer, GL_STATIC_DRAW );
+  width   = header->width;
+  height  = header->height;
+  heights = cache.heights();
 
-  // attribute 0 = position
+  pyramid.allocate( heights, width, height );
 
-  glEnableVertexAttribArray( 0 );
-  glVertexAttribPointer( 0, 3, GL_FLOAT, GL_FALSE, 0, 0 );
+  for (int l=0; l<pyramid.levels(); l++) {
+    size_t n = pyramid.width(l) * pyramid.height(l);
+    memcpy( pyramid.minLevel(l), cache.pyramidLevel(l),     n * sizeof(float) );
+    memcpy( pyramid.maxLevel(l), cache.pyramidLevel(l) + n, n * sizeof(float) );
+  }
+
+  return true;
+}
 
-  // store vertex normals (i.e. one triple of floats per vertex)
 
-  GLuint normalBufferID;
-  glGenBuffers( 1, &normalBufferID );
-  glBindBuffer( GL_ARRAY_BUFFER, normalBufferID );
+// Write the cache from a decoded heightfield
 
-  glBufferData( GL_ARRAY_BUFFER, nVerts * 3 * sizeof(GLfloat), normalBuffer, GL_STATIC_DRAW );
 
-  // attribute 1 = normal
+bool Terrain::writeCache()
 
-  glEnableVertexAttribArray( 1 );
-  glVertexAttribPointer( 1, 3, GL_FLOAT, GL_FALSE, 0, 0 );
+{
+  TerrainCacheWriter out;
+
+  if (cacheName == "" || !out.open( cacheName.c_str(), cacheKey ))
+    return false;
+
+  TerrainCacheHeader &header = out.header;
+
+  header.chunkSize = TERRAIN_CHUNK_SIZE;
+  header.width = width;
+  header.height = height;
+  header.nChunksX = nChunksX;
+  header.nChunksY = nChunksY;
+  header.nPyramidLevels = pyramid.levels();
+  header.chunkBytes = TERRAIN_CHUNK_VERTS * sizeof(TerrainVertex);
+
+  header.heightsOffset = out.write( heights, width * height * sizeof(float) );
+  out.align();
+
+  for (int l=0; l<pyramid.levels(); l++) {
+    size_t n = pyramid.width(l) * pyramid.height(l);
+    header.pyramidOffset[l] = out.write( pyramid.minLevel(l), n * sizeof(float) );
+    out.write( pyramid.maxLevel(l), n * sizeof(float) );
+    out.align();
+  }
+
+  // Chunk vertices, one after the other
+
+  TerrainVertex *vertices = new TerrainVertex[ TERRAIN_CHUNK_VERTS ];
 
-  // store vertex texture coordinates (i.e. one triple of floats per vertex)
+  for (int c=0; c<nChunksX*nChunksY; c++) {
+    buildChunk( chunks[c], vertices );
+    uint64_t offset = out.write( vertices, TERRAIN_CHUNK_VERTS * sizeof(TerrainVertex) );
+    if (c == 0)
+      header.verticesOffset = offset;
+  }
+
+  delete[] vertices;
+  out.align();
 
-  GLuint texCoordBufferID;
-  glGenBuffers( 1, &texCoordBufferID );
-  glBindBuffer( GL_ARRAY_BUFFER, texCoordBufferID );
+  // Chunk bounds and errors
 
-  glBufferData( GL_ARRAY_BUFFER, nVerts * 2 * sizeof(GLfloat), texCoordBuffer, GL_STATIC_DRAW );
+  TerrainChunkRecord *records = new TerrainChunkRecord[ nChunksX * nChunksY ];
 
-  // attribute 2 = texture coordinates
+  for (int c=0; c<nChunksX*nChunksY; c++) {
+    records[c].x0 = chunks[c].x0;
+    records[c].y0 = chunks[c].y0;
+    records[c].minZ = chunks[c].minZ;
+    records[c].maxZ = chunks[c].maxZ;
+    memcpy( records[c].error, chunks[c].error, sizeof(records[c].error) );
+  }
 
-  glEnableVertexAttribArray( 2 );
-  glVertexAttribPointer( 2, 2, GL_FLOAT, GL_FALSE, 0, 0 );
+  header.chunksOffset = out.write( records, nChunksX * nChunksY * sizeof(TerrainChunkRecord) );
+  out.align();
 
-  // store faces (i.e. one triple of vertex indices per face)
+  delete[] records;
 
-  GLuint indexBufferID;
-  glGenBuffers( 1, &indexBufferID );
-  glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, indexBufferID );
-  glBufferData( GL_ELEMENT_ARRAY_BUFFER, nFaces * 3 * sizeof(GLuint), indexBuffer, GL_STATIC_DRAW );
+  // Index buffers
 
-  // Clean up
+  GLushort *indexBuffer = new GLushort[ TERRAIN_CHUNK_INDICES ];
+
+  for (int l=0; l<TERRAIN_CHUNK_LODS; l++)
+    for (int mask=0; mask<16; mask++) {
+      int count = buildLODIndices( l, mask, indexBuffer );
+      header.indicesOffset[l][mask] = out.write( indexBuffer, count * sizeof(GLushort) );
+      header.indexCount[l][mask] = count;
+    }
 
-  delete[] vertexBuffer;
-  delete[] normalBuffer;
-  delete[] texCoordBuffer;
   delete[] indexBuffer;
+
+  return out.finish();
 }
 
 
+// Write the cache for a heightfield without opening a window (for
+// 'rollercoaster -bakeTerrain')
 
-void Terrain::draw( mat4 &MV, mat4 &MVP, vec3 lightDir, bool drawUndersideOnly ) 
+
+bool Terrain::bakeCache( string basePath, string heightfieldFilename )
 
 {
-  // Draw textured terrain
+  // Not deleted: the GPUProgram member can only be destroyed with an
+  // OpenGL context
 
-  gpu.activate();
-  
-  gpu.setMat4( "MV", MV );
-  gpu.setMat4( "MVP", MVP );
-  gpu.setVec3( "lightDir", lightDir );
-  gpu.setFloat( "alpha", 1.0 );
-  
-  const int textureUnitID = 0;
-  const int flowTextureID =  1;
-  const int normalTextureID = 2;
-  
-  texture->activate( textureUnitID);
-  gpu.setInt( "terrainColourSampler", textureUnitID);
-  gpu.setFloat("time", elapsedSeconds);
+  Terrain *terrain = new Terrain();
 
-  distortionTex->activate(flowTextureID);
-  gpu.setInt("distortionSampler", flowTextureID);
+  string path = basePath + "/" + heightfieldFilename;
 
-  normalTex->activate(normalTextureID);
-  gpu.setInt("normalSampler", normalTextureID);
+  terrain->openCache( path );
+  terrain->cache.close();       // rebuild even if current
 
+  if (!terrain->readHeightfield( path ))
+    return false;
 
-  // underside
+  terrain->allocateChunks();
 
-  const float minZ = -5; // level of underside of terrain box
-  
-  {
-    vec3 pts[4], colours[4];
+  if (!terrain->writeCache())
+    return false;
 
-    vec3 *p = pts;
+  cout << "Wrote " << terrain->cacheName << " (" << terrain->width << "x" << terrain->height << ", "
+       << terrain->nChunksX * terrain->nChunksY << " chunks)" << endl;
 
-    *p++ = vec3( 0,                    0,                     minZ );
-    *p++ = vec3( 0,                    heightfield->height-1, minZ );
-    *p++ = vec3( heightfield->width-1, heightfield->height-1, minZ );
-    *p++ = vec3( heightfield->width-1, 0,                     minZ );
+  return true;
+}
 
-    for (int i=0; i<4; i++)
-      colours[i] = vec3( BOTTOM_COLOUR );
 
-    segs->drawSegs( GL_TRIANGLE_FAN, pts, colours, 4, MV, MVP, lightDir );
-  }
 
-  if (drawUndersideOnly)
+// Normals are only needed on the CPU to build the vertex buffers
+
+
+void Terrain::releaseNormals()
+
+{
+  alignedFree( normals );
+  normals = NULL;
+}
+
+
+
+void Terrain::setupVAO()
+
+{
+  if (tiles != NULL) {
+    tiles->setupVAOs();
+    setupBoxVAOs();             // the curtain follows the overview
     return;
+  }
 
-  // Draw using element array
+  allocateChunks();
 
-  glBindVertexArray( VAO );
+  if (displaced) {
 
-  glDrawElements( GL_TRIANGLES, nFaces*3, GL_UNSIGNED_INT, 0 );
+    // One attribute-less VAO for all chunks
 
-  glBindVertexArray( 0 );
+    uploadHeightTexture();
+    glGenVertexArrays( 1, &gridVAO );
 
-  gpu.deactivate();
+  } else if (!cache.isOpen() && writeCache())
 
-  // Draw highlighted quads (for debugging)
+    // Write the cache on the first run, then upload from it
 
-  for (int i=0; i<quadsToHighlight.size(); i++) {
+    cache.open( cacheName.c_str(), cacheKey );
 
-    vec3 pts[4], colours[4];
-      
-    vec3 v = quadsToHighlight[i];
-    pts[0] = vec3( v.x, v.y, points[(int)v.x][(int)v.y].z + 0.1 );
-    v.x++;
-    pts[1] = vec3( v.x, v.y, points[(int)v.x][(int)v.y].z + 0.1 );
-    v.y++;
-    pts[2] = vec3( v.x, v.y, points[(int)v.x][(int)v.y].z + 0.1 );
-    v.x--;
-    pts[3] = vec3( v.x, v.y, points[(int)v.x][(int)v.y].z + 0.1 );
+  if (cache.isOpen()) {
 
-    for (int j=0; j<4; j++)
-      colours[j] = vec3(1,1,0);
+    TerrainChunkRecord *records = cache.chunks();
 
-    segs->drawSegs( GL_TRIANGLE_FAN, pts, colours, 4, MV, MVP, lightDir );
+    for (int c=0; c<nChunksX*nChunksY; c++) {
+      chunks[c].minZ = records[c].minZ;
+      chunks[c].maxZ = records[c].maxZ;
+      memcpy( chunks[c].error, records[c].error, sizeof(chunks[c].error) );
+      if (displaced)
+        chunks[c].VAO = gridVAO;
+      else
+        uploadChunk( chunks[c], (const TerrainVertex *) cache.chunkVertices(c) );
+    }
+
+    for (int l=0; l<TERRAIN_CHUNK_LODS; l++)
+      for (int mask=0; mask<16; mask++)
+        uploadLODIndices( l, mask, cache.indices( l, mask ), cache.header->indexCount[l][mask] );
+
+  } else {
+
+    // No cache (e.g. the data directory is read-only, or displacement)
+
+    TerrainVertex *vertices = new TerrainVertex[ TERRAIN_CHUNK_VERTS ];
+
+    for (int c=0; c<nChunksX*nChunksY; c++)
+      if (displaced) {
+        measureChunk( chunks[c] );
+        chunks[c].VAO = gridVAO;
+      } else {
+        buildChunk( chunks[c], vertices );
+        uploadChunk( chunks[c], vertices );
+      }
+
+    delete[] vertices;
+
+    GLushort *indexBuffer = new GLushort[ TERRAIN_CHUNK_INDICES ];
+
+    for (int l=0; l<TERRAIN_CHUNK_LODS; l++)
+      for (int mask=0; mask<16; mask++)
+        uploadLODIndices( l, mask, indexBuffer, buildLODIndices( l, mask, indexBuffer ) );
+
+    delete[] indexBuffer;
   }
 
-  // Draw curtain
+  glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, 0 );
+
+  setupBoxVAOs();
+
+  releaseNormals();
+}
+
+
+// Upload the heights to a single-channel float texture, which the
+// displacement shader reads with texelFetch() (GLES 3.0 cannot filter
+// float textures, nor does it need to)
+
+
+void Terrain::uploadHeightTexture()
+
+{
+  glGenTextures( 1, &heightTextureID );
+  glBindTexture( GL_TEXTURE_2D, heightTextureID );
+
+  glPixelStorei( GL_UNPACK_ALIGNMENT, 4 );
+  glTexImage2D( GL_TEXTURE_2D, 0, GL_R32F, width, height, 0, GL_RED, GL_FLOAT, heights );
+
+  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+
+  glBindTexture( GL_TEXTURE_2D, 0 );
+}
+
+
+void Terrain::allocateChunks()
+
+{
+  nChunksX = (width  - 2) / TERRAIN_CHUNK_SIZE + 1;
+  nChunksY = (height - 2) / TERRAIN_CHUNK_SIZE + 1;
+
+  chunks = new TerrainChunk[ nChunksX * nChunksY ];
+
+  for (int cy=0; cy<nChunksY; cy++)
+    for (int cx=0; cx<nChunksX; cx++) {
+      TerrainChunk &chunk = chunks[ cy*nChunksX + cx ];
+      chunk.x0 = cx * TERRAIN_CHUNK_SIZE;
+      chunk.y0 = cy * TERRAIN_CHUNK_SIZE;
+      chunk.VAO = chunk.VBO = 0;
+    }
+}
+
+
+// The underside and the curtain around the sides of the terrain box
+// don't change, so are built once.
+
+
+#define TERRAIN_MIN_Z -5        // level of underside of terrain box
 
-  vec3 *pts = new vec3[ 4*(heightfield->width + heightfield->height) ];
-  vec3 *colours =  new vec3[ 4*(heightfield->width + heightfield->height) ];
 
-  // ---- draw curtains around terrain ----
+void Terrain::setupBoxVAOs()
 
-  for (unsigned int i=0; i<4*(heightfield->width + heightfield->height); i++)
+{
+  const float minZ = TERRAIN_MIN_Z;
+
+  // underside
+
+  {
+    vec3 pts[4], colours[4];
+
+    vec3 *p = pts;
+
+    *p++ = vec3( 0,       0,        minZ );
+    *p++ = vec3( 0,       height-1, minZ );
+    *p++ = vec3( width-1, height-1, minZ );
+    *p++ = vec3( width-1, 0,        minZ );
+
+    for (int i=0; i<4; i++)
+      colours[i] = vec3( BOTTOM_COLOUR );
+
+    undersideVAO = Segs::makeVAO( pts, colours, NULL, 4 );
+  }
+
+  // curtain
+
+  vec3 *pts = new vec3[ 4*(width + height) ];
+  vec3 *colours =  new vec3[ 4*(width + height) ];
+
+  for (unsigned int i=0; i<4*(width + height); i++)
     colours[i] = vec3( CURTAIN_COLOUR );
   
   vec3 *p = pts;
@@ -287,8 +539,8 @@ void Terrain::draw( mat4 &MV, mat4 &MVP, vec3 lightDir, bool drawUndersideOnly )
 
   int i = 0;
   int j = 0;
-  for ( ; i<(int)heightfield->width; i++) {
-    *p++ = vec3( i, j, points[i][j].z );
+  for ( ; i<(int)width; i++) {
+    *p++ = vec3( i, j, getHeight(i,j) );
     *p++ = vec3( i, j, minZ );
   }
   i--;
@@ -296,8 +548,8 @@ void Terrain::draw( mat4 &MV, mat4 &MVP, vec3 lightDir, bool drawUndersideOnly )
   // right
 
   j++;
-  for ( ; j<(int)heightfield->height; j++) {
-    *p++ = vec3( i, j, points[i][j].z );
+  for ( ; j<(int)height; j++) {
+    *p++ = vec3( i, j, getHeight(i,j) );
     *p++ = vec3( i, j, minZ );
   }
   j--;
@@ -306,7 +558,7 @@ void Terrain::draw( mat4 &MV, mat4 &MVP, vec3 lightDir, bool drawUndersideOnly )
 
   i--;
   for ( ; i >= 0; i--) {
-    *p++ = vec3( i, j, points[i][j].z );
+    *p++ = vec3( i, j, getHeight(i,j) );
     *p++ = vec3( i, j, minZ );
   }
   i++;
@@ -315,303 +567,563 @@ void Terrain::draw( mat4 &MV, mat4 &MVP, vec3 lightDir, bool drawUndersideOnly )
 
   j--;
   for ( ; j >= 0; j--) {
-    *p++ = vec3( i, j, points[i][j].z );
+    *p++ = vec3( i, j, getHeight(i,j) );
     *p++ = vec3( i, j, minZ );
   }
 
-  segs->drawSegs( GL_TRIANGLE_STRIP, pts, colours, p-pts, MV, MVP, lightDir );
+  nCurtainPts = p - pts;
+  curtainVAO = Segs::makeVAO( pts, colours, NULL, nCurtainPts );
 
   delete[] pts;
   delete[] colours;
 }
 
 
-// Find the intersection of rayStart + t*rayDir with the terrain.
-// planePerp is perpendicular to the vertical plane that embeds this
-// ray.
+// Find the height range of a chunk and the height error at each
+// level of detail.
+//
+// Every chunk has (TERRAIN_CHUNK_SIZE+1)^2 vertices, so that all
+// chunks can share index buffers.  Vertices of chunks that extend past
+// the top or right edge of the terrain are clamped to the edge (here
+// and in the vertex shader), which makes the triangles out there
+// degenerate.
 
 
-bool Terrain::findIntPoint( vec3 rayStart, vec3 rayDir, vec3 planePerp, vec3 &intPoint, mat4 &M )
+void Terrain::measureChunk( TerrainChunk &chunk )
 
 {
-  // The ray/dir is in the WCS, so we first move it into the OCS of
-  // the terrain.
+  const int n = TERRAIN_CHUNK_SIZE + 1;
 
-  mat4 Minv = M.inverse();
-  
-  rayStart = (Minv * vec4( rayStart, 1 )).toVec3();
-  rayDir   = (Minv * vec4( rayDir,   0 )).toVec3();
+  auto h = [&]( int i, int j ) {
+    return heights[ MIN( chunk.y0 + j, (int) height-1 ) * width + MIN( chunk.x0 + i, (int) width-1 ) ];
+  };
 
-  // Find the first edge of the terrain that is hit by this vertical plane
+  chunk.minZ = MAXFLOAT;
+  chunk.maxZ = -MAXFLOAT;
 
-  float width  = heightfield->width;
-  float height = heightfield->height;
-  
-  vec3 corners[4] = { vec3(0,      0,       0),
-                      vec3(width-1,0,       0),
-                      vec3(width-1,height-1,0),
-                      vec3(0      ,height-1,0) };
-
-  float minDist = MAXFLOAT;
-  int minIndex;
-  vec3 minPoint;
-  
-  for (int i=0; i<4; i++) {
-
-    // two adjacent corners
-
-    vec3 &c0 = corners[i];
-    vec3 &c1 = corners[(i+1)%4];
-    
-    // Find t such that (c0 + t(c1-c0))*planePerp = rayStart*planePerp.
-
-    float denom = (c1-c0)*planePerp;
-    if (fabs(denom) > 0.001) {  // plane is not parallel to edge
-      float t = ((rayStart-c0)*planePerp) / denom;
-      if (t >= 0 && t <= 1) {   // plane intersects interior of edge
-        float dist = ((c0 + t*(c1-c0)) - rayStart).length();
-        if (dist < minDist) {   // closest intersection so far
-          minDist = dist;
-          minIndex = i;
-          minPoint = c0 + t*(c1-c0);
-        }
-      }
+  for (int j=0; j<n; j++)
+    for (int i=0; i<n; i++) {
+      chunk.minZ = MIN( chunk.minZ, h(i,j) );
+      chunk.maxZ = MAX( chunk.maxZ, h(i,j) );
     }
-  }
 
-  if (minDist == MAXFLOAT)
-    return false;               // no intersection at all
+  // Height error at each level: the largest difference between a
+  // vertex and the coarse triangles that replace it.  The coarse quads
+  // are split the same way as the index buffers split them.
 
-  // Find pixel corners ('pc') that bracket the starting point
+  chunk.error[0] = 0;
 
-  vec3 pc0, pc1;
+  for (int l=1; l<TERRAIN_CHUNK_LODS; l++) {
 
-#define ROUND(x) floor(x+0.5)
+    int step = 1 << l;
+    float maxErr = chunk.error[l-1];
 
-  if (minIndex == 0 || minIndex == 2) { // on an edge parallel to x axis
-    pc0 = vec3( floor(minPoint.x),   ROUND(minPoint.y), 0 );
-    pc1 = vec3( floor(minPoint.x)+1, ROUND(minPoint.y), 0 );
-  } else { // on an edge parallel to y axis
-    pc0 = vec3( ROUND(minPoint.x), floor(minPoint.y),   0 );
-    pc1 = vec3( ROUND(minPoint.x), floor(minPoint.y)+1, 0 );
-  }
+    for (int j=0; j<n; j++)
+      for (int i=0; i<n; i++) {
+
+        int i0 = MIN( i - i%step, n-1-step );
+        int j0 = MIN( j - j%step, n-1-step );
+
+        float u = (i-i0) / (float) step;
+        float w = (j-j0) / (float) step;
 
-  // Find the direction in which the vertical plane intersects the
-  // terrain.  Point that direction in the direction of rayDir.
-
-  vec3 dir = planePerp ^ vec3(0,0,1);
-
-  if (dir*rayDir < 0)
-    dir = -1 * dir;
-
-  // Pick unit x and y increments in the direction 'dir'.
-
-  vec3 xinc( dir.x / fabs(dir.x), 0, 0 );
-  vec3 yinc( 0, dir.y / fabs(dir.y), 0 );
-
-  // Name the corners of the boundary pixel ll, lr, ul, and ur.  Make
-  // sure that l (= 'lower') has smaller y value than u (= 'up') and
-  // that l (= 'left') has smaller x index than r (= 'right').
-
-  vec3 ll, lr, ul, ur;
-
-  switch (minIndex) {
-  case 0:                        // y=0 edge
-    ll = pc0;
-    lr = pc1;
-    ul = pc0+yinc;
-    ur = pc1+yinc;
-    break;
-  case 1:                        // x=width edge
-    ll = pc0+xinc;
-    lr = pc0;
-    ul = pc1+xinc;
-    ur = pc1;
-    break;
-  case 2:                        // y=height edge
-    ll = pc0+yinc;
-    lr = pc1+yinc;
-    ul = pc0;
-    ur = pc1;
-    break;
-  case 3:                        // x=0 edge
-    ll = pc0;
-    lr = pc0+xinc;
-    ul = pc1;
-    ur = pc1+xinc;
-    break;
+        float ll = h( i0,      j0 );
+        float lr = h( i0+step, j0 );
+        float ul = h( i0,      j0+step );
+        float ur = h( i0+step, j0+step );
+
+        float approx;
+        if (u+w <= 1)
+          approx = ll + u*(lr-ll) + w*(ul-ll);
+        else
+          approx = ur + (1-u)*(ul-ur) + (1-w)*(lr-ur);
+
+        float err = fabs( h(i,j) - approx );
+        if (err > maxErr)
+          maxErr = err;
+      }
+
+    chunk.error[l] = maxErr;
   }
+}
+
 
-  // Walk across the pixels of the terrain that intersect the vertical
-  // plan.  Stop when a pixel corner goes outside the terrain.
+// Fill 'vertices' with the packed vertices of one chunk, and measure it
 
-  if (false)
-    quadsToHighlight.clear();
 
-  do {
+void Terrain::buildChunk( TerrainChunk &chunk, TerrainVertex *vertices )
 
-    if (false) {  // show the terrain quad that are traversed in searching for the mouse position on the terrain
-      vec3 q( ll.x, ll.y, 0);
-      quadsToHighlight.add( q );
+{
+  const int n = TERRAIN_CHUNK_SIZE + 1;
+
+  TerrainVertex *v = vertices;
+
+  for (int j=0; j<n; j++)
+    for (int i=0; i<n; i++) {
+      int x = MIN( chunk.x0 + i, (int) width-1 );
+      int y = MIN( chunk.y0 + j, (int) height-1 );
+      *v++ = packTerrainVertex( getHeight(x,y), normal(x,y) );
     }
 
-    // Set heights of this terrain quad
+  measureChunk( chunk );
+}
 
-    ll = points[(int)ll.x][(int)ll.y];
-    lr = points[(int)lr.x][(int)lr.y];
-    ul = points[(int)ul.x][(int)ul.y];
-    ur = points[(int)ur.x][(int)ur.y];
 
-    // Test for intersection of ray with the two terrain triangles
-    // above this terrain pixel.
+void Terrain::uploadChunk( TerrainChunk &chunk, const TerrainVertex *vertices )
 
-    vec3 p;
-    float t;
+{
+  chunk.VAO = makeTerrainVAO( vertices, TERRAIN_CHUNK_VERTS, chunk.VBO );
+}
 
-    if (rayTriangleInt( rayStart, rayDir, ll, lr, ul, p, t )) {
-      intPoint = p;
-      return true;
-    }
 
-    if (rayTriangleInt( rayStart, rayDir, ul, lr, ur, p, t )) {
-      intPoint = p;
-      return true;
-    }
+TerrainVertex packTerrainVertex( float height, vec3 normal )
+
+{
+  TerrainVertex v;
 
-    // Move to the next terrain pixel in direction 'dir' that still
-    // brackets the vertical plane.
+  v.height = height;
+  encodeOctahedral( normal, v.normal );
 
-    vec3 nll, nlr, nul, nur;
-    float llDot;
+  return v;
+}
 
-    // Try the x direction
 
-    nll = ll+xinc;
-    nlr = lr+xinc;
-    nul = ul+xinc;
-    nur = ur+xinc;
+// Upload packed vertices to a new VAO with one interleaved buffer,
+// which is returned in VBO
 
-    llDot = (nll-rayStart) * planePerp;
-    if (((nlr-rayStart)*planePerp) * llDot > 0 &&
-        ((nul-rayStart)*planePerp) * llDot > 0 &&
-        ((nur-rayStart)*planePerp) * llDot > 0) {
 
-      // Try the y direction
+GLuint makeTerrainVAO( const TerrainVertex *vertices, int nVerts, GLuint &VBO )
 
-      nll = ll+yinc;
-      nlr = lr+yinc;
-      nul = ul+yinc;
-      nur = ur+yinc;
-    }
+{
+  GLuint VAO;
 
-    ll = nll;
-    lr = nlr;
-    ul = nul;
-    ur = nur;
+  glGenVertexArrays( 1, &VAO );
+  glBindVertexArray( VAO );
 
-  } while (ll.x >= 0 && ll.x < width && ll.y >= 0 && ll.y < height &&
-           lr.x >= 0 && lr.x < width && lr.y >= 0 && lr.y < height &&
-           ul.x >= 0 && ul.x < width && ul.y >= 0 && ul.y < height &&
-           ur.x >= 0 && ur.x < width && ur.y >= 0 && ur.y < height);
+  glGenBuffers( 1, &VBO );
+  glBindBuffer( GL_ARRAY_BUFFER, VBO );
+  glBufferData( GL_ARRAY_BUFFER, nVerts * sizeof(TerrainVertex), vertices, GL_STATIC_DRAW );
 
-  return false;
+  // attribute 0 = height
+
+  glEnableVertexAttribArray( 0 );
+  glVertexAttribPointer( 0, 1, GL_FLOAT, GL_FALSE, sizeof(TerrainVertex), (void *) offsetof( TerrainVertex, height ) );
+
+  // attribute 1 = octahedral normal, normalized to [-1,1]
+
+  glEnableVertexAttribArray( 1 );
+  glVertexAttribPointer( 1, 2, GL_SHORT, GL_TRUE, sizeof(TerrainVertex), (void *) offsetof( TerrainVertex, normal ) );
+
+  glBindVertexArray( 0 );
+
+  return VAO;
 }
 
 
+// Build the 16-bit index buffer of a chunk at level 'lod' with
+// coarser neighbours given by 'mask'.  Returns the number of indices.
 
-bool Terrain::rayTriangleInt( vec3 rayStart, vec3 rayDir,
-                              vec3 v0, vec3 v1, vec3 v2,
-                              vec3 & intPoint, float & intParam )
+
+int Terrain::buildLODIndices( int lod, int mask, GLushort *indexBuffer )
 
 {
-  float param;
-  vec3 point, lc;
+  const int n = TERRAIN_CHUNK_SIZE + 1;
+
+  int step = 1 << lod;
+  int coarse = 2 * step;        // vertex spacing on a coarser neighbour's edge
+
+  // Index of vertex (i,j), with odd vertices on edges next to a
+  // coarser neighbour collapsed onto the even vertex before them
 
-  vec3 normal = (v1-v0)^(v2-v0);  // not normalized yet!
+  auto index = [&]( int i, int j ) {
+    if ((i == 0 && (mask & LEFT_COARSER)) || (i == n-1 && (mask & RIGHT_COARSER)))
+      j -= j % coarse;
+    if ((j == 0 && (mask & BOTTOM_COARSER)) || (j == n-1 && (mask & TOP_COARSER)))
+      i -= i % coarse;
+    return (GLushort) (j*n + i);
+  };
 
-  // Compute ray/plane intersection
+  GLushort *k = indexBuffer;
 
-  float dn = rayDir * normal;
+  for (int j=0; j<n-1; j+=step)
+    for (int i=0; i<n-1; i+=step) {
 
-  if (fabs(dn) < 0.0001)
-    return false;               // ray is parallel to plane
+      GLushort ll = index( i,      j      );
+      GLushort lr = index( i+step, j      );
+      GLushort ul = index( i,      j+step );
+      GLushort ur = index( i+step, j+step );
 
-  float dist = v0 * normal;
+      // one face (dropped if collapsed)
 
-  param = (dist - rayStart*normal) / dn;
-  if (param < 0)
-    return false;               // plane is behind starting point
+      if (ll != lr && ll != ul && lr != ul) {
+        *k++ = ll;
+        *k++ = lr;
+        *k++ = ul;
+      }
 
-  point = rayStart + param * rayDir;
+      // other face
 
-  // Compute barycentric coords
+      if (ul != lr && ul != ur && lr != ur) {
+        *k++ = ul;
+        *k++ = lr;
+        *k++ = ur;
+      }
+    }
 
-  float totalArea = ((v1-v0) ^ (v2-v0)) * normal;
+  return k - indexBuffer;
+}
 
-  float u = (((v2-v1) ^ (point - v1)) * normal) / totalArea;
 
-  float v = (((v0-v2) ^ (point - v2)) * normal) / totalArea;
+void Terrain::uploadLODIndices( int lod, int mask, const GLushort *indexBuffer, int count )
 
-  // Reject if outside triangle
+{
+  lodIndexCount[lod][mask] = count;
+
+  glGenBuffers( 1, &lodIndexBuffer[lod][mask] );
+  glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, lodIndexBuffer[lod][mask] );
+  glBufferData( GL_ELEMENT_ARRAY_BUFFER, count * sizeof(GLushort), indexBuffer, GL_STATIC_DRAW );
+}
+
+
+// Frustum planes in the terrain's coordinate system, from the rows of
+// MVP.  A point p is inside if plane * (p,1) >= 0 for all planes.
+
+
+void frustumPlanes( mat4 &MVP, vec4 planes[6] )
+
+{
+  for (int i=0; i<3; i++) {
+    planes[2*i]   = MVP[3] + MVP[i];
+    planes[2*i+1] = MVP[3] - MVP[i];
+  }
+}
 
-  if (u < 0 || v < 0 || u + v > 1)
-    return false;
 
-  // Return int point and normal and parameter
+// A box is outside if its corner furthest along a plane's normal is
+// behind that plane.  (Some boxes near the frustum's corners are kept
+// even though they are outside.)
 
-  intParam = param / normal.length();
-  intPoint = point;
+
+bool boxInFrustum( vec4 planes[6], vec3 lo, vec3 hi )
+
+{
+  for (int i=0; i<6; i++) {
+    vec4 &pl = planes[i];
+    vec4 p( pl.x > 0 ? hi.x : lo.x,
+            pl.y > 0 ? hi.y : lo.y,
+            pl.z > 0 ? hi.z : lo.z, 1 );
+    if (pl * p < 0)
+      return false;
+  }
 
   return true;
 }
 
 
+// Pick a level of detail for each chunk, then limit the difference
+// between neighbours to one level.  Also find the chunks that are in
+// the view frustum.
+
+
+void Terrain::chooseLODs( mat4 &MV, mat4 &MVP )
+
+{
+  vec4 planes[6];
+
+  frustumPlanes( MVP, planes );
+
+  // Eye position and pixels per unit length at unit distance
+
+  mat4 MVinv = MV.inverse();
+  vec3 eye = (MVinv * vec4( 0, 0, 0, 1 )).toVec3();
+
+  mat4 P = MVP * MVinv;
+  float pixelsPerUnit = P[1][1] * windowHeight / 2.0;
+
+  for (int c=0; c<nChunksX*nChunksY; c++) {
+
+    TerrainChunk &chunk = chunks[c];
+
+    vec3 lo( chunk.x0, chunk.y0, chunk.minZ );
+    vec3 hi( MIN( chunk.x0 + TERRAIN_CHUNK_SIZE, (int) width-1 ),
+             MIN( chunk.y0 + TERRAIN_CHUNK_SIZE, (int) height-1 ),
+             chunk.maxZ );
+
+    // Distance from the eye to the nearest point of the box
+
+    vec3 nearest( MAX( lo.x, MIN( eye.x, hi.x ) ),
+                  MAX( lo.y, MIN( eye.y, hi.y ) ),
+                  MAX( lo.z, MIN( eye.z, hi.z ) ) );
+
+    float dist = MAX( (nearest - eye).length(), 0.001 );
+    float scale = pixelsPerUnit / dist;
+
+    // Coarsest level with a small enough error and quad size
+
+    int l = 0;
+    while (l+1 < TERRAIN_CHUNK_LODS &&
+           chunk.error[l+1] * scale <= TERRAIN_MAX_PIXEL_ERROR &&
+           (1 << (l+1)) * scale <= TERRAIN_MAX_QUAD_PIXELS)
+      l++;
+
+    chunk.lod = l;
+
+    chunk.visible = boxInFrustum( planes, lo, hi );
+  }
+
+  // Limit neighbours to one level apart by refining the coarser one.
+  // Culled chunks take part, since their edges are shared with visible
+  // ones.
 
-const char *Terrain::vertShader = R"(
+  bool changed = true;
 
-  #version 300 es
+  while (changed) {
 
-  uniform mat4 MVP;
-  uniform mat4 MV;
+    changed = false;
 
-  layout (location = 0) in mediump vec3 vertPosition;
-  layout (location = 1) in mediump vec3 vertNormal;
-  layout (location = 2) in mediump vec2 vertTexCoords;
+    for (int cy=0; cy<nChunksY; cy++)
+      for (int cx=0; cx<nChunksX; cx++) {
 
-  smooth out mediump vec3 normal;
-  smooth out mediump vec2 texCoords;
+        int &l = chunks[ cy*nChunksX + cx ].lod;
+        int limit = l;
 
-  void main() {
+        if (cx > 0)          limit = MIN( limit, chunks[ cy*nChunksX + cx-1 ].lod + 1 );
+        if (cx < nChunksX-1) limit = MIN( limit, chunks[ cy*nChunksX + cx+1 ].lod + 1 );
+        if (cy > 0)          limit = MIN( limit, chunks[ (cy-1)*nChunksX + cx ].lod + 1 );
+        if (cy < nChunksY-1) limit = MIN( limit, chunks[ (cy+1)*nChunksX + cx ].lod + 1 );
 
-    gl_Position = MVP * vec4( vertPosition, 1.0 );
-    normal = vec3( MV * vec4( vertNormal, 0.0 ) );
-    texCoords = vertTexCoords;
+        if (limit < l) {
+          l = limit;
+          changed = true;
+        }
+      }
   }
-)";
+}
+
+
+
+// Draw the visible chunks
+
+
+void Terrain::drawChunks( mat4 &MV, mat4 &MVP )
+
+{
+  chooseLODs( MV, MVP );
+
+  nChunksDrawn = 0;
+  nTrianglesDrawn = 0;
 
+  gpu.setInt( "gridWidth", TERRAIN_CHUNK_SIZE+1 );
+  gpu.setFloat( "gridSpacing", 1 );
 
-const char *Terrain::fragShader = R"(
+  GLint originLoc = glGetUniformLocation( gpu.id(), "gridOrigin" );
 
-  #version 300 es
+  for (int cy=0; cy<nChunksY; cy++)
+    for (int cx=0; cx<nChunksX; cx++) {
 
-  uniform mediump vec3 lightDir;
-  uniform mediump float alpha;
-  uniform sampler2D terrainColourSampler;
+      TerrainChunk &chunk = chunks[ cy*nChunksX + cx ];
 
-  smooth in mediump vec3 normal;
-  smooth in mediump vec2 texCoords;
+      if (!chunk.visible)
+        continue;
 
-  out mediump vec4 outputColour;
+      int mask = 0;
 
-  void main() {
+      if (cx > 0          && chunks[ cy*nChunksX + cx-1 ].lod > chunk.lod) mask |= LEFT_COARSER;
+      if (cx < nChunksX-1 && chunks[ cy*nChunksX + cx+1 ].lod > chunk.lod) mask |= RIGHT_COARSER;
+      if (cy > 0          && chunks[ (cy-1)*nChunksX + cx ].lod > chunk.lod) mask |= BOTTOM_COARSER;
+      if (cy < nChunksY-1 && chunks[ (cy+1)*nChunksX + cx ].lod > chunk.lod) mask |= TOP_COARSER;
 
-    mediump float NdotL = dot( normalize(normal), lightDir );
+      glUniform2f( originLoc, chunk.x0, chunk.y0 );
+      glBindVertexArray( chunk.VAO );
+      glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, lodIndexBuffer[chunk.lod][mask] );
+      glDrawElements( GL_TRIANGLES, lodIndexCount[chunk.lod][mask], GL_UNSIGNED_SHORT, 0 );
 
-    mediump vec3 colour = texture( terrainColourSampler, texCoords ).rgb;
+      nChunksDrawn++;
+      nTrianglesDrawn += lodIndexCount[chunk.lod][mask] / 3;
+    }
+}
 
-    if (NdotL < 0.0)
-      NdotL = 0.1; // some ambient
 
-    outputColour = vec4( NdotL * colour, alpha );
+
+void Terrain::draw( mat4 &MV, mat4 &MVP, vec3 lightDir, bool drawUndersideOnly ) 
+
+{
+  // Draw textured terrain
+
+  gpu.activate();
+  
+  gpu.setMat4( "MV", MV );
+  gpu.setMat4( "MVP", MVP );
+  gpu.setVec3( "lightDir", lightDir );
+  gpu.setFloat( "alpha", 1.0 );
+  gpu.setVec2( "terrainMax", vec2( width-1, height-1 ) );
+  
+  const int textureUnitID = 0;
+  const int flowTextureID =  1;
+  const int normalTextureID = 2;
+  const int heightTextureUnit = 3;
+  
+  texture->activate( textureUnitID);
+  gpu.setInt( "terrainColourSampler", textureUnitID);
+  gpu.setFloat("time", elapsedSeconds);
+
+  distortionTex->activate(flowTextureID);
+  gpu.setInt("distortionSampler", flowTextureID);
+
+  normalTex->activate(normalTextureID);
+  gpu.setInt("normalSampler", normalTextureID);
+
+  if (displaced) {
+    glActiveTexture( GL_TEXTURE0 + heightTextureUnit );
+    glBindTexture( GL_TEXTURE_2D, heightTextureID );
+    gpu.setInt( "heightSampler", heightTextureUnit );
+  }
+
+
+  // underside
+
+  segs->drawVAO( GL_TRIANGLE_FAN, undersideVAO, 4, false, MV, MVP, lightDir );
+
+  if (drawUndersideOnly)
+    return;
+
+  if (tiles != NULL) {
+
+    // Tiled terrain: stream tiles around the eye, then draw them
+
+    vec4 planes[6];
+    frustumPlanes( MVP, planes );
+
+    tiles->update( (MV.inverse() * vec4( 0, 0, 0, 1 )).toVec3() );
+    tiles->draw( gpu, planes, nChunksDrawn, nTrianglesDrawn );
+
+  } else
+    drawChunks( MV, MVP );
+
+  glBindVertexArray( 0 );
+
+  gpu.deactivate();
+
+  // Draw highlighted quads (for debugging)
+
+  for (int i=0; i<quadsToHighlight.size(); i++) {
+
+    vec3 pts[4], colours[4];
+      
+    vec3 v = quadsToHighlight[i];
+    pts[0] = vec3( v.x, v.y, getHeight( v.x, v.y ) + 0.1 );
+    v.x++;
+    pts[1] = vec3( v.x, v.y, getHeight( v.x, v.y ) + 0.1 );
+    v.y++;
+    pts[2] = vec3( v.x, v.y, getHeight( v.x, v.y ) + 0.1 );
+    v.x--;
+    pts[3] = vec3( v.x, v.y, getHeight( v.x, v.y ) + 0.1 );
+
+    for (int j=0; j<4; j++)
+      colours[j] = vec3(1,1,0);
+
+    segs->drawSegs( GL_TRIANGLE_FAN, pts, colours, 4, MV, MVP, lightDir );
   }
-)";
+
+  // Draw curtain
+
+  segs->drawVAO( GL_TRIANGLE_STRIP, curtainVAO, nCurtainPts, false, MV, MVP, lightDir );
+}
+
+
+void Terrain::heightsAt( const vec2 *xy, float *out, size_t n )
+
+{
+  if (tiles == NULL && width > 1 && height > 1) {
+    bilinearHeights( heights, width, height, xy, out, n );
+    return;
+  }
+
+  // Tiled (or degenerate) terrain: one corner at a time, since the
+  // heights are not contiguous
+
+  for (size_t i=0; i<n; i++) {
+
+    float x = MIN( MAX( xy[i].x, 0.0f ), (float) width-1 );
+    float y = MIN( MAX( xy[i].y, 0.0f ), (float) height-1 );
+
+    int x0 = (int) x;
+    int y0 = (int) y;
+
+    float fx = x - x0;
+    float fy = y - y0;
+
+    float lower = clampedHeight( x0, y0   ) + fx * (clampedHeight( x0+1, y0   ) - clampedHeight( x0, y0   ));
+    float upper = clampedHeight( x0, y0+1 ) + fx * (clampedHeight( x0+1, y0+1 ) - clampedHeight( x0, y0+1 ));
+
+    out[i] = lower + fy * (upper - lower);
+  }
+}
+
+
+float Terrain::clearance( Spline &spline, float spacing, float &atArcLength )
+
+{
+  float length = spline.totalArcLength();
+  int   n      = MAX( 1, (int) ceil( length / spacing ) );
+
+  vec2  *xy = new vec2[n];
+  float *z  = new float[n];
+  float *h  = new float[n];
+
+  for (int i=0; i<n; i++) {
+    vec3 p = spline.value( spline.paramAtArcLength( i * length / n ) );
+    xy[i] = vec2( p.x, p.y );
+    z[i]  = p.z;
+  }
+
+  heightsAt( xy, h, n );
+
+  float minClearance = MAXFLOAT;
+
+  for (int i=0; i<n; i++)
+    if (z[i] - h[i] < minClearance) {
+      minClearance = z[i] - h[i];
+      atArcLength = i * length / n;
+    }
+
+  delete[] xy;
+  delete[] z;
+  delete[] h;
+
+  return minClearance;
+}
+
+
+// Find the intersection of rayStart + t*rayDir with the terrain, by
+// descending the min/max pyramid (see MinMaxPyramid::intersect()), or
+// the pyramids of the tiles (see TerrainTiles::findIntPoint()).
+//
+// planePerp (perpendicular to the vertical plane that embeds the ray)
+// is not needed by this search.
+
+
+bool Terrain::findIntPoint( vec3 rayStart, vec3 rayDir, vec3 planePerp, vec3 &intPoint, mat4 &M )
+
+{
+  // The ray/dir is in the WCS, so we first move it into the OCS of
+  // the terrain.
+
+  mat4 Minv = M.inverse();
+  
+  rayStart = (Minv * vec4( rayStart, 1 )).toVec3();
+  rayDir   = (Minv * vec4( rayDir,   0 )).toVec3();
+
+  if (tiles != NULL)
+    return tiles->findIntPoint( rayStart, rayDir, intPoint );
+
+  return pyramid.intersect( rayStart, rayDir, intPoint );
+}
+
+
+
+// The shaders are read from data/water*.vert and data/water.frag by
+// the constructor
+
+const char *Terrain::vertShader = NULL;
+const char *Terrain::fragShader = NULL;
@@ -5,21 +5,151 @@
 
 #include "headers.h"
 #include "texture.h"
+#include "textureUpload.h"
 #include "seq.h"
 #include "gpuProgram.h"
+#include "minMaxPyramid.h"
+#include "terrainCache.h"
+#include "terrainTiles.h"
+
+
+class Spline;
+
+
+// Heights are stored in one contiguous, aligned buffer in row-major
+// order, since x and y are implied by the index.  Normals are stored
+// the same way, but only until they are uploaded in setupVAO().
+
+
+#define HEIGHT_ALIGNMENT 64     // bytes (one cache line)
+
+void *alignedAlloc( size_t size );
+void  alignedFree( void *p );
+
+
+// The mesh is split into square chunks of TERRAIN_CHUNK_SIZE quads,
+// each with its own vertex buffers and bounding box.  A chunk is drawn
+// only if its box is in the view frustum, at a level of detail (LOD)
+// chosen from its distance: level l uses every 2^l'th vertex.  The
+// level is the coarsest one at which both the chunk's height error
+// and the size of one of its quads on the screen are small enough.
+//
+// Neighbouring chunks differ by at most one level.  On an edge shared
+// with a coarser neighbour, the odd vertices are collapsed onto the
+// even ones, so that the edge matches the neighbour's and there are no
+// cracks.  The index buffers for each (level, coarser-neighbour mask)
+// pair are shared by all chunks.
+
+
+#define TERRAIN_CHUNK_SIZE        64  // quads per chunk side (a power of two)
+#define TERRAIN_CHUNK_LODS         7  // log2(TERRAIN_CHUNK_SIZE) + 1
+#define TERRAIN_MAX_PIXEL_ERROR    2  // allowed height error on the screen, in pixels
+#define TERRAIN_MAX_QUAD_PIXELS    8  // allowed size of one quad on the screen, in pixels
+
+#define TERRAIN_CHUNK_VERTS   ((TERRAIN_CHUNK_SIZE+1) * (TERRAIN_CHUNK_SIZE+1))
+#define TERRAIN_CHUNK_INDICES (6 * TERRAIN_CHUNK_SIZE * TERRAIN_CHUNK_SIZE)         // most indices per chunk
+
+#define LEFT_COARSER   1            // bits of the neighbour mask
+#define RIGHT_COARSER  2
+#define BOTTOM_COARSER 4
+#define TOP_COARSER    8
+
+
+// Terrain vertices are packed into 8 bytes: the height and the normal
+// (octahedral encoding, see terrainNormals.h).  Every terrain mesh is a
+// regular grid, so the vertex shader computes x, y and the texture
+// coordinates from the vertex's index in the grid (gl_VertexID) and
+// the grid's uniforms: gridOrigin, gridSpacing, gridWidth (vertices
+// per row) and terrainMax (the last texel).
+
+struct TerrainVertex {
+  GLfloat height;
+  GLshort normal[2];
+};
+
+TerrainVertex packTerrainVertex( float height, vec3 normal );
+GLuint        makeTerrainVAO( const TerrainVertex *vertices, int nVerts, GLuint &VBO );
+
+
+// View frustum culling
+
+void frustumPlanes( mat4 &MVP, vec4 planes[6] );
+bool boxInFrustum( vec4 planes[6], vec3 lo, vec3 hi );
+
+
+struct TerrainChunk {
+  int    x0, y0;                // texel of the lower-left corner
+  float  minZ, maxZ;            // height range
+  float  error[TERRAIN_CHUNK_LODS]; // maximum height error at each level
+  int    lod;                   // level chosen for this frame
+  bool   visible;               // in the view frustum this frame
+  GLuint VAO, VBO;
+};
 
 
 class Terrain {
 
-  vec3 **points;
-  vec3 **normals;
+  float *heights;               // heights[ y*width + x ]
+  vec3  *normals;               // normals[ y*width + x ], or NULL after upload
   seq<vec3> quadsToHighlight;
 
-  bool rayTriangleInt( vec3 rayStart, vec3 rayDir, vec3 v0, vec3 v1, vec3 v2, vec3 & intPoint, float & intParam );
+  MinMaxPyramid pyramid;        // height bounds for ray intersection
+
+  void releaseNormals();
+
+
+  TerrainChunk *chunks;         // chunks[ cy*nChunksX + cx ]
+  int           nChunksX, nChunksY;
+
+  GLuint lodIndexBuffer[TERRAIN_CHUNK_LODS][16]; // by level and neighbour mask
+  int    lodIndexCount[TERRAIN_CHUNK_LODS][16];
+
+  int nChunksDrawn, nTrianglesDrawn;
+
+  void allocateChunks();
+  void measureChunk( TerrainChunk &chunk );
+  void buildChunk( TerrainChunk &chunk, TerrainVertex *vertices );
+  void uploadChunk( TerrainChunk &chunk, const TerrainVertex *vertices );
+  int  buildLODIndices( int lod, int mask, GLushort *indexBuffer );
+  void uploadLODIndices( int lod, int mask, const GLushort *indexBuffer, int count );
+  void chooseLODs( mat4 &MV, mat4 &MVP );
+  void drawChunks( mat4 &MV, mat4 &MVP );
+
+  // With GPU displacement, every chunk shares one VAO with no vertex
+  // attributes, and the vertex shader reads the heights from a texture
+
+  bool   displaced;
+  GLuint gridVAO;
+  GLuint heightTextureID;
+
+  void uploadHeightTexture();
+
+  GLuint undersideVAO, curtainVAO; // static sides of the terrain box
+  int    nCurtainPts;
+
+  void setupBoxVAOs();
+
+  TerrainCache cache;           // mapped cache, if current
+  string       cacheName;
+  uint64_t     cacheKey;
+
+  bool readHeightfield( string filename );
+  bool openCache( string filename );
+  bool writeCache();
+
+  TerrainTiles *tiles;          // out-of-core heightfield, or NULL if 'heights' holds it all
+
+  Terrain() {                   // for bakeCache(): no OpenGL
+    heights = NULL;
+    normals = NULL;
+    chunks = NULL;
+    tiles = NULL;
+    displaced = false;
+    gridVAO = 0;
+    heightTextureID = 0;
+  }
 
-  GLuint      VAO; 
   GPUProgram  gpu;
-  int         nFaces;
 
   static const char *vertShader;
   static const char *fragShader;
@@ -28,7 +158,52 @@ class Terrain {
 
  public:
 
-  Texture *heightfield;
+  unsigned int width, height;   // heightfield size in texels
+
+  float getHeight( int x, int y ) {
+    if (tiles != NULL)
+      return tiles->getHeight( x, y );
+    return heights[ y*width + x ];
+  }
+
+  vec3 point( int x, int y ) {
+    return vec3( x, y, getHeight( x, y ) );
+  }
+
+  void setHeight( int x, int y, float h ) { // in-core only; does not rebuild the mesh
+    heights[ y*width + x ] = h;
+    pyramid.update( x, y, x, y );
+  }
+
+  float clampedHeight( int x, int y ) { // nearest height within the heightfield
+    x = (x < 0 ? 0 : (x > (int) width-1  ? width-1  : x));
+    y = (y < 0 ? 0 : (y > (int) height-1 ? height-1 : y));
+    return getHeight( x, y );
+  }
+
+  // Bilinearly interpolated heights at n points in texel coordinates
+  // (clamped to the heightfield).  For many points this is much faster
+  // than calling heightAt() in a loop (see terrainHeights.h).
+
+  void heightsAt( const vec2 *xy, float *out, size_t n );
+
+  float heightAt( vec2 xy ) {
+    float h;
+    heightsAt( &xy, &h, 1 );
+    return h;
+  }
+
+  // Lowest height of a curve above the terrain, sampled every
+  // 'spacing' along its arc length.  'atArcLength' is set to where it
+  // is lowest.  Negative if the curve goes underground.
+
+  float clearance( Spline &spline, float spacing, float &atArcLength );
+
+  vec3 &normal( int x, int y ) {
+    return normals[ y*width + x ];
+  }
+
+  string   heightfieldName;
   Texture *texture;
   Texture* distortionTex;
   Texture* normalTex;
@@ -47,8 +222,16 @@ class Terrain {
 
    Terrain(string basePath, string heightfieldFilename, string textureFilename)
   {
+      heights = NULL;
+      normals = NULL;
+      chunks = NULL;
+      tiles = NULL;
+      nChunksDrawn = nTrianglesDrawn = 0;
+      displaced = gpuDisplacement;
+      gridVAO = 0;
+      heightTextureID = 0;
       readTextures(basePath, heightfieldFilename, textureFilename, "flow_noise.png", "water-normal.png");
-      vertShader = gpu.textFileRead("data/water.vert");
+      vertShader = gpu.textFileRead(displaced ? "data/water-displaced.vert" : "data/water.vert");
       fragShader = gpu.textFileRead("data/water.frag");
       elapsedSeconds = 0;
 
@@ -61,11 +244,28 @@ class Terrain {
 
 
   
+  ~Terrain();                   // frees the heightfield, the mesh, and its references to the textures
+
   void readTextures( string basePath, string heightfieldFilename, string textureFilename, string distortionFilename,  string normalFilename );
   void readTextures( string basePath, string heightfieldFilename, string textureFilename);
   void setupVAO();
+
+  static bool bakeCache( string basePath, string heightfieldFilename );
+
+  static bool gpuDisplacement;  // displace a shared grid by a height texture, rather than build vertex buffers
+
+  static TextureUploader *textureUploader; // if set, textures are loaded through it, without waiting for them
+
   void draw( mat4 &MV, mat4 &MVP, vec3 lightDir, bool drawUndersideOnly );
 
+  int chunksDrawn() {           // in the last frame
+    return nChunksDrawn;
+  }
+
+  int trianglesDrawn() {
+    return nTrianglesDrawn;
+  }
+
   inline void setTime(float time) { elapsedSeconds += time; }
 
   bool findIntPoint( vec3 rayStart, vec3 rayDir, vec3 planePerp, vec3 &intPoint, mat4 &M );
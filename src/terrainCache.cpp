@@ -0,0 +1,260 @@
+// terrainCache.cpp
+
+
+#include "terrainCache.h"
+#include "terrain.h"            // for alignedAlloc
+
+#ifndef _WIN32
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+
+
+uint64_t fnvHash( const void *data, size_t n, uint64_t hash )
+
+{
+  const unsigned char *p = (const unsigned char *) data;
+
+  for (size_t i=0; i<n; i++) {
+    hash ^= p[i];
+    hash *= FNV_PRIME;
+  }
+
+  return hash;
+}
+
+
+// Hash the bytes of a file into 'hash'
+
+bool fnvHashFile( const char *filename, uint64_t &hash )
+
+{
+  FILE *in = fopen( filename, "rb" );
+  if (in == NULL)
+    return false;
+
+  static const size_t bufferSize = 1 << 16;
+  unsigned char *buffer = new unsigned char[ bufferSize ];
+
+  size_t n;
+  while ((n = fread( buffer, 1, bufferSize, in )) > 0)
+    hash = fnvHash( buffer, n, hash );
+
+  delete[] buffer;
+  fclose( in );
+
+  return true;
+}
+
+
+unsigned char *mapFile( const char *filename, size_t &size, bool writable, size_t minSize )
+
+{
+  unsigned char *mapping = NULL;
+
+#ifndef _WIN32
+
+  int fd = ::open( filename, O_RDONLY );
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  fstat( fd, &st );
+  size = st.st_size;
+
+  if (size >= minSize) {
+    void *p = mmap( NULL, size, PROT_READ | (writable ? PROT_WRITE : 0), MAP_PRIVATE, fd, 0 );
+    if (p != MAP_FAILED)
+      mapping = (unsigned char *) p;
+  }
+
+  ::close( fd );
+
+#else
+
+  // No mmap: read the whole file
+
+  FILE *in = fopen( filename, "rb" );
+  if (in == NULL)
+    return NULL;
+
+  fseek( in, 0, SEEK_END );
+  size = ftell( in );
+  rewind( in );
+
+  if (size >= minSize) {
+    mapping = (unsigned char *) alignedAlloc( size );
+    if (mapping != NULL && fread( mapping, 1, size, in ) != size) {
+      alignedFree( mapping );
+      mapping = NULL;
+    }
+  }
+
+  fclose( in );
+
+#endif
+
+  return mapping;
+}
+
+
+void unmapFile( unsigned char *mapping, size_t size )
+
+{
+  if (mapping == NULL)
+    return;
+
+#ifndef _WIN32
+  munmap( mapping, size );
+#else
+  alignedFree( mapping );
+#endif
+}
+
+
+// ---------------- TerrainCache ----------------
+
+
+bool TerrainCache::open( const char *filename, uint64_t key )
+
+{
+  close();
+
+  mapping = mapFile( filename, mappingSize, true, sizeof(TerrainCacheHeader) ); // writable, so heights can change in place
+
+  if (mapping == NULL) {
+    mappingSize = 0;
+    return false;
+  }
+
+  header = (TerrainCacheHeader *) mapping;
+
+  if (strncmp( header->magic, TERRAIN_CACHE_MAGIC, sizeof(header->magic) ) != 0 ||
+      header->version != TERRAIN_CACHE_VERSION ||
+      header->key != key ||
+      header->fileSize != mappingSize) {
+    cerr << "Terrain cache '" << filename << "' is stale and will be rebuilt." << endl;
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+
+void TerrainCache::close()
+
+{
+  unmapFile( mapping, mappingSize );
+
+  mapping = NULL;
+  mappingSize = 0;
+  header = NULL;
+}
+
+
+// ---------------- TerrainCacheWriter ----------------
+
+
+bool TerrainCacheWriter::open( const char *name, uint64_t key )
+
+{
+  filename = name;
+
+  file = fopen( (filename + ".tmp").c_str(), "wb" );
+
+  if (file == NULL) {
+    cerr << "Could not write terrain cache '" << filename << "'." << endl;
+    return false;
+  }
+
+  memset( &header, 0, sizeof(header) );
+  strncpy( header.magic, TERRAIN_CACHE_MAGIC, sizeof(header.magic) );
+  header.version = TERRAIN_CACHE_VERSION;
+  header.key = key;
+
+  // Reserve space for the header, which is written by finish()
+
+  offset = 0;
+  write( &header, sizeof(header) );
+  align();
+
+  return true;
+}
+
+
+uint64_t TerrainCacheWriter::write( const void *data, size_t n )
+
+{
+  uint64_t start = offset;
+
+  if (file == NULL)
+    return 0;                   // an earlier write failed
+
+  if (fwrite( data, 1, n, file ) != n) {
+    cerr << "Error writing terrain cache '" << filename << "'." << endl;
+    discard();
+    return 0;
+  }
+
+  offset += n;
+  return start;
+}
+
+
+uint64_t TerrainCacheWriter::align()
+
+{
+  static const char zeros[TERRAIN_CACHE_ALIGNMENT] = { 0 };
+
+  size_t pad = (TERRAIN_CACHE_ALIGNMENT - offset % TERRAIN_CACHE_ALIGNMENT) % TERRAIN_CACHE_ALIGNMENT;
+
+  if (pad > 0)
+    write( zeros, pad );
+
+  return offset;
+}
+
+
+bool TerrainCacheWriter::finish()
+
+{
+  if (file == NULL)
+    return false;               // a write failed
+
+  header.fileSize = offset;
+
+  rewind( file );
+  bool ok = (fwrite( &header, sizeof(header), 1, file ) == 1);
+  ok = (fclose( file ) == 0) && ok;
+  file = NULL;
+
+  string tmpName = filename + ".tmp";
+
+#ifdef _WIN32
+  remove( filename.c_str() );   // rename() does not replace on Windows
+#endif
+
+  if (!ok || rename( tmpName.c_str(), filename.c_str() ) != 0) {
+    cerr << "Could not write terrain cache '" << filename << "'." << endl;
+    remove( tmpName.c_str() );
+    return false;
+  }
+
+  return true;
+}
+
+
+void TerrainCacheWriter::discard()
+
+{
+  if (file == NULL)
+    return;
+
+  fclose( file );
+  file = NULL;
+
+  remove( (filename + ".tmp").c_str() );
+}
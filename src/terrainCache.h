@@ -0,0 +1,174 @@
+// terrainCache.h
+//
+// Binary cache of a terrain that is ready to upload, so that a warm
+// start skips decoding the heightfield PNG and building the mesh.
+//
+// The cache file is written next to the heightfield, with
+// TERRAIN_CACHE_SUFFIX appended to its name, the first time the
+// terrain is loaded (or offline with 'rollercoaster -bakeTerrain').
+// It is keyed by a hash of the PNG's bytes and of the parameters that
+// the mesh is built with, so a changed heightfield or a changed build
+// makes a stale cache be rebuilt.
+//
+// Layout (each section starts on a TERRAIN_CACHE_ALIGNMENT boundary,
+// so the file can be mapped and used in place):
+//
+//    TerrainCacheHeader
+//    heights          float[ height ][ width ]
+//    pyramid          for each level: float min[], float max[]
+//    vertices         for each chunk: TerrainVertex[] (see terrain.h)
+//    chunks           TerrainChunkRecord[ nChunks ]
+//    indices          GLushort index buffers, by level and neighbour mask
+
+
+#ifndef TERRAIN_CACHE_H
+#define TERRAIN_CACHE_H
+
+#include "headers.h"
+#include "minMaxPyramid.h"
+
+#include <stdint.h>
+
+
+#define TERRAIN_CACHE_MAGIC     "RCTERR"
+#define TERRAIN_CACHE_VERSION   3
+#define TERRAIN_CACHE_ALIGNMENT 4096   // bytes (one page)
+#define TERRAIN_CACHE_SUFFIX    ".cache"
+
+#define CACHE_CHUNK_LODS 7      // = TERRAIN_CHUNK_LODS (checked in terrain.cpp)
+
+
+struct TerrainCacheHeader {
+
+  char     magic[8];
+  uint32_t version;
+  uint32_t chunkSize;
+  uint64_t key;                 // hash of the source and build parameters
+  uint64_t fileSize;
+
+  uint32_t width, height;       // heightfield
+  uint32_t nChunksX, nChunksY;
+  uint32_t nPyramidLevels;
+  uint32_t chunkBytes;          // packed vertex data per chunk
+
+  uint64_t heightsOffset;
+  uint64_t pyramidOffset[MAX_PYRAMID_LEVELS];
+  uint64_t verticesOffset;
+  uint64_t chunksOffset;
+  uint64_t indicesOffset[CACHE_CHUNK_LODS][16];
+  uint32_t indexCount[CACHE_CHUNK_LODS][16];
+};
+
+
+struct TerrainChunkRecord {
+  int32_t x0, y0;
+  float   minZ, maxZ;
+  float   error[CACHE_CHUNK_LODS];
+};
+
+
+// Hash for the cache key
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME  1099511628211ULL
+
+uint64_t fnvHash( const void *data, size_t n, uint64_t hash = FNV_OFFSET );
+bool     fnvHashFile( const char *filename, uint64_t &hash );
+
+
+// Map a whole file into memory (or, without mmap, read it).  With
+// 'writable', changes are private to the process.  Returns NULL if the
+// file cannot be read or is shorter than 'minSize'.
+
+unsigned char *mapFile( const char *filename, size_t &size, bool writable, size_t minSize = 1 );
+void           unmapFile( unsigned char *mapping, size_t size );
+
+
+// A mapped cache file
+
+class TerrainCache {
+
+  unsigned char *mapping;
+  size_t         mappingSize;
+
+ public:
+
+  TerrainCacheHeader *header;
+
+  TerrainCache() {
+    mapping = NULL;
+    mappingSize = 0;
+    header = NULL;
+  }
+
+  ~TerrainCache() {
+    close();
+  }
+
+  // Map the file if it exists and matches 'key'.  The mapping is
+  // private and writable, so heights can be changed in place without
+  // changing the file.
+
+  bool open( const char *filename, uint64_t key );
+  void close();
+
+  bool isOpen() {
+    return mapping != NULL;
+  }
+
+  float *heights() {
+    return (float *) (mapping + header->heightsOffset);
+  }
+
+  float *pyramidLevel( int level ) { // min[], then max[]
+    return (float *) (mapping + header->pyramidOffset[level]);
+  }
+
+  const void *chunkVertices( int i ) { // TerrainVertex[]
+    return mapping + header->verticesOffset + (size_t) i * header->chunkBytes;
+  }
+
+  TerrainChunkRecord *chunks() {
+    return (TerrainChunkRecord *) (mapping + header->chunksOffset);
+  }
+
+  GLushort *indices( int lod, int mask ) {
+    return (GLushort *) (mapping + header->indicesOffset[lod][mask]);
+  }
+};
+
+
+// Sequential writer.  The file is written under a temporary name and
+// renamed when finished, so a partly written cache is never used.
+
+class TerrainCacheWriter {
+
+  FILE    *file;
+  string   filename;
+  uint64_t offset;
+
+ public:
+
+  TerrainCacheHeader header;
+
+  TerrainCacheWriter() {
+    file = NULL;
+    offset = 0;
+  }
+
+  ~TerrainCacheWriter() {
+    if (file != NULL)
+      discard();
+  }
+
+  bool open( const char *filename, uint64_t key );
+
+  uint64_t write( const void *data, size_t n ); // returns the offset of the data
+  uint64_t align();                              // pad to TERRAIN_CACHE_ALIGNMENT; returns the new offset
+
+  bool finish();
+  void discard();
+};
+
+
+#endif
@@ -0,0 +1,146 @@
+// terrainHeights.cpp
+
+
+#include "terrainHeights.h"
+
+#include <thread>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+
+// Heights at points [i0,i1).
+//
+// A point is clamped to [0,width-1] x [0,height-1] and its lower-left
+// corner to [0,width-2] x [0,height-2], so the upper-right corner is
+// always in the heightfield (a point on the right edge gets fx = 1).
+// The coordinates are non-negative after clamping, so truncation is
+// floor.  The scalar loop does exactly the same arithmetic as the SSE2
+// loop, so a point's height does not depend on where it falls in the
+// batch.
+
+
+static void heightRange( const float *heights, int width, int height,
+                         const vec2 *xy, float *out, size_t i0, size_t i1 )
+
+{
+  const float xMax  = width-1;
+  const float yMax  = height-1;
+  const float x0Max = width-2;
+  const float y0Max = height-2;
+
+  size_t i = i0;
+
+#ifdef __SSE2__
+
+  const __m128 zero   = _mm_setzero_ps();
+  const __m128 xHi    = _mm_set1_ps( xMax );
+  const __m128 yHi    = _mm_set1_ps( yMax );
+  const __m128 x0Hi   = _mm_set1_ps( x0Max );
+  const __m128 y0Hi   = _mm_set1_ps( y0Max );
+
+  for ( ; i+4 <= i1; i+=4) {
+
+    // Split four (x,y) pairs into an x register and a y register
+
+    __m128 a = _mm_loadu_ps( &xy[i  ].x );
+    __m128 b = _mm_loadu_ps( &xy[i+2].x );
+
+    __m128 x = _mm_shuffle_ps( a, b, _MM_SHUFFLE( 2, 0, 2, 0 ) );
+    __m128 y = _mm_shuffle_ps( a, b, _MM_SHUFFLE( 3, 1, 3, 1 ) );
+
+    x = _mm_min_ps( _mm_max_ps( x, zero ), xHi );
+    y = _mm_min_ps( _mm_max_ps( y, zero ), yHi );
+
+    __m128 x0 = _mm_min_ps( _mm_cvtepi32_ps( _mm_cvttps_epi32( x ) ), x0Hi );
+    __m128 y0 = _mm_min_ps( _mm_cvtepi32_ps( _mm_cvttps_epi32( y ) ), y0Hi );
+
+    __m128 fx = _mm_sub_ps( x, x0 );
+    __m128 fy = _mm_sub_ps( y, y0 );
+
+    // Load the corners (SSE2 has no 32-bit multiply for the index, so
+    // that is done in scalar code too)
+
+    alignas(16) int32_t xi[4], yi[4];
+    alignas(16) float   h00[4], h10[4], h01[4], h11[4];
+
+    _mm_store_si128( (__m128i *) xi, _mm_cvttps_epi32( x0 ) );
+    _mm_store_si128( (__m128i *) yi, _mm_cvttps_epi32( y0 ) );
+
+    for (int k=0; k<4; k++) {
+      const float *p = heights + (size_t) yi[k] * width + xi[k];
+      h00[k] = p[0];
+      h10[k] = p[1];
+      h01[k] = p[width];
+      h11[k] = p[width+1];
+    }
+
+    __m128 c00 = _mm_load_ps( h00 );
+    __m128 c01 = _mm_load_ps( h01 );
+
+    __m128 lower = _mm_add_ps( c00, _mm_mul_ps( fx, _mm_sub_ps( _mm_load_ps( h10 ), c00 ) ) );
+    __m128 upper = _mm_add_ps( c01, _mm_mul_ps( fx, _mm_sub_ps( _mm_load_ps( h11 ), c01 ) ) );
+
+    _mm_storeu_ps( out+i, _mm_add_ps( lower, _mm_mul_ps( fy, _mm_sub_ps( upper, lower ) ) ) );
+  }
+
+#endif
+
+  // Remaining points
+
+  for ( ; i<i1; i++) {
+
+    float x = MIN( MAX( xy[i].x, 0.0f ), xMax );
+    float y = MIN( MAX( xy[i].y, 0.0f ), yMax );
+
+    float x0 = MIN( (float) (int) x, x0Max );
+    float y0 = MIN( (float) (int) y, y0Max );
+
+    float fx = x - x0;
+    float fy = y - y0;
+
+    const float *p = heights + (size_t) y0 * width + (int) x0;
+
+    float lower = p[0]     + fx * (p[1]       - p[0]);
+    float upper = p[width] + fx * (p[width+1] - p[width]);
+
+    out[i] = lower + fy * (upper - lower);
+  }
+}
+
+
+void bilinearHeights( const float *heights, int width, int height,
+                      const vec2 *xy, float *out, size_t n, int nThreads )
+
+{
+  if (nThreads <= 0)
+    nThreads = std::thread::hardware_concurrency();
+
+  if ((size_t) nThreads > n / HEIGHTS_MIN_POINTS_PER_THREAD)
+    nThreads = n / HEIGHTS_MIN_POINTS_PER_THREAD;
+
+  if (nThreads <= 1) {
+    heightRange( heights, width, height, xy, out, 0, n );
+    return;
+  }
+
+  // One range of points per thread.  Ranges are multiples of four
+  // points, so only the last one has a scalar tail.
+
+  std::vector<std::thread> workers;
+
+  for (int t=0; t<nThreads; t++) {
+    size_t i0 = (t == 0          ? 0 : (n *  t    / nThreads) & ~(size_t) 3);
+    size_t i1 = (t == nThreads-1 ? n : (n * (t+1) / nThreads) & ~(size_t) 3);
+    workers.push_back( std::thread( heightRange, heights, width, height, xy, out, i0, i1 ) );
+  }
+
+  for (auto &w : workers)
+    w.join();
+}
@@ -0,0 +1,28 @@
+// terrainHeights.h
+//
+// Bilinearly interpolated heights at many points of a heightfield at
+// once.  The points are in texel coordinates and are clamped to the
+// heightfield.  Points are done four at a time with SSE2 (where
+// available): the coordinates, weights and interpolation are
+// vectorized, and the sixteen corner heights are loaded one by one,
+// since SSE2 has no gather.  Large batches are split into ranges, one
+// per worker thread.
+
+
+#ifndef TERRAIN_HEIGHTS_H
+#define TERRAIN_HEIGHTS_H
+
+#include "headers.h"
+
+
+#define HEIGHTS_MIN_POINTS_PER_THREAD 16384  // don't start a thread for fewer points than this
+
+
+// heights[ y*width + x ] at xy[0..n-1] -> out[0..n-1].  width and
+// height must be at least 2.  nThreads = 0 uses all cores.
+
+void bilinearHeights( const float *heights, int width, int height,
+                      const vec2 *xy, float *out, size_t n, int nThreads = 0 );
+
+
+#endif
@@ -0,0 +1,157 @@
+// terrainNormals.cpp
+
+
+#include "terrainNormals.h"
+
+#include <thread>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+// Normal at one texel, with the neighbours clamped to the heightfield
+
+
+static void borderNormal( const float *heights, vec3 *normals, int width, int height, int x, int y )
+
+{
+  int x0 = (x > 0 ? x-1 : x);
+  int x1 = (x < width-1 ? x+1 : x);
+  int y0 = (y > 0 ? y-1 : y);
+  int y1 = (y < height-1 ? y+1 : y);
+
+  float dx = (x1 > x0 ? (heights[y*width+x1] - heights[y*width+x0]) / (x1-x0) : 0);
+  float dy = (y1 > y0 ? (heights[y1*width+x] - heights[y0*width+x]) / (y1-y0) : 0);
+
+  float s = 1 / sqrt( dx*dx + dy*dy + 1 );
+
+  normals[y*width+x] = vec3( -dx*s, -dy*s, s );
+}
+
+
+// Normals for rows [y0,y1)
+
+
+static void normalRows( const float *heights, vec3 *normals, int width, int height, int y0, int y1 )
+
+{
+  for (int y=y0; y<y1; y++) {
+
+    // Rows above and below, and the y difference scale (one-sided on
+    // the first and last rows)
+
+    const float *row  = heights + y*width;
+    const float *prev = (y > 0        ? row - width : row);
+    const float *next = (y < height-1 ? row + width : row);
+    const float yScale = (prev != row && next != row ? 0.5 : 1);
+
+    vec3 *n = normals + y*width;
+
+    int x = 1;
+
+#ifdef __SSE2__
+
+    // Four interior texels at a time.  Each vec3 is written with a
+    // four-float store whose last float is overwritten by the next
+    // store; the last one overlaps n[x+4], which is at most the border
+    // texel and is written after this loop.
+
+    const __m128 half = _mm_set1_ps( 0.5 );
+    const __m128 ys   = _mm_set1_ps( yScale );
+    const __m128 one  = _mm_set1_ps( 1 );
+    const __m128 zero = _mm_setzero_ps();
+
+    for ( ; x+4 <= width-1; x+=4) {
+
+      __m128 dx = _mm_mul_ps( half, _mm_sub_ps( _mm_loadu_ps( row+x+1 ), _mm_loadu_ps( row+x-1 ) ) );
+      __m128 dy = _mm_mul_ps( ys,   _mm_sub_ps( _mm_loadu_ps( next+x ),  _mm_loadu_ps( prev+x ) ) );
+
+      __m128 s = _mm_div_ps( one, _mm_sqrt_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( dx, dx ), _mm_mul_ps( dy, dy ) ), one ) ) );
+
+      __m128 nx = _mm_sub_ps( zero, _mm_mul_ps( dx, s ) );
+      __m128 ny = _mm_sub_ps( zero, _mm_mul_ps( dy, s ) );
+      __m128 nz = s;
+      __m128 nw = zero;
+
+      _MM_TRANSPOSE4_PS( nx, ny, nz, nw ); // now one (x,y,z,0) per register
+
+      _mm_storeu_ps( &n[x  ].x, nx );
+      _mm_storeu_ps( &n[x+1].x, ny );
+      _mm_storeu_ps( &n[x+2].x, nz );
+      _mm_storeu_ps( &n[x+3].x, nw );
+    }
+
+#endif
+
+    // Remaining interior texels
+
+    for ( ; x < width-1; x++) {
+
+      float dx = 0.5 * (row[x+1] - row[x-1]);
+      float dy = yScale * (next[x] - prev[x]);
+
+      float s = 1 / sqrt( dx*dx + dy*dy + 1 );
+
+      n[x] = vec3( -dx*s, -dy*s, s );
+    }
+
+    // Left and right border texels
+
+    borderNormal( heights, normals, width, height, 0, y );
+    if (width > 1)
+      borderNormal( heights, normals, width, height, width-1, y );
+  }
+}
+
+
+void computeNormals( const float *heights, vec3 *normals, int width, int height, int nThreads )
+
+{
+  if (nThreads <= 0)
+    nThreads = std::thread::hardware_concurrency();
+
+  if (nThreads > height / NORMALS_MIN_ROWS_PER_THREAD)
+    nThreads = height / NORMALS_MIN_ROWS_PER_THREAD;
+
+  if (nThreads <= 1) {
+    normalRows( heights, normals, width, height, 0, height );
+    return;
+  }
+
+  // One band of rows per thread.  Bands only read from neighbouring
+  // rows and write to their own rows, so no locking is needed.
+
+  std::vector<std::thread> workers;
+
+  for (int i=0; i<nThreads; i++) {
+    int y0 = (int) ((long long) height *  i    / nThreads);
+    int y1 = (int) ((long long) height * (i+1) / nThreads);
+    workers.push_back( std::thread( normalRows, heights, normals, width, height, y0, y1 ) );
+  }
+
+  for (auto &w : workers)
+    w.join();
+}
+
+
+
+void encodeOctahedral( vec3 n, int16_t packed[2] )
+
+{
+  float s = fabs(n.x) + fabs(n.y) + fabs(n.z);
+
+  float u = n.x / s;
+  float v = n.y / s;
+
+  if (n.z < 0) {
+    float fu = (1 - fabs(v)) * (u >= 0 ? 1 : -1);
+    float fv = (1 - fabs(u)) * (v >= 0 ? 1 : -1);
+    u = fu;
+    v = fv;
+  }
+
+  packed[0] = (int16_t) lrintf( u * 32767 );
+  packed[1] = (int16_t) lrintf( v * 32767 );
+}
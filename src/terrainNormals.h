@@ -0,0 +1,39 @@
+// terrainNormals.h
+//
+// Vertex normals of a heightfield by central differences:
+//
+//    n = normalize( -(h[x+1] - h[x-1])/2, -(h[y+1] - h[y-1])/2, 1 )
+//
+// with one-sided differences on the border.  The rows are split into
+// bands, one per worker thread.  Within a row, the interior texels
+// are done four at a time with SSE2 (where available) and the two
+// border texels are done separately, so the inner loop has no
+// branches.
+
+
+#ifndef TERRAIN_NORMALS_H
+#define TERRAIN_NORMALS_H
+
+#include "headers.h"
+
+#include <stdint.h>
+
+
+#define NORMALS_MIN_ROWS_PER_THREAD 64  // don't start a thread for fewer rows than this
+
+
+// heights[ y*width + x ] -> normals[ y*width + x ].  nThreads = 0
+// uses all cores.
+
+void computeNormals( const float *heights, vec3 *normals, int width, int height, int nThreads = 0 );
+
+
+// Octahedral encoding of a unit normal in two signed 16-bit values
+// (for a normalized GL_SHORT vertex attribute).  The normal is
+// projected onto the octahedron |x|+|y|+|z| = 1, and the lower half of
+// the octahedron is folded over the upper half.
+
+void encodeOctahedral( vec3 n, int16_t packed[2] );
+
+
+#endif
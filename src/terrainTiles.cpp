@@ -0,0 +1,886 @@
+// terrainTiles.cpp
+
+
+#include "terrainTiles.h"
+#include "terrain.h"            // for alignedAlloc and frustum culling
+#include "terrainNormals.h"
+
+#include <algorithm>
+
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+#define TILE_PAGE_SIZE 4096     // tiles start on page boundaries
+
+
+static uint64_t pageRound( uint64_t n )
+
+{
+  return (n + TILE_PAGE_SIZE-1) / TILE_PAGE_SIZE * TILE_PAGE_SIZE;
+}
+
+
+// ---------------- Writing a tile file ----------------
+
+
+// Rows are read into a strip one tile high.  Rows and columns past the
+// top and right edges of the heightfield (which fill out the last
+// tiles) repeat the edge.
+
+
+bool TerrainTiles::build( const char *filename, int width, int height,
+                          std::function<bool( int y, float *row )> readRow )
+
+{
+  if (width < 2 || height < 2) {
+    cerr << "Heightfield is smaller than 2x2." << endl;
+    return false;
+  }
+
+  TileFileHeader header;
+
+  memset( &header, 0, sizeof(header) );
+  strncpy( header.magic, TILE_MAGIC, sizeof(header.magic) );
+  header.version = TILE_VERSION;
+  header.tileSize = TILE_SIZE;
+
+  header.width = width;
+  header.height = height;
+  header.nTilesX = (width  - 2) / TILE_SIZE + 1;
+  header.nTilesY = (height - 2) / TILE_SIZE + 1;
+
+  int paddedWidth = header.nTilesX * TILE_SIZE + 1;
+  int paddedHeight = header.nTilesY * TILE_SIZE + 1;
+
+  int step = TILE_OVERVIEW_MIN_STEP;
+  while (step < TILE_SIZE && ((paddedWidth-1) / step > TILE_OVERVIEW_SIZE || (paddedHeight-1) / step > TILE_OVERVIEW_SIZE))
+    step *= 2;
+
+  header.overviewStep = step;
+  header.overviewWidth = (paddedWidth-1) / step + 1;
+  header.overviewHeight = (paddedHeight-1) / step + 1;
+
+  int nTiles = header.nTilesX * header.nTilesY;
+  int ow = header.overviewWidth;
+
+  header.tileStride = pageRound( TILE_VERTS * sizeof(float) );
+  header.tilesOffset = pageRound( sizeof(header) );
+  header.overviewOffset = header.tilesOffset + nTiles * header.tileStride;
+  header.boundsOffset = pageRound( header.overviewOffset + (uint64_t) ow * header.overviewHeight * sizeof(float) );
+
+  // Write under a temporary name, so a partly written file is never used
+
+  string tmpName = string(filename) + ".tmp";
+
+  FILE *out = fopen( tmpName.c_str(), "wb" );
+  if (out == NULL) {
+    cerr << "Could not write '" << filename << "'." << endl;
+    return false;
+  }
+
+  float *strip    = new float[ (TILE_SIZE+1) * paddedWidth ];
+  float *tile     = new float[ TILE_VERTS ];
+  float *overview = new float[ ow * header.overviewHeight ];
+  float *bounds   = new float[ 2 * nTiles ];
+
+  bool ok = true;
+
+  for (int ty=0; ty<(int)header.nTilesY && ok; ty++) {
+
+    // The first row of a strip is the last row of the one before
+
+    int r0 = 0;
+
+    if (ty > 0) {
+      memcpy( strip, strip + TILE_SIZE*paddedWidth, paddedWidth * sizeof(float) );
+      r0 = 1;
+    }
+
+    for (int r=r0; r<=TILE_SIZE && ok; r++) {
+
+      int y = ty*TILE_SIZE + r;
+      float *row = strip + r*paddedWidth;
+
+      if (y < height)
+        ok = readRow( y, row );
+      else
+        memcpy( row, row - paddedWidth, paddedWidth * sizeof(float) );
+
+      for (int x=width; x<paddedWidth; x++)
+        row[x] = row[width-1];
+
+      if (y % step == 0)
+        for (int ox=0; ox<ow; ox++)
+          overview[ (y/step)*ow + ox ] = row[ ox*step ];
+    }
+
+    // Cut the strip into tiles
+
+    for (int tx=0; tx<(int)header.nTilesX && ok; tx++) {
+
+      float lo = MAXFLOAT;
+      float hi = -MAXFLOAT;
+
+      for (int j=0; j<=TILE_SIZE; j++)
+        for (int i=0; i<=TILE_SIZE; i++) {
+          float h = strip[ j*paddedWidth + tx*TILE_SIZE + i ];
+          tile[ j*(TILE_SIZE+1) + i ] = h;
+          lo = MIN( lo, h );
+          hi = MAX( hi, h );
+        }
+
+      int index = ty * header.nTilesX + tx;
+
+      bounds[2*index]   = lo;
+      bounds[2*index+1] = hi;
+
+      ok = (fseeko( out, header.tilesOffset + index * header.tileStride, SEEK_SET ) == 0 &&
+            fwrite( tile, sizeof(float), TILE_VERTS, out ) == TILE_VERTS);
+    }
+  }
+
+  // Overview, bounds, and finally the header
+
+  ok = ok &&
+       fseeko( out, header.overviewOffset, SEEK_SET ) == 0 &&
+       fwrite( overview, sizeof(float), ow * header.overviewHeight, out ) == ow * header.overviewHeight &&
+       fseeko( out, header.boundsOffset, SEEK_SET ) == 0 &&
+       fwrite( bounds, sizeof(float), 2 * nTiles, out ) == (size_t) 2 * nTiles &&
+       fseeko( out, 0, SEEK_SET ) == 0 &&
+       fwrite( &header, sizeof(header), 1, out ) == 1;
+
+  ok = (fclose( out ) == 0) && ok;
+
+  delete[] strip;
+  delete[] tile;
+  delete[] overview;
+  delete[] bounds;
+
+#ifdef _WIN32
+  if (ok)
+    remove( filename );         // rename() does not replace on Windows
+#endif
+
+  if (!ok || rename( tmpName.c_str(), filename ) != 0) {
+    cerr << "Could not write '" << filename << "'." << endl;
+    remove( tmpName.c_str() );
+    return false;
+  }
+
+  return true;
+}
+
+
+// ---------------- Opening and closing ----------------
+
+
+bool TerrainTiles::open( const char *filename )
+
+{
+  close();
+
+  file = fopen( filename, "rb" );
+
+  if (file == NULL) {
+    cerr << "Could not open tiled terrain '" << filename << "'." << endl;
+    return false;
+  }
+
+  if (fread( &header, sizeof(header), 1, file ) != 1 ||
+      strncmp( header.magic, TILE_MAGIC, sizeof(header.magic) ) != 0 ||
+      header.version != TILE_VERSION ||
+      header.tileSize != TILE_SIZE ||
+      header.overviewStep == 0 || TILE_SIZE % header.overviewStep != 0 ||
+      (TILE_OVERVIEW_CHUNK * header.overviewStep) % TILE_SIZE != 0) {
+    cerr << "'" << filename << "' is not a tiled terrain of this version; rebuild it with -tileTerrain." << endl;
+    fclose( file );
+    file = NULL;
+    return false;
+  }
+
+  width = header.width;
+  height = header.height;
+  nTilesX = header.nTilesX;
+  nTilesY = header.nTilesY;
+
+  int nTiles = nTilesX * nTilesY;
+  size_t overviewSize = header.overviewWidth * header.overviewHeight;
+
+  // The overview and the tile bounds stay in memory
+
+  overview = (float *) alignedAlloc( overviewSize * sizeof(float) );
+  float *bounds = new float[ 2 * nTiles ];
+
+  bool ok = (fseeko( file, header.overviewOffset, SEEK_SET ) == 0 &&
+             fread( overview, sizeof(float), overviewSize, file ) == overviewSize &&
+             fseeko( file, header.boundsOffset, SEEK_SET ) == 0 &&
+             fread( bounds, sizeof(float), 2 * nTiles, file ) == (size_t) 2 * nTiles);
+
+  if (!ok) {
+    cerr << "Error reading tiled terrain '" << filename << "'." << endl;
+    delete[] bounds;
+    close();
+    return false;
+  }
+
+  overviewPyramid.build( overview, header.overviewWidth, header.overviewHeight );
+
+  tiles = new TerrainTile[ nTiles ];
+
+  for (int i=0; i<nTiles; i++) {
+    TerrainTile &tile = tiles[i];
+    tile.state = TILE_ABSENT;
+    tile.minZ = bounds[2*i];
+    tile.maxZ = bounds[2*i+1];
+    tile.heights = NULL;
+    tile.pyramid = NULL;
+    tile.lastUsed = -1;
+  }
+
+  delete[] bounds;
+
+  stopping = false;
+  loader = std::thread( &TerrainTiles::loadTiles, this );
+
+  return true;
+}
+
+
+void TerrainTiles::close()
+
+{
+  if (loader.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      stopping = true;
+    }
+    wakeLoader.notify_one();
+    loader.join();
+  }
+
+  for (unsigned int i=0; i<loaded.size(); i++) {
+    alignedFree( loaded[i].heights );
+    delete[] loaded[i].vertices;
+    delete loaded[i].pyramid;
+  }
+
+  loaded.clear();
+  requests.clear();
+
+  if (tiles != NULL) {
+    for (int i=0; i<nTilesX*nTilesY; i++) {
+      alignedFree( tiles[i].heights );
+      delete tiles[i].pyramid;
+    }
+    delete[] tiles;
+    tiles = NULL;
+  }
+
+  lru.clear();
+  residentBytes = 0;
+
+  alignedFree( overview );
+  overview = NULL;
+
+  if (file != NULL) {
+    fclose( file );
+    file = NULL;
+  }
+}
+
+
+// ---------------- Loader thread ----------------
+
+
+// Read the requested tiles, nearest first, and prepare everything
+// that does not need OpenGL: the vertex data (including normals) and
+// the tile's min/max pyramid.
+//
+// Normals at a tile's edges use one-sided differences, since the
+// neighbouring tile may not be loaded.
+
+
+void TerrainTiles::loadTiles()
+
+{
+  const int n = TILE_SIZE + 1;
+
+  vec3 *normals = (vec3 *) alignedAlloc( TILE_VERTS * sizeof(vec3) );
+
+  while (true) {
+
+    int index;
+
+    {
+      std::unique_lock<std::mutex> lock( mutex );
+      wakeLoader.wait( lock, [this] { return stopping || !requests.empty(); } );
+
+      if (stopping) {
+        alignedFree( normals );
+        return;
+      }
+
+      index = requests.front();
+      requests.pop_front();
+    }
+
+    LoadedTile t;
+
+    t.index = index;
+    t.heights = (float *) alignedAlloc( TILE_VERTS * sizeof(float) );
+    t.vertices = NULL;
+    t.pyramid = NULL;
+
+    if (fseeko( file, header.tilesOffset + index * header.tileStride, SEEK_SET ) != 0 ||
+        fread( t.heights, sizeof(float), TILE_VERTS, file ) != TILE_VERTS) {
+
+      cerr << "Error reading terrain tile " << index << "." << endl;
+      alignedFree( t.heights );
+      t.heights = NULL;
+
+    } else {
+
+      computeNormals( t.heights, normals, n, n, 1 );
+
+      t.vertices = new TerrainVertex[ TILE_VERTS ];
+
+      for (int i=0; i<TILE_VERTS; i++)
+        t.vertices[i] = packTerrainVertex( t.heights[i], normals[i] );
+
+      t.pyramid = new MinMaxPyramid();
+      t.pyramid->build( t.heights, n, n );
+    }
+
+    std::lock_guard<std::mutex> lock( mutex );
+    loaded.push_back( t );
+  }
+}
+
+
+// ---------------- OpenGL ----------------
+
+
+// Append the two triangles of each quad of an n x n vertex grid in
+// [i0,i1) x [j0,j1), split as in Terrain::buildLODIndices()
+
+
+static GLushort *gridIndices( GLushort *k, int n, int i0, int j0, int i1, int j1 )
+
+{
+  for (int j=j0; j<j1; j++)
+    for (int i=i0; i<i1; i++) {
+
+      GLushort ll = j*n + i;
+      GLushort lr = ll + 1;
+      GLushort ul = ll + n;
+      GLushort ur = ul + 1;
+
+      *k++ = ll;  *k++ = lr;  *k++ = ul;
+      *k++ = ul;  *k++ = lr;  *k++ = ur;
+    }
+
+  return k;
+}
+
+
+// Build the overview chunks and the index buffers shared by all tiles
+// and by all overview chunks
+
+
+void TerrainTiles::setupVAOs()
+
+{
+  // Tiles
+
+  tileIndexCount = 6 * TILE_SIZE * TILE_SIZE;
+
+  GLushort *indices = new GLushort[ tileIndexCount ];
+  gridIndices( indices, TILE_SIZE+1, 0, 0, TILE_SIZE, TILE_SIZE );
+
+  glGenBuffers( 1, &tileIndexBuffer );
+  glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, tileIndexBuffer );
+  glBufferData( GL_ELEMENT_ARRAY_BUFFER, tileIndexCount * sizeof(GLushort), indices, GL_STATIC_DRAW );
+
+  delete[] indices;
+
+  // Overview normals.  computeNormals() assumes unit spacing, and
+  // overview samples are 'step' texels apart.
+
+  int step = header.overviewStep;
+  int ow = header.overviewWidth;
+  int oh = header.overviewHeight;
+
+  vec3 *normals = (vec3 *) alignedAlloc( ow * oh * sizeof(vec3) );
+
+  computeNormals( overview, normals, ow, oh );
+
+  for (int i=0; i<ow*oh; i++)
+    normals[i] = vec3( normals[i].x, normals[i].y, normals[i].z * step ).normalize();
+
+  // Overview chunks
+
+  const int n = TILE_OVERVIEW_CHUNK + 1;
+  const int quadsPerTile = TILE_SIZE / step;
+
+  tilesPerOverviewChunk = TILE_OVERVIEW_CHUNK / quadsPerTile;
+
+  nOverviewX = (ow - 2) / TILE_OVERVIEW_CHUNK + 1;
+  nOverviewY = (oh - 2) / TILE_OVERVIEW_CHUNK + 1;
+
+  overviewChunks = new OverviewChunk[ nOverviewX * nOverviewY ];
+
+  TerrainVertex *vertices = new TerrainVertex[ n * n ];
+
+  for (int cy=0; cy<nOverviewY; cy++)
+    for (int cx=0; cx<nOverviewX; cx++) {
+
+      OverviewChunk &chunk = overviewChunks[ cy*nOverviewX + cx ];
+
+      TerrainVertex *v = vertices;
+
+      chunk.minZ = MAXFLOAT;
+      chunk.maxZ = -MAXFLOAT;
+
+      for (int j=0; j<n; j++)
+        for (int i=0; i<n; i++) {
+
+          int ox = MIN( cx*TILE_OVERVIEW_CHUNK + i, ow-1 );
+          int oy = MIN( cy*TILE_OVERVIEW_CHUNK + j, oh-1 );
+
+          float h = overview[ oy*ow + ox ];
+
+          *v++ = packTerrainVertex( h, normals[ oy*ow + ox ] );
+
+          chunk.minZ = MIN( chunk.minZ, h );
+          chunk.maxZ = MAX( chunk.maxZ, h );
+        }
+
+      chunk.x0 = cx * TILE_OVERVIEW_CHUNK * step;
+      chunk.y0 = cy * TILE_OVERVIEW_CHUNK * step;
+      chunk.x1 = MIN( chunk.x0 + TILE_OVERVIEW_CHUNK * step, width-1.0 );
+      chunk.y1 = MIN( chunk.y0 + TILE_OVERVIEW_CHUNK * step, height-1.0 );
+
+      chunk.VAO = makeTerrainVAO( vertices, n*n, chunk.VBO );
+    }
+
+  delete[] vertices;
+  alignedFree( normals );
+
+  // Overview indices, tile by tile
+
+  overviewIndicesPerTile = 6 * quadsPerTile * quadsPerTile;
+
+  indices = new GLushort[ 6 * TILE_OVERVIEW_CHUNK * TILE_OVERVIEW_CHUNK ];
+  GLushort *k = indices;
+
+  for (int ty=0; ty<tilesPerOverviewChunk; ty++)
+    for (int tx=0; tx<tilesPerOverviewChunk; tx++)
+      k = gridIndices( k, n, tx*quadsPerTile, ty*quadsPerTile, (tx+1)*quadsPerTile, (ty+1)*quadsPerTile );
+
+  glGenBuffers( 1, &overviewIndexBuffer );
+  glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, overviewIndexBuffer );
+  glBufferData( GL_ELEMENT_ARRAY_BUFFER, (k - indices) * sizeof(GLushort), indices, GL_STATIC_DRAW );
+
+  delete[] indices;
+
+  glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, 0 );
+}
+
+
+// Free the OpenGL objects made by setupVAOs() and by uploading tiles.
+// Called on the OpenGL thread, before close().
+
+
+void TerrainTiles::releaseGL()
+
+{
+  while (!lru.empty())
+    evictTile( lru.back() );
+
+  if (overviewChunks == NULL)
+    return;                     // setupVAOs() was never called
+
+  for (int c=0; c<nOverviewX*nOverviewY; c++) {
+    glDeleteVertexArrays( 1, &overviewChunks[c].VAO );
+    glDeleteBuffers( 1, &overviewChunks[c].VBO );
+  }
+
+  delete[] overviewChunks;
+  overviewChunks = NULL;
+
+  glDeleteBuffers( 1, &tileIndexBuffer );
+  glDeleteBuffers( 1, &overviewIndexBuffer );
+}
+
+
+void TerrainTiles::uploadTile( LoadedTile &t )
+
+{
+  TerrainTile &tile = tiles[ t.index ];
+
+  if (t.heights == NULL)
+    return;                     // unreadable: stays queued, so is drawn from the overview
+
+  tile.VAO = makeTerrainVAO( t.vertices, TILE_VERTS, tile.VBO );
+  delete[] t.vertices;
+
+  tile.heights = t.heights;
+  tile.pyramid = t.pyramid;
+  tile.state = TILE_RESIDENT;
+
+  lru.push_front( t.index );
+  tile.lruPos = lru.begin();
+
+  residentBytes += TILE_RESIDENT_BYTES;
+}
+
+
+void TerrainTiles::evictTile( int index )
+
+{
+  TerrainTile &tile = tiles[ index ];
+
+  glDeleteVertexArrays( 1, &tile.VAO );
+  glDeleteBuffers( 1, &tile.VBO );
+
+  alignedFree( tile.heights );
+  tile.heights = NULL;
+
+  delete tile.pyramid;
+  tile.pyramid = NULL;
+
+  tile.state = TILE_ABSENT;
+
+  lru.erase( tile.lruPos );
+  residentBytes -= TILE_RESIDENT_BYTES;
+}
+
+
+// ---------------- Per frame ----------------
+
+
+void TerrainTiles::update( vec3 eye )
+
+{
+  frame++;
+
+  // Upload the tiles that the loader has finished
+
+  std::vector<LoadedTile> finished;
+
+  {
+    std::lock_guard<std::mutex> lock( mutex );
+    finished.swap( loaded );
+
+    // Withdraw the requests not yet started; those still wanted are
+    // requested again below, in the new order
+
+    for (unsigned int i=0; i<requests.size(); i++)
+      tiles[ requests[i] ].state = TILE_ABSENT;
+
+    requests.clear();
+  }
+
+  for (unsigned int i=0; i<finished.size(); i++)
+    uploadTile( finished[i] );
+
+  // Tiles whose boxes are within TILE_LOAD_RADIUS of the eye
+
+  std::vector< std::pair<float,int> > wanted;
+
+  int tx0 = MAX( 0,         (int) floor( (eye.x - TILE_LOAD_RADIUS) / TILE_SIZE ) );
+  int tx1 = MIN( nTilesX-1, (int) floor( (eye.x + TILE_LOAD_RADIUS) / TILE_SIZE ) );
+  int ty0 = MAX( 0,         (int) floor( (eye.y - TILE_LOAD_RADIUS) / TILE_SIZE ) );
+  int ty1 = MIN( nTilesY-1, (int) floor( (eye.y + TILE_LOAD_RADIUS) / TILE_SIZE ) );
+
+  for (int ty=ty0; ty<=ty1; ty++)
+    for (int tx=tx0; tx<=tx1; tx++) {
+
+      int index = ty*nTilesX + tx;
+      TerrainTile &tile = tiles[index];
+
+      vec3 nearest( MAX( tx*TILE_SIZE, MIN( eye.x, (tx+1)*TILE_SIZE ) ),
+                    MAX( ty*TILE_SIZE, MIN( eye.y, (ty+1)*TILE_SIZE ) ),
+                    MAX( tile.minZ,    MIN( eye.z, tile.maxZ ) ) );
+
+      float dist = (nearest - eye).length();
+
+      if (dist > TILE_LOAD_RADIUS)
+        continue;
+
+      tile.lastUsed = frame;
+
+      if (tile.state == TILE_RESIDENT)
+        lru.splice( lru.begin(), lru, tile.lruPos ); // most recently used
+      else if (tile.state == TILE_ABSENT)
+        wanted.push_back( std::make_pair( dist, index ) );
+    }
+
+  if (!wanted.empty()) {
+
+    std::sort( wanted.begin(), wanted.end() );
+
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      for (unsigned int i=0; i<wanted.size(); i++) {
+        requests.push_back( wanted[i].second );
+        tiles[ wanted[i].second ].state = TILE_QUEUED;
+      }
+    }
+
+    wakeLoader.notify_one();
+  }
+
+  // Evict the least recently used tiles while over budget.  Tiles near
+  // the eye are kept even if they alone exceed the budget.
+
+  while (residentBytes > TILE_MEMORY_BUDGET && !lru.empty() && tiles[ lru.back() ].lastUsed != frame)
+    evictTile( lru.back() );
+}
+
+
+// Draw the resident tiles, and the overview everywhere else
+
+
+void TerrainTiles::draw( GPUProgram &gpu, vec4 planes[6], int &nDrawn, int &nTriangles )
+
+{
+  nDrawn = 0;
+  nTriangles = 0;
+
+  GLint originLoc = glGetUniformLocation( gpu.id(), "gridOrigin" );
+
+  gpu.setInt( "gridWidth", TILE_SIZE+1 );
+  gpu.setFloat( "gridSpacing", 1 );
+
+  for (std::list<int>::iterator it = lru.begin(); it != lru.end(); it++) {
+
+    TerrainTile &tile = tiles[ *it ];
+
+    int tx = *it % nTilesX;
+    int ty = *it / nTilesX;
+
+    vec3 lo( tx*TILE_SIZE, ty*TILE_SIZE, tile.minZ );
+    vec3 hi( MIN( (tx+1)*TILE_SIZE, (int) width-1 ), MIN( (ty+1)*TILE_SIZE, (int) height-1 ), tile.maxZ );
+
+    if (!boxInFrustum( planes, lo, hi ))
+      continue;
+
+    glUniform2f( originLoc, tx*TILE_SIZE, ty*TILE_SIZE );
+    glBindVertexArray( tile.VAO );
+    glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, tileIndexBuffer );
+    glDrawElements( GL_TRIANGLES, tileIndexCount, GL_UNSIGNED_SHORT, 0 );
+
+    nDrawn++;
+    nTriangles += tileIndexCount / 3;
+  }
+
+  // Overview chunks, drawing each run of non-resident tiles (in the
+  // order of the chunk's index buffer) at once
+
+  gpu.setInt( "gridWidth", TILE_OVERVIEW_CHUNK+1 );
+  gpu.setFloat( "gridSpacing", header.overviewStep );
+
+  for (int c=0; c<nOverviewX*nOverviewY; c++) {
+
+    OverviewChunk &chunk = overviewChunks[c];
+
+    if (!boxInFrustum( planes, vec3( chunk.x0, chunk.y0, chunk.minZ ), vec3( chunk.x1, chunk.y1, chunk.maxZ ) ))
+      continue;
+
+    int firstTX = (c % nOverviewX) * tilesPerOverviewChunk;
+    int firstTY = (c / nOverviewX) * tilesPerOverviewChunk;
+
+    int nTiles = tilesPerOverviewChunk * tilesPerOverviewChunk;
+    int runStart = -1;
+    bool bound = false;
+
+    for (int k=0; k<=nTiles; k++) {
+
+      int tx = firstTX + k % tilesPerOverviewChunk;
+      int ty = firstTY + k / tilesPerOverviewChunk;
+
+      bool needed = (k < nTiles && tx < nTilesX && ty < nTilesY &&
+                     tiles[ ty*nTilesX + tx ].state != TILE_RESIDENT);
+
+      if (needed && runStart < 0)
+        runStart = k;
+
+      if (!needed && runStart >= 0) {
+
+        if (!bound) {
+          glUniform2f( originLoc, chunk.x0, chunk.y0 );
+          glBindVertexArray( chunk.VAO );
+          glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, overviewIndexBuffer );
+          bound = true;
+        }
+
+        int count = (k - runStart) * overviewIndicesPerTile;
+
+        glDrawElements( GL_TRIANGLES, count, GL_UNSIGNED_SHORT,
+                        (void *) (runStart * overviewIndicesPerTile * sizeof(GLushort)) );
+
+        nDrawn++;
+        nTriangles += count / 3;
+        runStart = -1;
+      }
+    }
+  }
+
+  glBindVertexArray( 0 );
+}
+
+
+// ---------------- Queries ----------------
+
+
+// Height at texel (x,y): exact if its tile is resident, otherwise
+// interpolated from the overview
+
+
+float TerrainTiles::getHeight( int x, int y )
+
+{
+  x = MAX( 0, MIN( x, (int) width-1 ) );
+  y = MAX( 0, MIN( y, (int) height-1 ) );
+
+  int tx = MIN( x / TILE_SIZE, nTilesX-1 );
+  int ty = MIN( y / TILE_SIZE, nTilesY-1 );
+
+  TerrainTile &tile = tiles[ ty*nTilesX + tx ];
+
+  if (tile.state == TILE_RESIDENT)
+    return tile.heights[ (y - ty*TILE_SIZE) * (TILE_SIZE+1) + (x - tx*TILE_SIZE) ];
+
+  int step = header.overviewStep;
+  int ow = header.overviewWidth;
+
+  int ox = MIN( x / step, ow-2 );
+  int oy = MIN( y / step, (int) header.overviewHeight-2 );
+
+  float u = (x - ox*step) / (float) step;
+  float v = (y - oy*step) / (float) step;
+
+  const float *h = overview + oy*ow + ox;
+
+  return (1-v) * ((1-u) * h[0]  + u * h[1]) +
+            v  * ((1-u) * h[ow] + u * h[ow+1]);
+}
+
+
+// Find the intersection of rayStart + t*rayDir (in the terrain's
+// coordinate system) with the terrain.
+//
+// The tiles under the ray are visited in the order in which the ray
+// crosses them (a 2D DDA over the tile grid), so the first hit is the
+// nearest.  Resident tiles are searched at full resolution and the
+// others in the overview, each with its own min/max pyramid.
+
+
+bool TerrainTiles::findIntPoint( vec3 rayStart, vec3 rayDir, vec3 &intPoint )
+
+{
+  if (tiles == NULL)
+    return false;
+
+  float tNear = 0;
+  float tFar = MAXFLOAT;
+
+  if (!raySlab( rayStart.x, rayDir.x, 0, width-1,  tNear, tFar ) ||
+      !raySlab( rayStart.y, rayDir.y, 0, height-1, tNear, tFar ))
+    return false;
+
+  vec3 p = rayStart + tNear * rayDir;
+
+  int tx = MAX( 0, MIN( (int) (p.x / TILE_SIZE), nTilesX-1 ) );
+  int ty = MAX( 0, MIN( (int) (p.y / TILE_SIZE), nTilesY-1 ) );
+
+  // Ray parameters at which the ray next crosses a tile boundary in
+  // x and in y, and between crossings
+
+  int stepX = (rayDir.x > 0 ? 1 : -1);
+  int stepY = (rayDir.y > 0 ? 1 : -1);
+
+  float tNextX  = MAXFLOAT;
+  float tNextY  = MAXFLOAT;
+  float tDeltaX = MAXFLOAT;
+  float tDeltaY = MAXFLOAT;
+
+  if (fabs(rayDir.x) > 1e-12) {
+    tNextX = ((tx + (stepX > 0)) * TILE_SIZE - rayStart.x) / rayDir.x;
+    tDeltaX = TILE_SIZE / fabs(rayDir.x);
+  }
+
+  if (fabs(rayDir.y) > 1e-12) {
+    tNextY = ((ty + (stepY > 0)) * TILE_SIZE - rayStart.y) / rayDir.y;
+    tDeltaY = TILE_SIZE / fabs(rayDir.y);
+  }
+
+  while (tx >= 0 && tx < nTilesX && ty >= 0 && ty < nTilesY) {
+
+    if (intersectTile( tx, ty, rayStart, rayDir, intPoint ))
+      return true;
+
+    if (MIN( tNextX, tNextY ) > tFar)
+      break;
+
+    if (tNextX < tNextY) {
+      tx += stepX;
+      tNextX += tDeltaX;
+    } else {
+      ty += stepY;
+      tNextY += tDeltaY;
+    }
+  }
+
+  return false;
+}
+
+
+bool TerrainTiles::intersectTile( int tx, int ty, vec3 &rayStart, vec3 &rayDir, vec3 &intPoint )
+
+{
+  TerrainTile &tile = tiles[ ty*nTilesX + tx ];
+
+  float x0 = tx * TILE_SIZE;
+  float y0 = ty * TILE_SIZE;
+  float x1 = MIN( x0 + TILE_SIZE, width-1.0 );
+  float y1 = MIN( y0 + TILE_SIZE, height-1.0 );
+
+  float tNear = 0;
+  float tFar = MAXFLOAT;
+
+  if (!raySlab( rayStart.x, rayDir.x, x0-CELL_EPSILON, x1+CELL_EPSILON, tNear, tFar ) ||
+      !raySlab( rayStart.y, rayDir.y, y0-CELL_EPSILON, y1+CELL_EPSILON, tNear, tFar ) ||
+      !raySlab( rayStart.z, rayDir.z, tile.minZ-CELL_EPSILON, tile.maxZ+CELL_EPSILON, tNear, tFar ))
+    return false;
+
+  if (tile.state == TILE_RESIDENT) {
+
+    // The tile's pyramid is in tile coordinates
+
+    vec3 offset( x0, y0, 0 );
+
+    if (!tile.pyramid->intersect( rayStart - offset, rayDir, intPoint, 0, 0, x1-x0, y1-y0 ))
+      return false;
+
+    intPoint = intPoint + offset;
+    return true;
+  }
+
+  // The overview's pyramid is in overview coordinates, in which
+  // samples are one unit apart.  Scaling the ray's x and y keeps its
+  // parameter t.
+
+  float s = header.overviewStep;
+
+  vec3 start( rayStart.x / s, rayStart.y / s, rayStart.z );
+  vec3 dir( rayDir.x / s, rayDir.y / s, rayDir.z );
+
+  if (!overviewPyramid.intersect( start, dir, intPoint, x0/s, y0/s, x1/s, y1/s ))
+    return false;
+
+  intPoint = vec3( intPoint.x * s, intPoint.y * s, intPoint.z );
+  return true;
+}
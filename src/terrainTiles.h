@@ -0,0 +1,199 @@
+// terrainTiles.h
+//
+// Out-of-core terrain, for heightfields too large to hold in memory.
+//
+// A tiled terrain file (made by 'rollercoaster -tileTerrain') holds
+// the heightfield cut into tiles of TILE_SIZE x TILE_SIZE quads.  Each
+// tile has (TILE_SIZE+1)^2 heights, so neighbouring tiles share their
+// edges, and starts on a page boundary.  The file also holds a coarse
+// overview of the heightfield (every overviewStep'th height in x and
+// y, with at most TILE_OVERVIEW_SIZE samples across) and the height
+// range of each tile.
+//
+// TerrainTiles keeps the overview and the tile ranges in memory, and
+// only the tiles near the eye resident.  update(), called each frame
+// on the OpenGL thread:
+//
+//   - uploads tiles that the background loader has read,
+//   - queues the missing tiles within TILE_LOAD_RADIUS of the eye,
+//     nearest first, for the loader, and
+//   - evicts the least recently used tiles while the resident tiles
+//     take more than TILE_MEMORY_BUDGET.
+//
+// Where a tile is not resident, the terrain is drawn and picked at the
+// resolution of the overview.
+
+
+#ifndef TERRAIN_TILES_H
+#define TERRAIN_TILES_H
+
+#include "headers.h"
+#include "minMaxPyramid.h"
+#include "gpuProgram.h"
+
+#include <stdint.h>
+#include <list>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+
+#define TERRAIN_TILES_SUFFIX  ".tiles"
+#define TILE_MAGIC            "RCTILES"
+#define TILE_VERSION          1
+
+#define TILE_SIZE              128      // quads per tile side (a power of two; 16-bit indices suffice)
+#define TILE_LOAD_RADIUS       1024     // distance from the eye within which tiles are loaded
+#define TILE_MEMORY_BUDGET     (256 << 20) // bytes of resident tiles (CPU and GPU)
+
+#define TILE_OVERVIEW_SIZE     1024     // most overview samples across
+#define TILE_OVERVIEW_MIN_STEP 4        // fewest texels between overview samples
+#define TILE_OVERVIEW_CHUNK    64       // overview quads per overview chunk side
+
+#define TILE_VERTS   ((TILE_SIZE+1) * (TILE_SIZE+1))
+
+#define TILE_RESIDENT_BYTES (TILE_VERTS * (sizeof(float) + 8) + TILE_SIZE*TILE_SIZE * 3 * sizeof(float))
+                                        // heights, packed vertices, and pyramid (about 4/3 of 2 floats per quad)
+
+
+struct TerrainVertex;                   // see terrain.h
+
+
+struct TileFileHeader {
+
+  char     magic[8];
+  uint32_t version;
+  uint32_t tileSize;
+  uint32_t overviewStep;        // texels between overview samples (divides tileSize)
+
+  uint32_t width, height;       // of the heightfield, in texels
+  uint32_t nTilesX, nTilesY;
+  uint32_t overviewWidth, overviewHeight;
+
+  uint64_t tileStride;          // bytes from one tile to the next
+  uint64_t tilesOffset;         // tiles in row-major order
+  uint64_t overviewOffset;      // float[ overviewHeight ][ overviewWidth ]
+  uint64_t boundsOffset;        // float[ nTiles ][2] (min, max)
+};
+
+
+enum TileState { TILE_ABSENT, TILE_QUEUED, TILE_RESIDENT };
+
+
+struct TerrainTile {
+  TileState     state;
+  float         minZ, maxZ;
+  float        *heights;        // (TILE_SIZE+1)^2 when resident
+  MinMaxPyramid *pyramid;       // over 'heights', when resident
+  GLuint        VAO, VBO;
+  int           lastUsed;       // frame in which it was last near the eye
+  std::list<int>::iterator lruPos;
+};
+
+
+// A tile read by the loader thread, ready to upload.  'heights' is
+// NULL if it could not be read.
+
+struct LoadedTile {
+  int            index;
+  float         *heights;
+  TerrainVertex *vertices;      // TILE_VERTS
+  MinMaxPyramid *pyramid;
+};
+
+
+struct OverviewChunk {
+  GLuint VAO, VBO;
+  float  x0, y0, x1, y1;        // extent in texels
+  float  minZ, maxZ;
+};
+
+
+class TerrainTiles {
+
+  TileFileHeader header;
+  FILE          *file;          // read only by the loader thread
+
+  TerrainTile   *tiles;         // tiles[ ty*nTilesX + tx ]
+  int            nTilesX, nTilesY;
+
+  float         *overview;      // overview[ oy*overviewWidth + ox ]
+  MinMaxPyramid  overviewPyramid;
+
+  // The overview mesh is cut into chunks of TILE_OVERVIEW_CHUNK quads.
+  // A chunk's triangles are ordered by tile, so the part of it under
+  // any run of tiles is one range of its index buffer.
+
+  OverviewChunk *overviewChunks;
+  int            nOverviewX, nOverviewY;
+  int            tilesPerOverviewChunk;
+  GLuint         overviewIndexBuffer;
+  int            overviewIndicesPerTile;
+
+  GLuint  tileIndexBuffer;
+  int     tileIndexCount;
+
+  std::list<int> lru;           // resident tiles, most recently used first
+  size_t         residentBytes;
+  int            frame;
+
+  // Loader thread
+
+  std::thread             loader;
+  std::mutex              mutex;
+  std::condition_variable wakeLoader;
+  std::deque<int>         requests; // tile indices, nearest first
+  std::vector<LoadedTile> loaded;
+  bool                    stopping;
+
+  void loadTiles();
+  void uploadTile( LoadedTile &t );
+  void evictTile( int index );
+
+  bool intersectTile( int tx, int ty, vec3 &rayStart, vec3 &rayDir, vec3 &intPoint );
+
+ public:
+
+  unsigned int width, height;
+
+  TerrainTiles() {
+    file = NULL;
+    tiles = NULL;
+    overview = NULL;
+    overviewChunks = NULL;
+    residentBytes = 0;
+    frame = 0;
+    stopping = false;
+  }
+
+  ~TerrainTiles() {
+    close();
+  }
+
+  bool open( const char *filename );
+  void close();                 // does not free OpenGL objects
+
+  void setupVAOs();             // overview meshes and shared index buffers
+  void releaseGL();             // frees every OpenGL object, and evicts the resident tiles
+  void update( vec3 eye );
+  void draw( GPUProgram &gpu, vec4 planes[6], int &nDrawn, int &nTriangles ); // with 'gpu' active
+
+  float getHeight( int x, int y ); // full resolution if resident, else from the overview
+  bool  findIntPoint( vec3 rayStart, vec3 rayDir, vec3 &intPoint );
+
+  int residentTiles() {
+    return lru.size();
+  }
+
+  // Write a tiled terrain file.  readRow(y,row) fills row y of the
+  // heightfield; rows are read in order, one strip of tiles at a time.
+
+  static bool build( const char *filename, int width, int height,
+                     std::function<bool( int y, float *row )> readRow );
+};
+
+
+#endif
@@ -3,6 +3,21 @@
 
 #include "texture.h"
 #include "lodepng.h"
+#include "terrainCache.h"       // for fnvHashFile()
+
+#include <chrono>
+#include <stdlib.h>
+#include <limits.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+#define SAMPLE_UV_LIMIT 65536.0f  // texture coordinates are clamped to +/- this
 
 
 bool Texture::useMipMaps = false;
@@ -14,52 +29,182 @@ bool Texture::useMipMaps = false;
 void Texture::registerWithOpenGL( )
 
 {
-  // Register it with OpenGL
+  // Precomputed mipmaps: upload each level from the mapped container
+
+  if (mips != NULL) {
+
+    textureID = createTexture( mips->header->nLevels );
+
+    for (unsigned int l=0; l<mips->header->nLevels; l++)
+      glTexImage2D( GL_TEXTURE_2D, l, glFormat(), mips->header->levelWidth[l], mips->header->levelHeight[l], 0,
+                    glFormat(), GL_UNSIGNED_BYTE, mips->level(l) );
+
+    delete mips;
+    mips = NULL;
+    return;
+  }
+
+  textureID = createTexture( 1 );
+
+  glTexImage2D( GL_TEXTURE_2D, 0, glFormat(), width, height, 0,
+                glFormat(), GL_UNSIGNED_BYTE, texmap );
+
+  if (options & TEXTURE_MIPMAPS)
+    glGenerateMipmap( GL_TEXTURE_2D );
+
+  // Keep the texels only if the CPU samples them
+
+  if (!(options & TEXTURE_KEEP_TEXELS)) {
+    free( texmap );
+    texmap = NULL;
+  }
+}
+
+
+
+// Create and bind an OpenGL texture with this texture's parameters,
+// for 'nLevels' precomputed levels, or (if nLevels is 1) for one level
+// from which any mipmaps are generated
+
+
+GLuint Texture::createTexture( int nLevels )
+
+{
+  GLuint id;
 
-  glGenTextures( 1, &textureID );
-  glBindTexture( GL_TEXTURE_2D, textureID );
+  glGenTextures( 1, &id );
+  glBindTexture( GL_TEXTURE_2D, id );
 
   glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
   glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT );
 
+  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, (options & TEXTURE_MIPMAPS) ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR );
+
+  if (nLevels > 1)
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, nLevels-1 );
+
   glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
 
-  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
-  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
+  return id;
+}
+
+
+// Grey images are uploaded as luminance, so that they sample as
+// (g,g,g) like they did when they were expanded to RGBA
 
-  glTexImage2D( GL_TEXTURE_2D, 0, (hasAlpha ? GL_RGBA : GL_RGB), width, height, 0,
-                (hasAlpha ? GL_RGBA : GL_RGB), GL_UNSIGNED_BYTE, texmap );
 
-  glGenerateMipmap( GL_TEXTURE_2D );
+GLenum Texture::glFormat()
+
+{
+  static const GLenum format[] = { 0, GL_LUMINANCE, GL_LUMINANCE_ALPHA, GL_RGB, GL_RGBA };
+
+  return format[channels];
 }
 
 
 
+// Decode the image, directly into texmap, with as many 8-bit channels
+// as the file has: grey, grey+alpha, RGB or RGBA.  (A palette or a
+// transparent colour key becomes RGB or RGBA.)
+
+
 void Texture::loadTexture( string filename )
 
 {
-  // Read image
-  
-  std::vector<unsigned char> image;
+  unsigned char *file = NULL;
+  size_t fileSize = 0;
+
+  texmap = NULL;
+
+  if ((options & TEXTURE_MIPMAPS) && loadMips( filename ))
+    return;
+
+  LodePNGState state;
+  lodepng_state_init( &state );
+
+  unsigned error = lodepng_load_file( &file, &fileSize, filename.c_str() );
 
-  unsigned error = lodepng::decode( image, width, height, filename.c_str() );
+  if (!error)
+    error = lodepng_inspect( &width, &height, &state, file, fileSize );
 
-  if (error)
+  if (!error) {
+
+    bool grey  = lodepng_is_greyscale_type( &state.info_png.color );
+    hasAlpha   = lodepng_can_have_alpha( &state.info_png.color );
+    channels   = (grey ? 1 : 3) + (hasAlpha ? 1 : 0);
+
+    state.info_raw.colortype = (grey ? (hasAlpha ? LCT_GREY_ALPHA : LCT_GREY) : (hasAlpha ? LCT_RGBA : LCT_RGB));
+    state.info_raw.bitdepth  = 8;
+
+    error = lodepng_decode( &texmap, &width, &height, &state, file, fileSize );
+  }
+
+  if (error) {
     std::cerr << "Error loading '" << filename << "': " << lodepng_error_text(error) << std::endl;
+    free( texmap );
+    texmap = NULL;
+    width = height = 0;
+  }
+
+  lodepng_state_cleanup( &state );
+  free( file );
+}
+
+
+
+
 
-  // Copy image to our own texmap
-  
-  texmap = new GLubyte[ width * height * 4 ];
+// Map the image's mipmap container, if it is current.  If the image
+// itself is missing, the container is used regardless.
 
-  GLubyte *p = texmap;
-  for (unsigned int i=0; i<width*height*4; i++)
-    *p++ = image[i];
 
-  hasAlpha = true;
+bool Texture::loadMips( string filename )
+
+{
+  mips = new TextureMips();
+
+  if (!mips->open( (filename + TEXTURE_MIPS_SUFFIX).c_str(), filename.c_str() )) {
+    delete mips;
+    mips = NULL;
+    return false;
+  }
+
+  width    = mips->header->levelWidth[0];
+  height   = mips->header->levelHeight[0];
+  channels = mips->header->channels;
+  hasAlpha = (channels == 2 || channels == 4);
+
+  if (options & TEXTURE_KEEP_TEXELS) {
+    size_t n = (size_t) width * height * channels;
+    texmap = (GLubyte *) malloc( n );
+    memcpy( texmap, mips->level(0), n );
+  }
+
+  return true;
 }
 
 
+bool Texture::writeMips( string filename )
+
+{
+  uint64_t key = FNV_OFFSET;
+
+  Texture t;
+  t.options = 0;                // decode the image itself
 
+  if (!fnvHashFile( filename.c_str(), key )) {
+    cerr << "Could not open file '" << filename << "'." << endl;
+    return false;
+  }
+
+  t.loadTexture( filename );
+
+  if (t.texmap == NULL)
+    return false;
+
+  return TextureMips::write( (filename + TEXTURE_MIPS_SUFFIX).c_str(), t.texmap, t.width, t.height, t.channels, key );
+}
 
 
 // Find the texel at x,y for x,y in [0,width-1]x[0,height-1]
@@ -67,6 +212,11 @@ void Texture::loadTexture( string filename )
 vec3 Texture::texel( int x, int y, float &alpha )
 
 {
+  if (texmap == NULL) {         // not loaded with TEXTURE_KEEP_TEXELS
+    alpha = 1;
+    return vec3(0,0,0);
+  }
+
   if (x<0) x = 0;
   if (x>(int)width-1) x = width-1;
   if (y<0) y = 0;
@@ -75,11 +225,15 @@ vec3 Texture::texel( int x, int y, float &alpha )
   unsigned char *p;
   vec3 colour;
 
-  p = texmap + (hasAlpha ? 4 : 3) * (y*width + x);
+  p = texmap + channels * (y*width + x);
 
-  colour.x = (*p++)/255.0f;
-  colour.y = (*p++)/255.0f;
-  colour.z = (*p++)/255.0f;
+  if (channels >= 3) {
+    colour.x = (*p++)/255.0f;
+    colour.y = (*p++)/255.0f;
+    colour.z = (*p++)/255.0f;
+  } else {
+    colour.x = colour.y = colour.z = (*p++)/255.0f; // grey
+  }
 
   if (hasAlpha)
     alpha = (*p++)/255.0f;
@@ -88,3 +242,582 @@ vec3 Texture::texel( int x, int y, float &alpha )
 
   return colour;
 }
+
+
+
+// ---------------- Batched sampling ----------------
+
+
+// The SSE2 loops and the scalar loops do exactly the same arithmetic,
+// so a sample does not depend on where it falls in the batch.
+//
+// A coordinate is wrapped to [0,1] by subtracting its floor.  It is
+// clamped to +/- SAMPLE_UV_LIMIT first, which keeps the conversions to
+// int in range and turns a NaN into a number.  The floor is the
+// truncation, less one if that is above the coordinate.
+
+
+static inline float wrapUV( float u )
+
+{
+  u = MIN( MAX( u, -SAMPLE_UV_LIMIT ), SAMPLE_UV_LIMIT );
+
+  float t = (float) (int) u;
+  if (t > u)
+    t -= 1;
+
+  return u - t;
+}
+
+
+// A texel's channels in one 32-bit value, the first channel in the
+// lowest byte.  Three channels are loaded as four bytes (one load
+// rather than two or three), except for the last texel, whose fourth
+// byte is past the end of the texels.
+
+template<int channels>
+static inline uint32_t texelBits( const GLubyte *p, const GLubyte *last )
+
+{
+  if (channels == 3 && p < last) {
+    uint32_t bits;
+    memcpy( &bits, p, 4 );
+    return bits & 0xffffff;     // little-endian
+  }
+
+  uint32_t bits = p[0];
+
+  if (channels > 1) bits |= p[1] << 8;
+  if (channels > 2) bits |= p[2] << 16;
+  if (channels > 3) bits |= (uint32_t) p[3] << 24;
+
+  return bits;
+}
+
+
+#ifdef __SSE2__
+
+static inline __m128 wrapUV4( __m128 u )
+
+{
+  u = _mm_min_ps( _mm_max_ps( u, _mm_set1_ps( -SAMPLE_UV_LIMIT ) ), _mm_set1_ps( SAMPLE_UV_LIMIT ) );
+
+  __m128 t = _mm_cvtepi32_ps( _mm_cvttps_epi32( u ) );
+  t = _mm_sub_ps( t, _mm_and_ps( _mm_cmpgt_ps( t, u ), _mm_set1_ps( 1 ) ) );
+
+  return _mm_sub_ps( u, t );
+}
+
+
+// Channel c of four texels, as floats in [0,255]
+
+static inline __m128 channel4( __m128i bits, int c )
+
+{
+  return _mm_cvtepi32_ps( _mm_and_si128( _mm_srli_epi32( bits, 8*c ), _mm_set1_epi32( 255 ) ) );
+}
+
+#endif
+
+
+// Nearest texels to uv[i0,i1).  The texel is floor(u*width), with u
+// in [0,1] after wrapping, and is clamped to width-1 for u = 1.
+
+
+template<int channels>
+static void nearestRange( const GLubyte *texmap, int width, int height,
+                          const vec2 *uv, float *out[], size_t i0, size_t i1 )
+
+{
+  const float w     = width;
+  const float h     = height;
+  const float xMax  = width-1;
+  const float yMax  = height-1;
+  const float scale = 1/255.0f;
+
+  size_t i = i0;
+
+#ifdef __SSE2__
+
+  const GLubyte *last = texmap + ((size_t) width * height - 1) * channels;
+
+  for ( ; i+4 <= i1; i+=4) {
+
+    // Split four (u,v) pairs into a u register and a v register
+
+    __m128 a = _mm_loadu_ps( &uv[i  ].x );
+    __m128 b = _mm_loadu_ps( &uv[i+2].x );
+
+    __m128 u = wrapUV4( _mm_shuffle_ps( a, b, _MM_SHUFFLE( 2, 0, 2, 0 ) ) );
+    __m128 v = wrapUV4( _mm_shuffle_ps( a, b, _MM_SHUFFLE( 3, 1, 3, 1 ) ) );
+
+    alignas(16) int32_t  xi[4], yi[4];
+    alignas(16) uint32_t t[4];
+
+    _mm_store_si128( (__m128i *) xi, _mm_cvttps_epi32( _mm_min_ps( _mm_mul_ps( u, _mm_set1_ps( w ) ), _mm_set1_ps( xMax ) ) ) );
+    _mm_store_si128( (__m128i *) yi, _mm_cvttps_epi32( _mm_min_ps( _mm_mul_ps( v, _mm_set1_ps( h ) ), _mm_set1_ps( yMax ) ) ) );
+
+    // Load the texels one by one (SSE2 has no gather), then convert
+    // each channel of all four at once
+
+    for (int k=0; k<4; k++)
+      t[k] = texelBits<channels>( texmap + channels * ((size_t) yi[k] * width + xi[k]), last );
+
+    __m128i bits = _mm_load_si128( (__m128i *) t );
+
+    for (int c=0; c<channels; c++)
+      _mm_storeu_ps( out[c]+i, _mm_mul_ps( channel4( bits, c ), _mm_set1_ps( scale ) ) );
+  }
+
+#endif
+
+  // Remaining samples
+
+  for ( ; i<i1; i++) {
+
+    int x = (int) MIN( wrapUV( uv[i].x ) * w, xMax );
+    int y = (int) MIN( wrapUV( uv[i].y ) * h, yMax );
+
+    const GLubyte *p = texmap + channels * ((size_t) y * width + x);
+
+    for (int c=0; c<channels; c++)
+      out[c][i] = p[c] * scale;
+  }
+}
+
+
+// Bilinearly interpolated texels at uv[i0,i1).  With u in [0,1] after
+// wrapping, x = u*width - 0.5 is in [-0.5,width-0.5], so its left texel
+// is in [-1,width-1] and its right texel in [0,width]; -1 and width
+// wrap to the other side, as with GL_REPEAT.  The channels are
+// interpolated as bytes and scaled to [0,1] at the end.
+
+
+template<int channels>
+static void bilinearRange( const GLubyte *texmap, int width, int height,
+                           const vec2 *uv, float *out[], size_t i0, size_t i1 )
+
+{
+  const float w     = width;
+  const float h     = height;
+  const float scale = 1/255.0f;
+
+  const size_t rowBytes = (size_t) width * channels;
+
+  size_t i = i0;
+
+#ifdef __SSE2__
+
+  const GLubyte *last = texmap + ((size_t) width * height - 1) * channels;
+
+  const __m128i zero    = _mm_setzero_si128();
+  const __m128i widthV  = _mm_set1_epi32( width );
+  const __m128i heightV = _mm_set1_epi32( height );
+
+  for ( ; i+4 <= i1; i+=4) {
+
+    __m128 a = _mm_loadu_ps( &uv[i  ].x );
+    __m128 b = _mm_loadu_ps( &uv[i+2].x );
+
+    __m128 u = wrapUV4( _mm_shuffle_ps( a, b, _MM_SHUFFLE( 2, 0, 2, 0 ) ) );
+    __m128 v = wrapUV4( _mm_shuffle_ps( a, b, _MM_SHUFFLE( 3, 1, 3, 1 ) ) );
+
+    __m128 x = _mm_sub_ps( _mm_mul_ps( u, _mm_set1_ps( w ) ), _mm_set1_ps( 0.5f ) );
+    __m128 y = _mm_sub_ps( _mm_mul_ps( v, _mm_set1_ps( h ) ), _mm_set1_ps( 0.5f ) );
+
+    // Floor of x and y, which are at least -0.5
+
+    __m128i x0 = _mm_cvttps_epi32( x );
+    __m128i y0 = _mm_cvttps_epi32( y );
+
+    x0 = _mm_add_epi32( x0, _mm_castps_si128( _mm_cmpgt_ps( _mm_cvtepi32_ps( x0 ), x ) ) ); // adds -1
+    y0 = _mm_add_epi32( y0, _mm_castps_si128( _mm_cmpgt_ps( _mm_cvtepi32_ps( y0 ), y ) ) );
+
+    __m128 fx = _mm_sub_ps( x, _mm_cvtepi32_ps( x0 ) );
+    __m128 fy = _mm_sub_ps( y, _mm_cvtepi32_ps( y0 ) );
+
+    // Wrap the texels
+
+    __m128i x1 = _mm_add_epi32( x0, _mm_set1_epi32( 1 ) );
+    __m128i y1 = _mm_add_epi32( y0, _mm_set1_epi32( 1 ) );
+
+    x0 = _mm_add_epi32( x0, _mm_and_si128( _mm_cmplt_epi32( x0, zero ), widthV ) );
+    y0 = _mm_add_epi32( y0, _mm_and_si128( _mm_cmplt_epi32( y0, zero ), heightV ) );
+    x1 = _mm_sub_epi32( x1, _mm_andnot_si128( _mm_cmplt_epi32( x1, widthV ), widthV ) );
+    y1 = _mm_sub_epi32( y1, _mm_andnot_si128( _mm_cmplt_epi32( y1, heightV ), heightV ) );
+
+    alignas(16) int32_t  xi0[4], xi1[4], yi0[4], yi1[4];
+    alignas(16) uint32_t t00[4], t10[4], t01[4], t11[4];
+
+    _mm_store_si128( (__m128i *) xi0, x0 );
+    _mm_store_si128( (__m128i *) xi1, x1 );
+    _mm_store_si128( (__m128i *) yi0, y0 );
+    _mm_store_si128( (__m128i *) yi1, y1 );
+
+    for (int k=0; k<4; k++) {
+      const GLubyte *row0 = texmap + yi0[k] * rowBytes;
+      const GLubyte *row1 = texmap + yi1[k] * rowBytes;
+      t00[k] = texelBits<channels>( row0 + xi0[k] * channels, last );
+      t10[k] = texelBits<channels>( row0 + xi1[k] * channels, last );
+      t01[k] = texelBits<channels>( row1 + xi0[k] * channels, last );
+      t11[k] = texelBits<channels>( row1 + xi1[k] * channels, last );
+    }
+
+    __m128i b00 = _mm_load_si128( (__m128i *) t00 );
+    __m128i b10 = _mm_load_si128( (__m128i *) t10 );
+    __m128i b01 = _mm_load_si128( (__m128i *) t01 );
+    __m128i b11 = _mm_load_si128( (__m128i *) t11 );
+
+    for (int c=0; c<channels; c++) {
+
+      __m128 c00 = channel4( b00, c );
+      __m128 c01 = channel4( b01, c );
+
+      __m128 lower = _mm_add_ps( c00, _mm_mul_ps( fx, _mm_sub_ps( channel4( b10, c ), c00 ) ) );
+      __m128 upper = _mm_add_ps( c01, _mm_mul_ps( fx, _mm_sub_ps( channel4( b11, c ), c01 ) ) );
+
+      _mm_storeu_ps( out[c]+i, _mm_mul_ps( _mm_add_ps( lower, _mm_mul_ps( fy, _mm_sub_ps( upper, lower ) ) ), _mm_set1_ps( scale ) ) );
+    }
+  }
+
+#endif
+
+  // Remaining samples
+
+  for ( ; i<i1; i++) {
+
+    float x = wrapUV( uv[i].x ) * w - 0.5f;
+    float y = wrapUV( uv[i].y ) * h - 0.5f;
+
+    int x0 = (int) x;
+    int y0 = (int) y;
+
+    if (x0 > x) x0--;
+    if (y0 > y) y0--;
+
+    float fx = x - x0;
+    float fy = y - y0;
+
+    int x1 = x0+1;
+    int y1 = y0+1;
+
+    if (x0 < 0) x0 += width;
+    if (y0 < 0) y0 += height;
+    if (x1 >= width)  x1 -= width;
+    if (y1 >= height) y1 -= height;
+
+    const GLubyte *row0 = texmap + y0 * rowBytes;
+    const GLubyte *row1 = texmap + y1 * rowBytes;
+
+    for (int c=0; c<channels; c++) {
+
+      float c00 = row0[ x0*channels + c ];
+      float c01 = row1[ x0*channels + c ];
+
+      float lower = c00 + fx * (row0[ x1*channels + c ] - c00);
+      float upper = c01 + fx * (row1[ x1*channels + c ] - c01);
+
+      out[c][i] = (lower + fy * (upper - lower)) * scale;
+    }
+  }
+}
+
+
+typedef void (*SampleRange)( const GLubyte *texmap, int width, int height,
+                             const vec2 *uv, float *out[], size_t i0, size_t i1 );
+
+
+// Sample with one range of samples per thread.  Ranges are multiples
+// of four samples, so only the last one has a scalar tail.
+
+
+static void sampleRanges( SampleRange range, const GLubyte *texmap, int width, int height,
+                          const vec2 *uv, float *out[], size_t n, int nThreads )
+
+{
+  if (nThreads <= 0)
+    nThreads = std::thread::hardware_concurrency();
+
+  if ((size_t) nThreads > n / TEXTURE_SAMPLE_MIN_POINTS_PER_THREAD)
+    nThreads = n / TEXTURE_SAMPLE_MIN_POINTS_PER_THREAD;
+
+  if (nThreads <= 1) {
+    range( texmap, width, height, uv, out, 0, n );
+    return;
+  }
+
+  std::vector<std::thread> workers;
+
+  for (int t=0; t<nThreads; t++) {
+    size_t i0 = (t == 0          ? 0 : (n *  t    / nThreads) & ~(size_t) 3);
+    size_t i1 = (t == nThreads-1 ? n : (n * (t+1) / nThreads) & ~(size_t) 3);
+    workers.push_back( std::thread( range, texmap, width, height, uv, out, i0, i1 ) );
+  }
+
+  for (auto &w : workers)
+    w.join();
+}
+
+
+// Without the texels, black and opaque, as from texel()
+
+static void sampleMissing( int channels, bool hasAlpha, float *out[], size_t n )
+
+{
+  for (int c=0; c<channels; c++)
+    for (size_t i=0; i<n; i++)
+      out[c][i] = (hasAlpha && c == channels-1 ? 1 : 0);
+}
+
+
+void Texture::sampleNearest( const vec2 *uv, size_t n, float *out[], int nThreads )
+
+{
+  static const SampleRange ranges[] = { NULL, nearestRange<1>, nearestRange<2>, nearestRange<3>, nearestRange<4> };
+
+  if (texmap == NULL)
+    sampleMissing( channels, hasAlpha, out, n );
+  else
+    sampleRanges( ranges[channels], texmap, width, height, uv, out, n, nThreads );
+}
+
+
+void Texture::sampleBilinear( const vec2 *uv, size_t n, float *out[], int nThreads )
+
+{
+  static const SampleRange ranges[] = { NULL, bilinearRange<1>, bilinearRange<2>, bilinearRange<3>, bilinearRange<4> };
+
+  if (texmap == NULL)
+    sampleMissing( channels, hasAlpha, out, n );
+  else
+    sampleRanges( ranges[channels], texmap, width, height, uv, out, n, nThreads );
+}
+
+
+
+std::map<string,TextureCache::Entry> TextureCache::entries;
+
+
+// The key is the canonical path (so that "data/a.png" and
+// "data/../data/a.png" match), followed by the options
+
+
+string TextureCache::key( string path, unsigned int options )
+
+{
+#ifdef _WIN32
+  char resolved[_MAX_PATH];
+
+  if (_fullpath( resolved, path.c_str(), _MAX_PATH ) != NULL)
+    path = resolved;
+#else
+  char resolved[PATH_MAX];
+
+  if (realpath( path.c_str(), resolved ) != NULL)
+    path = resolved;
+#endif
+
+  return path + "#" + std::to_string( options );
+}
+
+
+Texture *TextureCache::find( string path, unsigned int options, string &k )
+
+{
+  k = key( path, options );
+
+  auto e = entries.find( k );
+
+  if (e == entries.end())
+    return NULL;
+
+  e->second.refs++;
+  return e->second.texture;
+}
+
+
+void TextureCache::add( Texture *t, string k )
+
+{
+  t->cacheKey = k;
+  entries[k] = { t, 1 };
+}
+
+
+Texture *TextureCache::acquire( string basePath, string filename, unsigned int options )
+
+{
+  string k;
+  Texture *t = find( basePath + string("/") + filename, options, k );
+
+  if (t == NULL) {
+    t = new Texture( basePath, filename, options );
+    add( t, k );
+  }
+
+  return t;
+}
+
+
+void TextureCache::release( Texture *t )
+
+{
+  if (t == NULL)
+    return;
+
+  auto e = entries.find( t->cacheKey );
+
+  if (e == entries.end() || e->second.texture != t) { // not cached
+    delete t;
+    return;
+  }
+
+  if (--e->second.refs == 0) {
+    entries.erase( e );
+    delete t;
+  }
+}
+
+
+
+TextureLoader::TextureLoader( int nThreads )
+
+{
+  maxWorkers = (nThreads > 0 ? nThreads : std::thread::hardware_concurrency());
+  if (maxWorkers < 1)
+    maxWorkers = 1;
+
+  nPending = 0;
+  stopping = false;
+
+  nDecoded = 0;
+  decodeSum = decodeMax = 0;
+}
+
+
+// Queue a job, starting another worker if there are fewer workers than
+// jobs
+
+
+void TextureLoader::queue( std::function<void()> job )
+
+{
+  std::lock_guard<std::mutex> lock( mutex );
+
+  jobs.push_back( job );
+  nPending++;
+
+  if ((int) workers.size() < maxWorkers && (int) workers.size() < nPending)
+    workers.push_back( std::thread( &TextureLoader::work, this ) );
+
+  changed.notify_all();
+}
+
+
+void TextureLoader::work()
+
+{
+  while (true) {
+
+    std::function<void()> job;
+
+    {
+      std::unique_lock<std::mutex> lock( mutex );
+      changed.wait( lock, [this] { return stopping || !jobs.empty(); } );
+      if (jobs.empty())
+        return;
+      job = jobs.front();
+      jobs.pop_front();
+    }
+
+    job();
+  }
+}
+
+
+Texture *TextureLoader::load( string basePath, string filename, unsigned int options )
+
+{
+  string path = basePath + string("/") + filename;
+
+  // Already resident (or queued on this loader)?
+
+  string key;
+  Texture *t = TextureCache::find( path, options, key );
+
+  if (t != NULL)
+    return t;
+
+  t = new Texture();
+  t->name = filename;
+  t->options = options;
+
+  TextureCache::add( t, key );
+
+  queue( [this, t, path]() {
+
+    auto start = std::chrono::steady_clock::now();
+    t->loadTexture( path );
+    double secs = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+
+    std::lock_guard<std::mutex> lock( mutex );
+    decoded.push_back( t );
+    nPending--;
+    nDecoded++;
+    decodeSum += secs;
+    if (secs > decodeMax)
+      decodeMax = secs;
+    changed.notify_all();
+  } );
+
+  return t;
+}
+
+
+void TextureLoader::run( std::function<void()> job )
+
+{
+  queue( [this, job]() {
+
+    job();
+
+    std::lock_guard<std::mutex> lock( mutex );
+    nPending--;
+    changed.notify_all();
+  } );
+}
+
+
+// Upload textures as they are decoded until all jobs are done, then
+// stop the workers
+
+
+void TextureLoader::finish()
+
+{
+  std::unique_lock<std::mutex> lock( mutex );
+
+  while (nPending > 0 || !decoded.empty())
+
+    if (decoded.empty())
+      changed.wait( lock );
+
+    else {
+      Texture *t = decoded.front();
+      decoded.pop_front();
+
+      lock.unlock();
+      t->registerWithOpenGL();
+      lock.lock();
+    }
+
+  stopping = true;
+  changed.notify_all();
+  lock.unlock();
+
+  for (auto &w : workers)
+    w.join();
+
+  workers.clear();
+  stopping = false;
+}
@@ -6,13 +6,44 @@
 #define TEXTURE_H
 
 #include "headers.h"
+#include "textureMips.h"
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <map>
+
+
+// Load options (bits)
+
+#define TEXTURE_MIPMAPS         0x1     // build mipmaps, or load them (see textureMips.h), else linear filtering
+#define TEXTURE_KEEP_TEXELS     0x2     // keep the texels after upload, for texel()
+
+#define TEXTURE_DEFAULT_OPTIONS TEXTURE_MIPMAPS
+
+#define TEXTURE_SAMPLE_MIN_POINTS_PER_THREAD 16384  // don't start a thread for fewer samples than this
+
 
 class Texture {
 
-  GLubyte *texmap; 
+  GLubyte *texmap;              // native channels; NULL after upload unless TEXTURE_KEEP_TEXELS
 
-  void registerWithOpenGL();
-  void loadTexture( string filename );
+  TextureMips *mips;            // mapped mipmaps, until uploaded
+
+  void   registerWithOpenGL();
+  GLuint createTexture( int nLevels );
+  GLenum glFormat();
+  void   loadTexture( string filename );
+  bool   loadMips( string filename );
+
+  string cacheKey;              // in TextureCache, or empty if not cached
+
+  friend class TextureLoader;
+  friend class TextureUploader;
+  friend class TextureCache;
 
  public:
 
@@ -20,28 +51,143 @@ class Texture {
   GLuint textureID;
   unsigned int width, height;
   bool hasAlpha;
+  int  channels;                // 1 (grey), 2 (grey, alpha), 3 (RGB) or 4 (RGBA)
+
+  unsigned int options;
 
   static bool useMipMaps;
 
-  Texture() {}
+  Texture() {
+    texmap = NULL;
+    mips = NULL;
+    textureID = 0;
+    width = height = 0;
+    channels = 4;
+    hasAlpha = true;
+    options = TEXTURE_DEFAULT_OPTIONS;
+  }
 
-  Texture( string basePath, string filename ) {
+  Texture( string basePath, string filename, unsigned int opts = TEXTURE_DEFAULT_OPTIONS ) {
     name = filename;
+    options = opts;
+    texmap = NULL;
+    mips = NULL;
+    textureID = 0;
+    channels = 4;
+    hasAlpha = true;
     loadTexture( basePath + string("/") + filename );
-    registerWithOpenGL();
+    if (texmap != NULL || mips != NULL) // else left with a textureID of 0
+      registerWithOpenGL();
   }
 
-  void activate( int textureUnit ) {
+  ~Texture() {
+    free( texmap );
+    delete mips;
+    if (textureID != 0)
+      glDeleteTextures( 1, &textureID );
+  }
+
+  void activate( int textureUnit ) { // binds only; blending is left to the caller
     glActiveTexture( GL_TEXTURE0 + textureUnit );
     glBindTexture( GL_TEXTURE_2D, textureID );
-    if (hasAlpha) {
-      glEnable(GL_BLEND);
-      glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    } else
-      glDisable(GL_BLEND);
   }
 
-  vec3 texel( int i, int j, float &alpha );
+  vec3 texel( int i, int j, float &alpha ); // needs TEXTURE_KEEP_TEXELS
+
+  // Samples at uv[0..n-1], like the OpenGL texture's level 0 samples
+  // them (v = 0 at the first row of the image, wrapping with GL_REPEAT,
+  // and for bilinear, texel centres at (i+0.5)/width).  out[c][i] is
+  // channel c of sample i, in [0,1], for each of the texture's
+  // 'channels' channels.  Samples are done four at a time with SSE2
+  // (where available), and large batches are split across threads
+  // (nThreads = 0 uses all cores).  Needs TEXTURE_KEEP_TEXELS; without
+  // the texels, like texel(), this returns black, opaque samples.
+
+  void sampleNearest(  const vec2 *uv, size_t n, float *out[], int nThreads = 0 );
+  void sampleBilinear( const vec2 *uv, size_t n, float *out[], int nThreads = 0 );
+
+  // Write the mipmap container for an image (see textureMips.h)
+
+  static bool writeMips( string filename );
+};
+
+
+// Textures shared by reference count, keyed by the resolved path of
+// the image and the load options, so that terrains (and reloads of a
+// scene) that use the same image share one Texture.  A texture is
+// freed when its last reference is released.  Used only on the OpenGL
+// thread.
+
+
+class TextureCache {
+
+  struct Entry {
+    Texture *texture;
+    int      refs;
+  };
+
+  static std::map<string,Entry> entries;
+
+  static string key( string path, unsigned int options );
+
+ public:
+
+  // The cached texture for this image and options (with one more
+  // reference), or NULL if there is none.  'key' is set for add().
+
+  static Texture *find( string path, unsigned int options, string &key );
+
+  static void add( Texture *t, string key ); // with one reference
+
+  static Texture *acquire( string basePath, string filename, unsigned int options = TEXTURE_DEFAULT_OPTIONS ); // find or load
+  static void     release( Texture *t );
+
+  static int resident() {
+    return entries.size();
+  }
+};
+
+
+// Decodes textures on a pool of worker threads, and uploads each one
+// to OpenGL as soon as it is decoded, on the thread that calls
+// finish() (which must be the OpenGL thread).  Other CPU-only work,
+// like reading a heightfield, can share the pool through run().
+//
+//    TextureLoader loader;
+//    Texture *a = loader.load( path, "a.png" );
+//    Texture *b = loader.load( path, "b.png" );
+//    loader.finish();                  // a and b are now uploaded
+
+
+class TextureLoader {
+
+  std::mutex                        mutex;
+  std::condition_variable           changed;  // a job was queued or finished
+  std::deque<std::function<void()>> jobs;
+  std::deque<Texture *>             decoded;  // waiting to be uploaded
+  std::vector<std::thread>          workers;
+  int                               maxWorkers;
+  int                               nPending; // jobs queued or running
+  bool                              stopping;
+
+  void queue( std::function<void()> job );
+  void work();
+
+ public:
+
+  int    nDecoded;
+  double decodeSum, decodeMax;  // seconds of decoding: total and longest image
+
+  TextureLoader( int nThreads = 0 ); // 0 = all cores
+
+  ~TextureLoader() {
+    finish();
+  }
+
+  Texture *load( string basePath, string filename, unsigned int options = TEXTURE_DEFAULT_OPTIONS ); // cached; usable after finish()
+  void     run( std::function<void()> job );
+
+  void finish();
 };
 
 
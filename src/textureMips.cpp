@@ -0,0 +1,167 @@
+// textureMips.cpp
+
+
+#include "textureMips.h"
+#include "terrainCache.h"       // for mapFile()
+
+
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+
+bool TextureMips::open( const char *filename, const char *imageFilename )
+
+{
+  close();
+
+  mapping = mapFile( filename, mappingSize, false, sizeof(TextureMipsHeader) );
+
+  if (mapping == NULL) {
+    mappingSize = 0;
+    return false;               // no container
+  }
+
+  header = (TextureMipsHeader *) mapping;
+
+  bool ok = (strncmp( header->magic, TEXTURE_MIPS_MAGIC, sizeof(header->magic) ) == 0 &&
+             header->version == TEXTURE_MIPS_VERSION &&
+             header->fileSize == mappingSize &&
+             header->nLevels >= 1 && header->nLevels <= TEXTURE_MIPS_MAX_LEVELS &&
+             header->channels >= 1 && header->channels <= 4);
+
+  for (unsigned int l=0; ok && l<header->nLevels; l++)
+    ok = (header->levelOffset[l] + (uint64_t) header->levelWidth[l] * header->levelHeight[l] * header->channels <= mappingSize);
+
+  uint64_t key = FNV_OFFSET;
+
+  if (ok && fnvHashFile( imageFilename, key ))
+    ok = (header->key == key);
+
+  if (!ok) {
+    cerr << "Texture mipmaps '" << filename << "' are stale; using the image instead." << endl;
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+
+void TextureMips::close()
+
+{
+  unmapFile( mapping, mappingSize );
+
+  mapping = NULL;
+  mappingSize = 0;
+  header = NULL;
+}
+
+
+// Level l+1 from level l: the average of each 2x2 block (rounded)
+
+
+static void halve( const unsigned char *src, int srcWidth, int srcHeight, unsigned char *dst, int width, int height, int channels )
+
+{
+  for (int y=0; y<height; y++) {
+
+    const unsigned char *row0 = src + (size_t) (2*y) * srcWidth * channels;
+    const unsigned char *row1 = (2*y+1 < srcHeight ? row0 + srcWidth * channels : row0);
+    unsigned char *out = dst + (size_t) y * width * channels;
+
+    for (int x=0; x<width; x++)
+      for (int c=0; c<channels; c++) {
+        int x0 = 2*x * channels + c;
+        int x1 = (2*x+1 < srcWidth ? x0 + channels : x0);
+        *out++ = (row0[x0] + row0[x1] + row1[x0] + row1[x1] + 2) >> 2;
+      }
+  }
+}
+
+
+bool TextureMips::write( const char *filename, const unsigned char *texels, int width, int height, int channels, uint64_t key )
+
+{
+  TextureMipsHeader h;
+
+  memset( &h, 0, sizeof(h) );
+  strncpy( h.magic, TEXTURE_MIPS_MAGIC, sizeof(h.magic) );
+  h.version = TEXTURE_MIPS_VERSION;
+  h.channels = channels;
+  h.key = key;
+
+  // Level sizes and offsets
+
+  uint64_t offset = sizeof(h);
+
+  for (int w=width, ht=height; ; w=MAX(w/2,1), ht=MAX(ht/2,1)) {
+
+    if (h.nLevels == TEXTURE_MIPS_MAX_LEVELS) {
+      cerr << "Texture is too large for a mipmap container." << endl;
+      return false;
+    }
+
+    offset = (offset + TEXTURE_MIPS_ALIGNMENT-1) / TEXTURE_MIPS_ALIGNMENT * TEXTURE_MIPS_ALIGNMENT;
+
+    h.levelWidth[h.nLevels] = w;
+    h.levelHeight[h.nLevels] = ht;
+    h.levelOffset[h.nLevels] = offset;
+    h.nLevels++;
+
+    offset += (uint64_t) w * ht * channels;
+
+    if (w == 1 && ht == 1)
+      break;
+  }
+
+  h.fileSize = offset;
+
+  // Write under a temporary name, then rename, so that a partly
+  // written container is never used
+
+  string tmpName = string(filename) + ".tmp";
+
+  FILE *out = fopen( tmpName.c_str(), "wb" );
+  if (out == NULL) {
+    cerr << "Could not write '" << filename << "'." << endl;
+    return false;
+  }
+
+  bool ok = (fwrite( &h, sizeof(h), 1, out ) == 1);
+
+  const unsigned char *level = texels;
+  unsigned char *prev = NULL;
+
+  for (unsigned int l=0; ok && l<h.nLevels; l++) {
+
+    if (l > 0) {
+      unsigned char *next = new unsigned char[ (size_t) h.levelWidth[l] * h.levelHeight[l] * channels ];
+      halve( level, h.levelWidth[l-1], h.levelHeight[l-1], next, h.levelWidth[l], h.levelHeight[l], channels );
+      delete[] prev;
+      level = prev = next;
+    }
+
+    size_t n = (size_t) h.levelWidth[l] * h.levelHeight[l] * channels;
+
+    ok = (fseeko( out, h.levelOffset[l], SEEK_SET ) == 0 && fwrite( level, 1, n, out ) == n);
+  }
+
+  delete[] prev;
+
+  // The last level ends the file
+
+  ok = ok && (ftello( out ) == (int64_t) h.fileSize);
+  ok = (fclose( out ) == 0) && ok;
+
+#ifdef _WIN32
+  remove( filename );           // rename() does not replace on Windows
+#endif
+
+  if (!ok || rename( tmpName.c_str(), filename ) != 0) {
+    cerr << "Could not write '" << filename << "'." << endl;
+    remove( tmpName.c_str() );
+    return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,92 @@
+// textureMips.h
+//
+// A texture's whole mipmap chain, ready to upload, so that loading the
+// texture skips decoding the PNG and generating the mipmaps.
+//
+// The container is written next to the image, with TEXTURE_MIPS_SUFFIX
+// appended to its name, by 'rollercoaster -mipTextures image.png ...'.
+// It is keyed by a hash of the PNG's bytes, so a changed image makes
+// the container stale, and the PNG is then loaded as usual.
+//
+// Layout (each section starts on a TEXTURE_MIPS_ALIGNMENT boundary, so
+// the file can be mapped and uploaded in place):
+//
+//    TextureMipsHeader
+//    level 0          unsigned char[ height ][ width ][ channels ]
+//    level 1          half the size (rounded down, at least 1)
+//    ...              down to 1x1
+//
+// Each texel of level l+1 is the average of a 2x2 block of level l.
+// Where level l has an odd size, its last row or column is dropped.
+
+
+#ifndef TEXTURE_MIPS_H
+#define TEXTURE_MIPS_H
+
+#include "headers.h"
+
+#include <stdint.h>
+
+
+#define TEXTURE_MIPS_MAGIC      "RCMIPS"
+#define TEXTURE_MIPS_VERSION    1
+#define TEXTURE_MIPS_ALIGNMENT  4096    // bytes (one page)
+#define TEXTURE_MIPS_SUFFIX     ".mips"
+
+#define TEXTURE_MIPS_MAX_LEVELS 16      // up to 32768 texels wide
+
+
+struct TextureMipsHeader {
+
+  char     magic[8];
+  uint32_t version;
+  uint32_t channels;            // 1 (grey), 2 (grey, alpha), 3 (RGB) or 4 (RGBA)
+  uint64_t key;                 // hash of the PNG
+  uint64_t fileSize;
+
+  uint32_t nLevels;
+  uint32_t levelWidth[TEXTURE_MIPS_MAX_LEVELS];
+  uint32_t levelHeight[TEXTURE_MIPS_MAX_LEVELS];
+  uint64_t levelOffset[TEXTURE_MIPS_MAX_LEVELS];
+};
+
+
+// A mapped container
+
+class TextureMips {
+
+  unsigned char *mapping;
+  size_t         mappingSize;
+
+ public:
+
+  TextureMipsHeader *header;
+
+  TextureMips() {
+    mapping = NULL;
+    mappingSize = 0;
+    header = NULL;
+  }
+
+  ~TextureMips() {
+    close();
+  }
+
+  // Map the container if it exists and matches the image it was made
+  // from (unless the image is missing).  The image is only read to
+  // hash it once there is a container to check.
+
+  bool open( const char *filename, const char *imageFilename );
+  void close();
+
+  const unsigned char *level( int l ) {
+    return mapping + header->levelOffset[l];
+  }
+
+  // Build the mipmap chain of 'texels' and write the container
+
+  static bool write( const char *filename, const unsigned char *texels, int width, int height, int channels, uint64_t key );
+};
+
+
+#endif
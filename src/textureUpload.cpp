@@ -0,0 +1,419 @@
+// textureUpload.cpp
+
+
+#include "textureUpload.h"
+
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+
+TextureUploader::TextureUploader()
+
+{
+  glGenBuffers( TEXTURE_UPLOAD_BUFFERS, buffers );
+
+  for (int b=0; b<TEXTURE_UPLOAD_BUFFERS; b++) {
+
+    glBindBuffer( GL_PIXEL_UNPACK_BUFFER, buffers[b] );
+    glBufferData( GL_PIXEL_UNPACK_BUFFER, TEXTURE_UPLOAD_BUFFER_SIZE, NULL, GL_STREAM_DRAW );
+
+    fences[b] = NULL;
+    mapBuffer( b );
+    empty.push_back( b );
+  }
+
+  // glad loads only the desktop OpenGL 3.3 entry points, which do not
+  // include glTexStorage2D
+
+  if (glad_glTexStorage2D == NULL)
+    glad_glTexStorage2D = (PFNGLTEXSTORAGE2DPROC) glfwGetProcAddress( "glTexStorage2D" );
+
+  decoding = NULL;
+  nUploaded = 0;
+  frameBytes = maxFrameBytes = 0;
+  stopping = false;
+
+  worker = std::thread( &TextureUploader::work, this );
+}
+
+
+// Textures not yet complete are left with a textureID of 0
+
+
+TextureUploader::~TextureUploader()
+
+{
+  {
+    std::lock_guard<std::mutex> lock( mutex );
+    stopping = true;
+  }
+  changed.notify_all();
+  worker.join();
+
+  for (int b=0; b<TEXTURE_UPLOAD_BUFFERS; b++) {
+    if (fences[b] != NULL)
+      glDeleteSync( fences[b] );
+    if (mapped[b] != NULL) {
+      glBindBuffer( GL_PIXEL_UNPACK_BUFFER, buffers[b] );
+      glUnmapBuffer( GL_PIXEL_UNPACK_BUFFER );
+    }
+  }
+
+  glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+  glDeleteBuffers( TEXTURE_UPLOAD_BUFFERS, buffers );
+
+  delete decoding;
+
+  for (auto &b : filled)
+    if (b.last)
+      delete b.decoded;
+
+  for (auto &b : building) {
+    if (b.second != 0)
+      glDeleteTextures( 1, &b.second );
+    TextureCache::release( b.first );
+  }
+}
+
+
+// Map a buffer for the worker.  The buffer's previous transfer has
+// finished, so there is nothing to synchronize with.
+
+
+void TextureUploader::mapBuffer( int b )
+
+{
+  glBindBuffer( GL_PIXEL_UNPACK_BUFFER, buffers[b] );
+
+  mapped[b] = (unsigned char *) glMapBufferRange( GL_PIXEL_UNPACK_BUFFER, 0, TEXTURE_UPLOAD_BUFFER_SIZE,
+                                                  GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT );
+
+  glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+
+  if (mapped[b] == NULL) {
+    cerr << "Could not map a texture upload buffer (GL error " << glGetError() << ")." << endl;
+    exit(1);
+  }
+}
+
+
+Texture *TextureUploader::load( string basePath, string filename, unsigned int options )
+
+{
+  string path = basePath + string("/") + filename;
+
+  // Already resident (or being loaded)?
+
+  string key;
+  Texture *t = TextureCache::find( path, options, key );
+
+  if (t != NULL)
+    return t;
+
+  t = new Texture();
+  t->name = filename;
+  t->options = options;
+
+  TextureCache::add( t, key );
+  TextureCache::find( path, options, key ); // the uploader's own reference, released when complete
+
+  building[t] = 0;
+
+  {
+    std::lock_guard<std::mutex> lock( mutex );
+    requests.push_back( std::make_pair( t, path ) );
+  }
+  changed.notify_all();
+
+  return t;
+}
+
+
+// ---------------- Worker thread ----------------
+
+
+// Decode each requested texture and copy its levels, a band of rows at
+// a time, into the empty buffers.  The mipmaps (and the texels, unless
+// they are kept) are freed before the last band is handed over, since
+// the decoded texture is freed once that band is transferred.
+
+
+void TextureUploader::work()
+
+{
+  while (true) {
+
+    std::pair<Texture *,string> request;
+
+    {
+      std::unique_lock<std::mutex> lock( mutex );
+      changed.wait( lock, [this] { return stopping || !requests.empty(); } );
+
+      if (stopping)
+        return;
+
+      request = requests.front();
+      requests.pop_front();
+    }
+
+    Texture *t = request.first;
+
+    Texture *d = new Texture();
+    d->name = t->name;
+    d->options = t->options;
+
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      decoding = d;
+    }
+
+    d->loadTexture( request.second );
+
+    bool tooWide = ((size_t) d->width * d->channels > TEXTURE_UPLOAD_BUFFER_SIZE);
+
+    if (tooWide)
+      cerr << "Texture '" << request.second << "' is too wide to upload: one row of it does not fit in an upload buffer." << endl;
+
+    if (tooWide || (d->mips == NULL && d->texmap == NULL)) { // could not be decoded, or uploaded
+      std::lock_guard<std::mutex> lock( mutex );
+      filled.push_back( { t, d, -1, 0, 1, 0, 0, true } );
+      decoding = NULL;
+      continue;
+    }
+
+    int nLevels = (d->mips != NULL ? d->mips->header->nLevels : 1);
+
+    for (int l=0; l<nLevels; l++) {
+
+      int width  = MAX( d->width  >> l, 1 );
+      int height = MAX( d->height >> l, 1 );
+
+      const unsigned char *texels = (d->mips != NULL ? d->mips->level(l) : d->texmap);
+
+      size_t rowBytes = (size_t) width * d->channels;
+      int rowsPerBand = TEXTURE_UPLOAD_BUFFER_SIZE / rowBytes;
+
+      for (int y=0; y<height; y+=rowsPerBand) {
+
+        TextureBand band = { t, d, -1, l, nLevels, y, MIN( rowsPerBand, height-y ), l == nLevels-1 && y+rowsPerBand >= height };
+
+        {
+          std::unique_lock<std::mutex> lock( mutex );
+          changed.wait( lock, [this] { return stopping || !empty.empty(); } );
+
+          if (stopping)
+            return;             // the destructor frees 'd' (as 'decoding')
+
+          band.buffer = empty.front();
+          empty.pop_front();
+        }
+
+        memcpy( mapped[ band.buffer ], texels + y * rowBytes, band.nRows * rowBytes );
+
+        if (band.last) {
+          delete d->mips;
+          d->mips = NULL;
+          if (!(d->options & TEXTURE_KEEP_TEXELS)) {
+            free( d->texmap );
+            d->texmap = NULL;
+          }
+        }
+
+        std::lock_guard<std::mutex> lock( mutex );
+        filled.push_back( band );
+        if (band.last)
+          decoding = NULL;
+      }
+    }
+  }
+}
+
+
+// ---------------- OpenGL ----------------
+
+
+// Levels a texture is allocated with: those transferred, and any that
+// glGenerateMipmap() fills from them
+
+
+static int levelsAllocated( Texture *t, int nLevels )
+
+{
+  if (!(t->options & TEXTURE_MIPMAPS) || nLevels > 1)
+    return nLevels;
+
+  int n = 1;
+
+  for (unsigned int size = MAX( t->width, t->height ); size > 1; size >>= 1)
+    n++;
+
+  return n;
+}
+
+
+static size_t bytesAllocated( Texture *t, int nLevels )
+
+{
+  size_t bytes = 0;
+
+  for (int l=0; l<levelsAllocated( t, nLevels ); l++)
+    bytes += (size_t) MAX( t->width >> l, 1 ) * MAX( t->height >> l, 1 ) * t->channels;
+
+  return bytes;
+}
+
+
+// Allocate all of a bound texture's levels at once, before its first
+// band, so that every band is a glTexSubImage2D().  RGB and RGBA
+// textures get immutable storage.  Grey textures (which have no sized
+// format in OpenGL ES) and drivers without glTexStorage2D() get each
+// transferred level from glTexImage2D(), and glGenerateMipmap()
+// allocates the rest.
+
+
+void TextureUploader::allocate( Texture *t, int nLevels )
+
+{
+  if (glad_glTexStorage2D != NULL && t->channels >= 3) {
+    glTexStorage2D( GL_TEXTURE_2D, levelsAllocated( t, nLevels ), (t->channels == 4 ? GL_RGBA8 : GL_RGB8), t->width, t->height );
+    return;
+  }
+
+  for (int l=0; l<nLevels; l++)
+    glTexImage2D( GL_TEXTURE_2D, l, t->glFormat(), MAX( t->width >> l, 1 ), MAX( t->height >> l, 1 ), 0,
+                  t->glFormat(), GL_UNSIGNED_BYTE, NULL );
+}
+
+
+// Transfer a band to its texture.  The first band creates the texture
+// and allocates its levels, and the last band makes it usable.  Only
+// here, on the OpenGL thread, is the requested texture changed: the
+// first band gives it the decoded size and format, and the last gives
+// it any kept texels.
+
+
+void TextureUploader::transfer( TextureBand &band )
+
+{
+  Texture *t = band.texture;
+  Texture *d = band.decoded;
+
+  if (band.level == 0 && band.y == 0 && band.buffer >= 0) {
+    t->width    = d->width;
+    t->height   = d->height;
+    t->channels = d->channels;
+    t->hasAlpha = d->hasAlpha;
+  }
+
+  GLuint id = building[t];
+
+  if (id == 0) {
+    id = building[t] = t->createTexture( band.nLevels );
+    if (band.buffer >= 0)
+      allocate( t, band.nLevels );
+  } else
+    glBindTexture( GL_TEXTURE_2D, id );
+
+  if (band.buffer >= 0) {
+
+    int b = band.buffer;
+
+    glBindBuffer( GL_PIXEL_UNPACK_BUFFER, buffers[b] );
+    glUnmapBuffer( GL_PIXEL_UNPACK_BUFFER );
+    mapped[b] = NULL;
+
+    glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
+    glTexSubImage2D( GL_TEXTURE_2D, band.level, 0, band.y, MAX( t->width >> band.level, 1 ), band.nRows,
+                     t->glFormat(), GL_UNSIGNED_BYTE, (void *) 0 );
+
+    glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+
+    fences[b] = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+
+  } else                        // not decoded: empty, as Texture::registerWithOpenGL() leaves it
+    glTexImage2D( GL_TEXTURE_2D, 0, t->glFormat(), 0, 0, 0, t->glFormat(), GL_UNSIGNED_BYTE, NULL );
+
+  if (band.last) {
+
+    if ((t->options & TEXTURE_MIPMAPS) && band.nLevels == 1 && band.buffer >= 0)
+      glGenerateMipmap( GL_TEXTURE_2D );
+
+    if (t->options & TEXTURE_KEEP_TEXELS) {
+      t->texmap = d->texmap;
+      d->texmap = NULL;
+    }
+    delete d;
+
+    t->textureID = id;
+    building.erase( t );
+    TextureCache::release( t ); // the uploader's reference
+    nUploaded++;
+  }
+}
+
+
+// Called each frame: recycle the buffers whose transfers have finished,
+// then transfer the filled bands, in order, within the frame's budget.
+// At least one band is transferred, if there is one.
+
+
+void TextureUploader::update()
+
+{
+  for (int b=0; b<TEXTURE_UPLOAD_BUFFERS; b++)
+    if (fences[b] != NULL) {
+
+      GLenum status = glClientWaitSync( fences[b], 0, 0 ); // don't wait
+
+      if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+
+        glDeleteSync( fences[b] );
+        fences[b] = NULL;
+        mapBuffer( b );
+
+        {
+          std::lock_guard<std::mutex> lock( mutex );
+          empty.push_back( b );
+        }
+        changed.notify_all();
+      }
+    }
+
+  frameBytes = 0;
+
+  while (true) {
+
+    TextureBand band;
+    size_t bytes;
+
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+
+      if (filled.empty())
+        break;
+
+      // A band's cost is its texels, and the first band's also those
+      // of every level it allocates, so that a texture's allocation
+      // starts a frame and nothing else follows it in that frame
+
+      band = filled.front();
+
+      Texture *t = band.decoded;
+
+      bytes = band.nRows * (size_t) MAX( t->width >> band.level, 1 ) * t->channels;
+      if (band.level == 0 && band.y == 0 && band.buffer >= 0)
+        bytes += bytesAllocated( t, band.nLevels );
+
+      if (frameBytes > 0 && frameBytes + bytes > TEXTURE_UPLOAD_FRAME_BUDGET)
+        break;
+
+      filled.pop_front();
+    }
+
+    transfer( band );
+    frameBytes += bytes;
+  }
+
+  maxFrameBytes = MAX( maxFrameBytes, frameBytes );
+}
@@ -0,0 +1,105 @@
+// textureUpload.h
+//
+// Loads textures without stalling the OpenGL thread, for textures
+// loaded after startup (as when the scene is reloaded).
+//
+// A worker thread decodes each image and copies its texels, a band of
+// rows at a time, into pixel buffer objects from a ring of
+// TEXTURE_UPLOAD_BUFFERS, which the OpenGL thread keeps mapped.
+// update(), called each frame on the OpenGL thread, issues the
+// transfers from the filled buffers to their textures, up to
+// TEXTURE_UPLOAD_FRAME_BUDGET bytes a frame, and fences each one.  A
+// buffer is mapped again for the worker once its fence has passed, so
+// neither thread waits on a transfer.  All of a texture's levels are
+// allocated at once, in a frame that transfers only their first band.
+//
+// A texture's textureID is 0 (so it samples as black) until all of
+// its levels have been transferred, and its width and height are 0
+// until its first band has been.
+//
+//    TextureUploader uploader;         // on the OpenGL thread
+//    Texture *t = uploader.load( path, "a.png" );
+//    ...
+//    uploader.update();                // each frame
+
+
+#ifndef TEXTURE_UPLOAD_H
+#define TEXTURE_UPLOAD_H
+
+#include "headers.h"
+#include "texture.h"
+
+#include <deque>
+#include <map>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+#define TEXTURE_UPLOAD_BUFFERS      4          // pixel buffer objects in the ring
+#define TEXTURE_UPLOAD_BUFFER_SIZE  (4 << 20)  // bytes in each (textures with wider rows are not loaded)
+#define TEXTURE_UPLOAD_FRAME_BUDGET (8 << 20)  // most bytes transferred per frame (at least one band)
+
+
+// A band of rows of one level of a texture, copied into a buffer.  A
+// texture that could not be decoded gets one band with no buffer.
+//
+// The worker decodes into a Texture of its own ('decoded'), so that
+// the requested texture is only touched on the OpenGL thread: its
+// size and format are set from the decoded one by its first band, and
+// its kept texels (with TEXTURE_KEEP_TEXELS) are taken by its last.
+
+struct TextureBand {
+  Texture *texture;
+  Texture *decoded;             // freed after the last band
+  int      buffer;              // index in the ring, or -1
+  int      level, nLevels;      // nLevels is 1 if mipmaps are to be generated
+  int      y, nRows;
+  bool     last;                // of the texture
+};
+
+
+class TextureUploader {
+
+  GLuint         buffers[ TEXTURE_UPLOAD_BUFFERS ];
+  unsigned char *mapped[ TEXTURE_UPLOAD_BUFFERS ];  // NULL unless mapped
+  GLsync         fences[ TEXTURE_UPLOAD_BUFFERS ];  // NULL unless a transfer is in flight
+
+  std::map<Texture *,GLuint> building; // loaded but not yet complete (0 until the first band)
+
+  // Worker thread
+
+  std::thread                 worker;
+  std::mutex                  mutex;
+  std::condition_variable     changed;  // a request, or an empty buffer
+  std::deque< std::pair<Texture *,string> > requests; // textures to decode, and their paths
+  std::deque<int>             empty;    // mapped buffers for the worker to fill
+  std::deque<TextureBand>     filled;   // bands ready to transfer
+  Texture                    *decoding; // by the worker, until its last band is filled
+  bool                        stopping;
+
+  void work();
+  void mapBuffer( int b );
+  void allocate( Texture *t, int nLevels );
+  void transfer( TextureBand &band );
+
+ public:
+
+  int    nUploaded;
+  size_t frameBytes, maxFrameBytes; // transferred by the last update(), and by the busiest
+
+  TextureUploader();
+  ~TextureUploader();
+
+  Texture *load( string basePath, string filename, unsigned int options = TEXTURE_DEFAULT_OPTIONS ); // cached
+
+  void update();
+
+  bool busy() {
+    return !building.empty();
+  }
+};
+
+
+#endif
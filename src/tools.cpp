@@ -0,0 +1,588 @@
+// tools.cpp
+
+
+#include "tools.h"
+#include "train.h"
+#include "sweep.h"
+#include "terrain.h"
+#include "terrainNormals.h"
+#include "heightfield.h"
+#include "texture.h"
+#include "lodepng.h"
+
+#include <fstream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+#include <thread>
+#include <filesystem>
+#include <algorithm>
+
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+
+static int benchIntegrators( int argc, char **argv );
+static int benchNormals( int argc, char **argv );
+static int bakeTerrain( int argc, char **argv );
+static int tileTerrain( int argc, char **argv );
+static int mipTextures( int argc, char **argv );
+static int benchDecode( int argc, char **argv );
+
+
+int runTool( int argc, char **argv )
+
+{
+  if (strcmp( argv[1], "-benchIntegrators" ) == 0)
+    return benchIntegrators( argc, argv );
+
+  if (strcmp( argv[1], "-sweep" ) == 0)
+    return runSweep( argc, argv );
+
+  if (strcmp( argv[1], "-benchNormals" ) == 0)
+    return benchNormals( argc, argv );
+
+  if (strcmp( argv[1], "-bakeTerrain" ) == 0)
+    return bakeTerrain( argc, argv );
+
+  if (strcmp( argv[1], "-tileTerrain" ) == 0)
+    return tileTerrain( argc, argv );
+
+  if (strcmp( argv[1], "-mipTextures" ) == 0)
+    return mipTextures( argc, argv );
+
+  if (strcmp( argv[1], "-benchDecode" ) == 0)
+    return benchDecode( argc, argv );
+
+  cerr << "Unknown tool '" << argv[1] << "'.  Tools are:" << endl
+       << "  -benchIntegrators scene_file" << endl
+       << "  -sweep scene_file [name=values ...]" << endl
+       << "  -benchNormals [size ...]" << endl
+       << "  -bakeTerrain scene_file" << endl
+       << "  -tileTerrain heightfield output.tiles [width height]" << endl
+       << "  -mipTextures image.png ..." << endl
+       << "  -benchDecode [image.png ...]" << endl;
+
+  return 1;
+}
+
+
+// Read only the control points of a scene file (no terrain, so no
+// OpenGL is needed).
+
+
+bool readTrack( const char *filename, CtrlPoints *ctrlPoints )
+
+{
+  ifstream in( filename );
+
+  if (!in) {
+    cerr << "Could not open file '" << filename << "'." << endl;
+    return false;
+  }
+
+  ctrlPoints->clear();
+
+  string cmd;
+  in >> cmd;
+  while (in) {
+
+    if (cmd == "points") {
+
+      in >> cmd;
+
+      while (in && (isdigit(cmd.c_str()[0]) || cmd.c_str()[0] == '-' || cmd.c_str()[0] == '.')) {
+        float y, z, h;
+        in >> y >> z >> h;
+        ctrlPoints->addPointWithHeight( vec3( atof(cmd.c_str()), y, z ), h );
+        in >> cmd;
+      }
+
+    } else
+      in >> cmd;                // skip everything else
+  }
+
+  if (ctrlPoints->count() < 2) {
+    cerr << "Scene '" << filename << "' has fewer than two control points." << endl;
+    return false;
+  }
+
+  return true;
+}
+
+
+// Measure energy drift against step size for each integrator.
+//
+// Drag and the minimum speed are disabled, so the exact solution
+// conserves energy.  The drift is the maximum |E - E0| over the run,
+// relative to the initial kinetic energy.
+
+
+#define BENCH_SECONDS 120.0
+#define BENCH_INITIAL_SPEED 70
+#define BENCH_REFERENCE_DT (1/60.0)
+
+
+static int benchIntegrators( int argc, char **argv )
+
+{
+  if (argc < 3) {
+    cerr << "Usage: " << argv[0] << " -benchIntegrators scene_file" << endl;
+    return 1;
+  }
+
+  Spline spline;
+  CtrlPoints ctrlPoints( &spline, NULL );
+
+  if (!readTrack( argv[2], &ctrlPoints ))
+    return 1;
+
+  // Run separately for each change-of-basis matrix, since the
+  // smoothness of the track limits the order of the integrators.
+
+  string firstCOB = spline.name();
+
+  do {
+
+    float length = spline.totalArcLength();
+
+    cout << spline.name() << " track, length " << setprecision(6) << length << ", " << BENCH_SECONDS << " simulated seconds per run" << endl << endl;
+
+    const int nSteps = 8;
+    float stepSizes[nSteps] = { 1/480.0, 1/240.0, 1/120.0, 1/60.0, 1/30.0, 1/15.0, 1/7.5, 1/3.75 };
+    float drift[NUM_INTEGRATORS][nSteps];
+
+    cout << setw(22) << left << "integrator" << right
+         << setw(10) << "dt"
+         << setw(14) << "drift"
+         << setw(14) << "ms/sim-sec" << endl;
+
+    for (int i=0; i<NUM_INTEGRATORS; i++)
+      for (int j=0; j<nSteps; j++) {
+
+        Train train( &spline );
+        train.setIntegrator( (IntegratorType) i );
+        train.setDrag( 0 );
+        train.setMinSpeed( 0 );
+        train.setSpeed( BENCH_INITIAL_SPEED );
+
+        float E0 = train.energy();
+        float KE0 = 0.5 * BENCH_INITIAL_SPEED * BENCH_INITIAL_SPEED;
+        float maxErr = 0;
+
+        int n = (int) (BENCH_SECONDS / stepSizes[j]);
+
+        auto start = std::chrono::steady_clock::now();
+
+        for (int k=0; k<n; k++) {
+          train.advance( stepSizes[j] );
+          float err = fabs( train.energy() - E0 );
+          if (err > maxErr)
+            maxErr = err;
+        }
+
+        double ms = std::chrono::duration<double,std::milli>( std::chrono::steady_clock::now() - start ).count();
+
+        drift[i][j] = maxErr / KE0;
+
+        cout << setw(22) << left << integratorName[i] << right
+             << setw(10) << setprecision(4) << stepSizes[j]
+             << setw(14) << setprecision(3) << drift[i][j]
+             << setw(14) << setprecision(3) << ms / BENCH_SECONDS << endl;
+      }
+
+    // For each integrator, the largest step with no more drift than the
+    // current default at 60 Hz
+
+    int ref;
+    for (ref=0; stepSizes[ref] < BENCH_REFERENCE_DT*0.999; ref++)
+      ;
+
+    float target = drift[SEMI_IMPLICIT_EULER][ref];
+
+    cout << endl << "largest step with drift <= " << setprecision(3) << target
+         << " (" << integratorName[SEMI_IMPLICIT_EULER] << " at dt = " << setprecision(4) << BENCH_REFERENCE_DT << "):" << endl;
+
+    for (int i=0; i<NUM_INTEGRATORS; i++) {
+      float best = 0;
+      for (int j=0; j<nSteps; j++)
+        if (drift[i][j] <= target)
+          best = stepSizes[j];
+      cout << "  " << setw(22) << left << integratorName[i] << right;
+      if (best > 0)
+        cout << "dt = " << setprecision(4) << best << "  (" << setprecision(3) << best / BENCH_REFERENCE_DT << "x)" << endl;
+      else
+        cout << "none" << endl;
+    }
+
+    cout << endl;
+    spline.nextCOB();
+
+  } while (spline.name() != firstCOB);
+
+  return 0;
+}
+
+
+// Time terrain normal generation on synthetic heightfields of the
+// given sizes (default 512, 4096, and 8192 square), single-threaded
+// and on all cores.
+
+
+#define BENCH_NORMALS_REPEATS 3
+
+
+static int benchNormals( int argc, char **argv )
+
+{
+  std::vector<int> sizes;
+
+  for (int i=2; i<argc; i++)
+    sizes.push_back( atoi( argv[i] ) );
+
+  if (sizes.empty())
+    sizes = { 512, 4096, 8192 };
+
+  int nThreads = std::thread::hardware_concurrency();
+
+  cout << setw(8) << "size"
+       << setw(14) << "1 thread"
+       << setw(11) << nThreads << " thr" << "  (ms)" << endl;
+
+  for (int size : sizes) {
+
+    if (size < 2) {
+      cerr << "Bad heightfield size " << size << "." << endl;
+      return 1;
+    }
+
+    float *heights = (float *) alignedAlloc( (size_t) size * size * sizeof(float) );
+    vec3  *normals = (vec3 *)  alignedAlloc( (size_t) size * size * sizeof(vec3) );
+
+    for (int y=0; y<size; y++)
+      for (int x=0; x<size; x++)
+        heights[(size_t) y*size + x] = 20 * sin( x * 0.05 ) * cos( y * 0.03 ) + 5 * sin( (x+y) * 0.2 );
+
+    double ms[2];
+
+    for (int k=0; k<2; k++) {
+      ms[k] = MAXFLOAT;
+      for (int r=0; r<BENCH_NORMALS_REPEATS; r++) {
+        auto start = std::chrono::steady_clock::now();
+        computeNormals( heights, normals, size, size, (k == 0 ? 1 : nThreads) );
+        double t = std::chrono::duration<double,std::milli>( std::chrono::steady_clock::now() - start ).count();
+        if (t < ms[k])
+          ms[k] = t;
+      }
+    }
+
+    cout << setw(8) << size
+         << setw(14) << setprecision(4) << ms[0]
+         << setw(14) << setprecision(4) << ms[1] << endl;
+
+    alignedFree( heights );
+    alignedFree( normals );
+  }
+
+  return 0;
+}
+
+
+// Write the terrain cache for a scene ahead of time (see terrainCache.h)
+
+
+static int bakeTerrain( int argc, char **argv )
+
+{
+  if (argc < 3) {
+    cerr << "Usage: " << argv[0] << " -bakeTerrain scene_file" << endl;
+    return 1;
+  }
+
+  ifstream in( argv[2] );
+
+  if (!in) {
+    cerr << "Could not open file '" << argv[2] << "'." << endl;
+    return 1;
+  }
+
+  // Heightfield paths are relative to the scene file's directory
+
+  string basePath( argv[2] );
+  size_t slash = basePath.find_last_of( "/\\" );
+  basePath = (slash == string::npos ? string("") : basePath.substr( 0, slash ));
+
+  string cmd;
+  in >> cmd;
+  while (in) {
+
+    if (cmd == "terrain") {
+
+      string heightFile, textureFile;
+      in >> heightFile >> textureFile;
+
+      auto start = std::chrono::steady_clock::now();
+
+      if (!Terrain::bakeCache( basePath, heightFile ))
+        return 1;
+
+      cout << "  in " << setprecision(3)
+           << std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count() << " s" << endl;
+
+      return 0;
+    }
+
+    in >> cmd;
+  }
+
+  cerr << "Scene '" << argv[2] << "' has no terrain." << endl;
+  return 1;
+}
+
+
+
+// Convert a heightfield to a tiled terrain (see terrainTiles.h).
+//
+// The heightfield is any that HeightfieldReader reads (see
+// heightfield.h), or, if width and height are given, raw little-endian
+// 32-bit floats in row-major order.  A raw heightfield is read a row at
+// a time, so it need not fit in memory.
+
+
+static int tileTerrain( int argc, char **argv )
+
+{
+  if (argc != 4 && argc != 6) {
+    cerr << "Usage: " << argv[0] << " -tileTerrain heightfield output" << TERRAIN_TILES_SUFFIX << " [width height]" << endl;
+    return 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+
+  HeightfieldReader reader;
+
+  if (!(argc == 6 ? reader.openRaw( argv[2], atoi( argv[4] ), atoi( argv[5] ), sizeof(float) ) : reader.open( argv[2] )))
+    return 1;
+
+  unsigned int width = reader.width;
+  unsigned int height = reader.height;
+
+  bool ok = TerrainTiles::build( argv[3], width, height, [&]( int y, float *row ) {
+      return reader.readRow( y, row );
+    } );
+
+  if (!ok)
+    return 1;
+
+  cout << "Wrote " << argv[3] << " (" << width << "x" << height << ") in " << setprecision(3)
+       << std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count() << " s" << endl;
+
+  return 0;
+}
+
+
+// Write the mipmap container of each image (see textureMips.h)
+
+
+static int mipTextures( int argc, char **argv )
+
+{
+  if (argc < 3) {
+    cerr << "Usage: " << argv[0] << " -mipTextures image.png ..." << endl;
+    return 1;
+  }
+
+  int status = 0;
+
+  for (int i=2; i<argc; i++) {
+
+    auto start = std::chrono::steady_clock::now();
+
+    if (!Texture::writeMips( argv[i] )) {
+      status = 1;
+      continue;
+    }
+
+    cout << "Wrote " << argv[i] << TEXTURE_MIPS_SUFFIX << " in " << setprecision(3)
+         << std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count() << " s" << endl;
+  }
+
+  return status;
+}
+
+
+// Time PNG decoding with scalar and with SSE2 unfiltering (see
+// LODEPNG_SSE2 in lodepng.cpp), and check that they agree, on the
+// given images (default data/*.png) and on synthetic 16-bit grey
+// (heightfield), RGB and RGBA images BENCH_DECODE_SIZE square: one for
+// each of the sub, average and paeth filters, and one with the
+// encoder's usual mix of filters.
+
+
+#define BENCH_DECODE_REPEATS 3
+#define BENCH_DECODE_SIZE    8192
+
+
+// Decode to the PNG's own colour type, returning the best time of
+// BENCH_DECODE_REPEATS, or -1 on error
+
+
+static double timeDecode( const std::vector<unsigned char> &png, unsigned simd, std::vector<unsigned char> &out )
+
+{
+  double best = -1;
+
+  for (int r=0; r<BENCH_DECODE_REPEATS; r++) {
+
+    LodePNGState state;
+    lodepng_state_init( &state );
+    state.decoder.color_convert = 0;
+    state.decoder.simd_unfilter = simd;
+
+    unsigned char *image = NULL;
+    unsigned width, height;
+
+    auto start = std::chrono::steady_clock::now();
+    unsigned error = lodepng_decode( &image, &width, &height, &state, png.data(), png.size() );
+    double t = std::chrono::duration<double,std::milli>( std::chrono::steady_clock::now() - start ).count();
+
+    if (!error && r == 0)
+      out.assign( image, image + lodepng_get_raw_size( width, height, &state.info_raw ) );
+
+    free( image );
+    lodepng_state_cleanup( &state );
+
+    if (error) {
+      cerr << "Decoding failed: " << lodepng_error_text( error ) << endl;
+      return -1;
+    }
+
+    if (best < 0 || t < best)
+      best = t;
+  }
+
+  return best;
+}
+
+
+static int benchDecode( int argc, char **argv )
+
+{
+  struct BenchImage {
+    string name;
+    std::vector<unsigned char> png;
+  };
+
+  std::vector<BenchImage> images;
+
+  std::vector<string> files;
+  for (int i=2; i<argc; i++)
+    files.push_back( argv[i] );
+
+  if (files.empty()) {
+    std::error_code error;
+    for (auto &entry : std::filesystem::directory_iterator( "data", error ))
+      if (entry.path().extension() == ".png")
+        files.push_back( entry.path().string() );
+    std::sort( files.begin(), files.end() );
+  }
+
+  for (string &f : files) {
+    BenchImage b;
+    b.name = f;
+    if (lodepng::load_file( b.png, f ) != 0 || b.png.empty()) {
+      cerr << "Could not open file '" << f << "'." << endl;
+      return 1;
+    }
+    images.push_back( b );
+  }
+
+  // Synthetic images: smooth, terrain-like heights and colours with a
+  // little noise
+
+  static const struct { LodePNGFilterStrategy strategy; const char *name; } filters[] = {
+    { LFS_ONE, "sub" }, { LFS_THREE, "average" }, { LFS_FOUR, "paeth" }, { LFS_MINSUM, "mixed" }
+  };
+
+  static const struct { LodePNGColorType colorType; unsigned int bitDepth; int channels; const char *name; } formats[] = {
+    { LCT_GREY, 16, 1, "grey16 " }, { LCT_RGB, 8, 3, "RGB " }, { LCT_RGBA, 8, 4, "RGBA " }
+  };
+
+  for (auto &format : formats) {
+
+    int bytes = format.channels * format.bitDepth / 8;
+    std::vector<unsigned char> pixels( (size_t) BENCH_DECODE_SIZE * BENCH_DECODE_SIZE * bytes );
+    unsigned int seed = 1;
+
+    for (int y=0; y<BENCH_DECODE_SIZE; y++)
+      for (int x=0; x<BENCH_DECODE_SIZE; x++) {
+        unsigned char *p = &pixels[ ((size_t) y * BENCH_DECODE_SIZE + x) * bytes ];
+        seed = seed * 1103515245 + 12345;
+        float h = 0.5 + 0.3 * sin( x * 0.003 ) * cos( y * 0.002 ) + 0.1 * sin( (x+2*y) * 0.02 );
+        int noise = (seed >> 16) % 9 - 4;
+        if (format.bitDepth == 16) {
+          int v = MIN( 65535, MAX( 0, (int) (65535 * h) + noise ) );
+          p[0] = v >> 8;        // big-endian
+          p[1] = v & 255;
+        } else
+          for (int c=0; c<format.channels; c++)
+            p[c] = MIN( 255, MAX( 0, (int) (255 * h * (0.6 + 0.2*c)) + noise ) );
+      }
+
+    for (auto &f : filters) {
+
+      BenchImage b;
+      b.name = string( "synthetic " ) + format.name + f.name;
+
+      lodepng::State state;
+      state.info_raw.colortype = format.colorType;
+      state.info_raw.bitdepth = format.bitDepth;
+      state.info_png.color.colortype = format.colorType;
+      state.info_png.color.bitdepth = format.bitDepth;
+      state.encoder.auto_convert = 0;
+      state.encoder.filter_strategy = f.strategy;
+
+      if (lodepng::encode( b.png, pixels, BENCH_DECODE_SIZE, BENCH_DECODE_SIZE, state ) != 0) {
+        cerr << "Could not encode " << b.name << "." << endl;
+        return 1;
+      }
+
+      images.push_back( b );
+    }
+  }
+
+  // Decode each image both ways
+
+  cout << setw(28) << left << "image" << right << setw(14) << "pixels"
+       << setw(10) << "scalar" << setw(10) << "SSE2" << "  (ms)" << endl;
+
+  for (BenchImage &b : images) {
+
+    std::vector<unsigned char> scalar, simd;
+
+    double scalarMs = timeDecode( b.png, 0, scalar );
+    double simdMs = timeDecode( b.png, 1, simd );
+
+    if (scalarMs < 0 || simdMs < 0)
+      return 1;
+
+    if (scalar != simd) {
+      cerr << b.name << ": SSE2 and scalar unfiltering differ." << endl;
+      return 1;
+    }
+
+    unsigned width, height;
+    LodePNGState state;
+    lodepng_state_init( &state );
+    lodepng_inspect( &width, &height, &state, b.png.data(), b.png.size() );
+    lodepng_state_cleanup( &state );
+
+    cout << setw(28) << left << b.name << right << setw(14) << (std::to_string( width ) + "x" + std::to_string( height ))
+         << setw(10) << fixed << setprecision(1) << scalarMs << setw(10) << simdMs
+         << "  " << setprecision(2) << scalarMs / simdMs << "x" << endl;
+    cout.unsetf( std::ios::floatfield );
+  }
+
+  return 0;
+}
@@ -0,0 +1,27 @@
+// tools.h
+//
+// Command-line tools that run without opening a window.  These are
+// selected by a first argument that starts with '-':
+//
+//    rollercoaster -benchIntegrators scene_file
+//    rollercoaster -sweep scene_file [name=values ...]   (see sweep.h)
+//    rollercoaster -benchNormals [size ...]
+//    rollercoaster -bakeTerrain scene_file               (see terrainCache.h)
+//    rollercoaster -tileTerrain heightfield output.tiles [width height]
+//                                                        (see terrainTiles.h)
+//    rollercoaster -mipTextures image.png ...            (see textureMips.h)
+//    rollercoaster -benchDecode [image.png ...]          (see lodepng.cpp)
+
+
+#ifndef TOOLS_H
+#define TOOLS_H
+
+#include "headers.h"
+#include "ctrlPoints.h"
+
+
+int  runTool( int argc, char **argv );
+bool readTrack( const char *filename, CtrlPoints *ctrlPoints );
+
+
+#endif
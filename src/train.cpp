@@ -6,6 +6,16 @@
 
 #define SPHERE_RADIUS 5.0
 #define SPHERE_COLOUR 238/255.0, 106/255.0, 20/255.0
+#define CONFLICT_COLOUR 1, 0, 0
+
+
+const char *integratorName[] = {
+  "semi-implicit Euler",
+  "explicit Euler",
+  "velocity Verlet",
+  "RK4"
+};
+
 
 // Draw the train.
 //
@@ -16,12 +26,16 @@ void Train::draw( mat4 &WCStoVCS, mat4 &WCStoCCS, vec3 lightDir, bool flag )
 
 {
   
-  float t = spline->paramAtArcLength( pos );
-
   // Draw sphere
   
   vec3 o, x, y, z;
-  spline->findLocalSystem( t, o, x, y, z );
+
+  if (replay != NULL)
+    o = replayO;
+  else {
+    float t = spline->paramAtArcLength( pos );
+    spline->findLocalSystem( t, o, x, y, z );
+  }
   
   height = o.z;
 
@@ -30,29 +44,150 @@ void Train::draw( mat4 &WCStoVCS, mat4 &WCStoCCS, vec3 lightDir, bool flag )
   mat4 MV  = WCStoVCS * M;
   mat4 MVP = WCStoCCS * M;
 
-  cube->Draw( MV, MVP, lightDir, vec3( SPHERE_COLOUR ) );
+  if (conflict)
+    cube->Draw( MV, MVP, lightDir, vec3( CONFLICT_COLOUR ) );
+  else
+    cube->Draw( MV, MVP, lightDir, vec3( SPHERE_COLOUR ) );
+
+}
+
 
+// Acceleration along the track at arc length 's' and speed 'v'.  The
+// track's vertical slope scales gravity less drag.
+
+
+float Train::accelAt( float s, float v )
+
+{
+    float zComp = spline->slopeAtArcLength( s );
+
+    return trackAccel( zComp, v, drag, mass, friction );
 }
 
 
+// Advance pos and speed by one step of 'Integrator'
+
+
+template<class Integrator>
+void Train::step( float elapsedSeconds )
+
+{
+    auto a = [this]( float s, float v ) { return accelAt( s, v ); };
+
+    Integrator::step( pos, speed, elapsedSeconds, a );
+}
+
+
+
+
 void Train::advance( float elapsedSeconds )
 
 { 
-    float t = spline->paramAtArcLength(pos);
+    // Replay: take the state from the recording
+
+    if (replay != NULL) {
+        simTime += elapsedSeconds;
+
+        TelemetryRecord rec;
+        if (replay->sample( simTime, rec )) {
+            pos = rec.pos;
+            speed = rec.speed;
+            accel = rec.accel;
+            replayO = rec.o;
+        }
+        return;
+    }
+
+    if (profile != NULL && profile->speedAt( pos ) > speedLimit) {
+
+        // Held by a block brake: leave the profile, and rejoin it
+        // where the train is once the brake is released
+
+        speed = speedLimit;
+        pos += speed * elapsedSeconds;
+
+        profileTime = profile->timeAtPos( fmod( pos, spline->totalArcLength() ) );
+        profileCursor = 0;
+
+    } else if (profile != NULL) {
+
+        // Look up the position and speed in the profile
+
+        profileTime += elapsedSeconds;
+
+        while (profileTime >= profile->lapTime()) {
+            profileTime -= profile->lapTime();
+            laps++;
+        }
+
+        pos = profile->posAtTime( profileTime, profileCursor );
+        speed = profile->speedAt( pos );
+
+    } else if (speed >= speedLimit) {
+        speed = speedLimit;     // held by a block brake
+        pos += speed * elapsedSeconds;
+    } else if (speed < minSpeed) {
+        speed = minSpeed;
+        pos += speed * elapsedSeconds;
+    } else
+        switch (integrator) {
+        case SEMI_IMPLICIT_EULER: step<SemiImplicitEuler>( elapsedSeconds ); break;
+        case EXPLICIT_EULER:      step<ExplicitEuler>( elapsedSeconds );     break;
+        case VELOCITY_VERLET:     step<VelocityVerlet>( elapsedSeconds );    break;
+        default:                  step<RungeKutta4>( elapsedSeconds );       break;
+        }
+
+    // Keep pos in [0,length) so that it does not lose precision on long runs
+
+    float length = spline->totalArcLength();
+
+    if (pos >= length) {
+        pos -= length;
+        laps++;
+    }
+
+    simTime += elapsedSeconds;
+
+    // Record the state after this step
+
+    if (recorder != NULL) {
+        TelemetryRecord rec;
+        rec.time = simTime;
+        rec.pos = pos;
+        rec.speed = speed;
+        rec.accel = accel = accelAt( pos, speed );
+        vec3 x;
+        spline->findLocalSystem( spline->paramAtArcLength(pos), rec.o, x, rec.y, rec.z );
+        recorder->record( rec );
+    }
+}
 
-    vec3 o, x, y, z;
-    spline->findLocalSystem( t, o, x, y, z );
 
-    float zComp = z * vec3(0, 0, 1);
+// Drive the train from a precomputed speed profile, starting at the
+// train's current position.  NULL returns to step-by-step integration.
 
-    accel = G - 0.2 * speed;
-    
-    if (speed < 20)
-        speed = 20;
-    else
-        speed +=  zComp * accel * elapsedSeconds;
 
+void Train::setProfile( SpeedProfile *p )
 
-    pos += speed * elapsedSeconds;
+{
+    profile = p;
+
+    if (profile != NULL) {
+        profileTime = profile->timeAtPos( pos );
+        profileCursor = 0;
+    }
+}
+
+
+// Energy per unit mass.  advance() accelerates by +G times the
+// vertical slope, so without drag the conserved quantity is
+// v^2/2 - G h.
+
+
+float Train::energy()
+
+{
+    float h = spline->value( spline->paramAtArcLength( pos ) ).z;
 
+    return 0.5 * speed * speed - G * h;
 }
@@ -5,10 +5,26 @@
 
 #include "headers.h"
 #include "spline.h"
+#include "telemetry.h"
+#include "integrator.h"
+#include "speedProfile.h"
 
 
 #define SPEED_INC 0.5
 #define G 9.81
+#define DEFAULT_DRAG      0.2   // drag force per unit speed
+#define DEFAULT_MIN_SPEED 20    // the train is never slower than this
+#define DEFAULT_FRICTION  0     // rolling friction as a fraction of G
+
+
+// Acceleration along a track of vertical slope dz/ds = 'slope' at speed 'v'
+
+inline float trackAccel( float slope, float v, float drag, float mass, float friction )
+
+{
+  return slope * (G - drag / mass * v) - friction * G;
+}
+
 
 class Train {
 
@@ -16,20 +32,61 @@ class Train {
 
   // state
 
-  float accel;
-  float pos;                    // position on spline
+  float accel;                  // along the track
+  float pos;                    // position on spline, in [0,totalArcLength)
+  int   laps;                   // number of times pos has wrapped
   float speed;
 
   float mass;
   float height;
 
+  // physics
+
+  float drag;
+  float friction;
+  float minSpeed;
+  float speedLimit;             // set by a block brake; MAXFLOAT if none
+  IntegratorType integrator;
+
+  bool conflict;                // too close to another train
+
+  // precomputed speed profile (not owned)
+
+  SpeedProfile *profile;        // if non-NULL, pos and speed come from here
+  double profileTime;           // time since the start of the lap
+  int    profileCursor;
+
+  float accelAt( float s, float v );
+
+  template<class Integrator>
+  void step( float elapsedSeconds );
+
+  double simTime;               // total simulated seconds
+
+  // telemetry (not owned)
+
+  TelemetryRecorder *recorder;  // if non-NULL, each step is recorded
+  TelemetryReplay   *replay;    // if non-NULL, the state is read from here instead of simulated
+  vec3 replayO;                 // replayed position
+
  public:
 
   Train( Spline *spl ) {
     spline = spl;
     pos = 0;
+    laps = 0;
     speed = 70;
     mass = 1;
+    drag = DEFAULT_DRAG;
+    friction = DEFAULT_FRICTION;
+    minSpeed = DEFAULT_MIN_SPEED;
+    speedLimit = MAXFLOAT;
+    conflict = false;
+    integrator = SEMI_IMPLICIT_EULER;
+    simTime = 0;
+    recorder = NULL;
+    replay = NULL;
+    profile = NULL;
   }
   
   void draw( mat4 &WCStoVCS, mat4 &WCStoCCS, vec3 lightDir, bool flag ); 
@@ -39,6 +96,74 @@ class Train {
     return speed;
   }
 
+  float getPos() {
+    return pos;
+  }
+
+  void setPos( float s ) {
+    pos = s;
+  }
+
+  int getLaps() {
+    return laps;
+  }
+
+  double getTime() {
+    return simTime;
+  }
+
+  float energy();
+
+  void setSpeed( float s ) {
+    speed = s;
+  }
+
+  void setMass( float m ) {
+    mass = m;
+  }
+
+  void setDrag( float d ) {
+    drag = d;
+  }
+
+  void setFriction( float f ) {
+    friction = f;
+  }
+
+  void setMinSpeed( float s ) {
+    minSpeed = s;
+  }
+
+  void setSpeedLimit( float s ) {
+    speedLimit = s;
+  }
+
+  bool inConflict() {
+    return conflict;
+  }
+
+  void setConflict( bool c ) {
+    conflict = c;
+  }
+
+  void computeProfile( SpeedProfile *p ) {
+    p->compute( spline, pos, speed, drag, mass, friction, minSpeed );
+  }
+
+  void setProfile( SpeedProfile *p );
+
+  SpeedProfile *getProfile() {
+    return profile;
+  }
+
+  IntegratorType getIntegrator() {
+    return integrator;
+  }
+
+  void setIntegrator( IntegratorType i ) {
+    integrator = i;
+  }
+
   void accelerate() {
     speed += SPEED_INC;
   }
@@ -46,6 +171,15 @@ class Train {
   void brake() {
     speed -= SPEED_INC;
   }
+
+  void setRecorder( TelemetryRecorder *r ) {
+    recorder = r;
+  }
+
+  void setReplay( TelemetryReplay *r ) {
+    replay = r;
+    simTime = 0;
+  }
 };
 
 
@@ -0,0 +1,133 @@
+// trains.cpp
+
+
+#include "trains.h"
+
+
+// Add a train in the middle of the largest gap between trains
+
+
+Train *Trains::add()
+
+{
+  if (trains.size() == 0)
+    return add( 0 );
+
+  float length = spline->totalArcLength();
+
+  float maxGap = -1;
+  float maxPos = 0;
+
+  for (int i=0; i<trains.size(); i++) {
+
+    Train *trailing = trains[i];
+    Train *leading  = trains[(i+1) % trains.size()];
+
+    float gap = leading->getPos() - trailing->getPos();
+    if (gap <= 0)
+      gap += length;
+
+    if (gap > maxGap) {
+      maxGap = gap;
+      maxPos = trailing->getPos() + 0.5 * gap;
+    }
+  }
+
+  return add( fmod( maxPos, length ) );
+}
+
+
+Train *Trains::add( float pos )
+
+{
+  Train *train = new Train( spline );
+  train->setPos( pos );
+
+  trains.add( train );
+
+  sort();
+  sweep();
+
+  return train;
+}
+
+
+void Trains::advance( float elapsedSeconds )
+
+{
+  for (int i=0; i<trains.size(); i++)
+    trains[i]->advance( elapsedSeconds );
+
+  sort();
+  sweep();
+}
+
+
+// Insertion sort by pos.  O(n) when the order from the last step is
+// nearly right, which it is unless trains have passed each other or
+// wrapped around the loop.
+
+
+void Trains::sort()
+
+{
+  for (int i=1; i<trains.size(); i++) {
+
+    Train *t = trains[i];
+    float pos = t->getPos();
+
+    int j = i;
+    while (j > 0 && trains[j-1]->getPos() > pos) {
+      trains[j] = trains[j-1];
+      j--;
+    }
+
+    trains[j] = t;
+  }
+}
+
+
+// Flag each train that is closer than the safety distance to the
+// train ahead, and set block brakes on it.
+
+
+void Trains::sweep()
+
+{
+  nConflicts = 0;
+
+  for (int i=0; i<trains.size(); i++) {
+    trains[i]->setConflict( false );
+    trains[i]->setSpeedLimit( MAXFLOAT );
+  }
+
+  if (trains.size() < 2)
+    return;
+
+  float length = spline->totalArcLength();
+
+  for (int i=0; i<trains.size(); i++) {
+
+    Train *trailing = trains[i];
+    Train *leading  = trains[(i+1) % trains.size()];
+
+    float gap = leading->getPos() - trailing->getPos();
+    if (i == trains.size()-1)
+      gap += length;            // around the end of the loop
+
+    if (gap < safetyDistance) {
+
+      trailing->setConflict( true );
+      leading->setConflict( true );
+      nConflicts++;
+
+      // Hold the trailing train below the leading train's speed, by
+      // more the closer it is
+
+      if (blockBrakes) {
+        float limit = leading->getSpeed() * (gap > 0 ? gap : 0) / safetyDistance;
+        trailing->setSpeedLimit( limit );
+      }
+    }
+  }
+}
@@ -0,0 +1,85 @@
+// trains.h
+//
+// Several trains on one closed track, with block-section collision
+// detection.
+//
+// The trains are kept sorted by arc length position.  Trains only
+// change order at the wrap point of the loop or by colliding, so the
+// sort from the previous step is almost correct and an insertion sort
+// restores it in O(n).  Then each train is compared with the one ahead
+// of it (the last train with the first, around the loop): any pair
+// closer than the safety distance is in conflict.
+//
+// With block brakes on, the trailing train of a conflicting pair is
+// held to a speed that lets the gap open again.
+
+
+#ifndef TRAINS_H
+#define TRAINS_H
+
+#include "headers.h"
+#include "seq.h"
+#include "train.h"
+
+
+#define DEFAULT_SAFETY_DISTANCE 60 // arc length between trains below which they conflict
+
+
+class Trains {
+
+  Spline      *spline;
+  seq<Train*>  trains;          // sorted by increasing pos
+
+  float safetyDistance;
+  bool  blockBrakes;
+  int   nConflicts;
+
+  void sort();
+  void sweep();
+
+ public:
+
+  Trains( Spline *spl ) {
+    spline = spl;
+    safetyDistance = DEFAULT_SAFETY_DISTANCE;
+    blockBrakes = false;
+    nConflicts = 0;
+  }
+
+  ~Trains() {
+    for (int i=0; i<trains.size(); i++)
+      delete trains[i];
+  }
+
+  Train *add();
+  Train *add( float pos );
+
+  int count() {
+    return trains.size();
+  }
+
+  Train *operator[]( int i ) {
+    return trains[i];
+  }
+
+  void advance( float elapsedSeconds );
+
+  int conflicts() {
+    return nConflicts;
+  }
+
+  void setSafetyDistance( float d ) {
+    safetyDistance = d;
+  }
+
+  bool getBlockBrakes() {
+    return blockBrakes;
+  }
+
+  void setBlockBrakes( bool b ) {
+    blockBrakes = b;
+  }
+};
+
+
+#endif